@@ -18,6 +18,7 @@
 
 
 #include <stdlib.h>
+#include <math.h>
 #include <gdk/gdk.h>
 #ifdef HAVE_SPECTRE
 #include <libspectre/spectre.h>
@@ -25,6 +26,46 @@
 
 #include "cairo-device.h"
 
+/* 
+ * Grey glyphs are not separate surfaces: they are packed in shelves into
+ * shared atlas pages. A page is freed when the last glyph in it is, so
+ * whole pages are charged to the glyph budget, and mdvi drops the glyphs
+ * of a page together (see dvi_cairo_image_group).
+ * Glyphs only hold coverage (A8), the color is applied when drawing.
+ */
+#define DVI_ATLAS_SIZE 512
+
+/* glyph draws accumulated before compositing them */
+#define DVI_GLYPH_BATCH 256
+
+typedef struct {
+    cairo_surface_t *surface;
+    guchar *data;
+    gint stride;
+    glong size;     /* bytes of data */
+    gint refs;      /* glyphs in this page, +1 while we pack into it */
+    gint x;         /* free space in the current shelf */
+    gint y;         /* top of the current shelf */
+    gint shelf;     /* height of the current shelf */
+} DviCairoAtlas;
+
+typedef struct {
+    DviCairoAtlas *atlas;
+    cairo_surface_t *mask;  /* the glyph's rectangle in the atlas */
+    gint x;
+    gint y;
+    gint w;
+    gint h;
+    gint refs;
+} DviCairoImage;
+
+typedef struct {
+    DviCairoImage *image;
+    gint x;
+    gint y;
+    Ulong fg;
+} DviCairoGlyphDraw;
+
 typedef struct {
     cairo_t *cr;
 
@@ -37,8 +78,131 @@ typedef struct {
     Ulong fg;
     Ulong bg;
 
+    DviCairoGlyphDraw pending[DVI_GLYPH_BATCH];
+    gint npending;
 } DviCairoDevice;
 
+/* the page new glyphs go to, shared by all devices */
+static GMutex           atlas_mutex;
+static DviCairoAtlas   *atlas_current = NULL;
+
+static DviCairoAtlas *
+dvi_cairo_atlas_new (gint width, gint height)
+{
+    DviCairoAtlas *atlas;
+
+    atlas = g_new0 (DviCairoAtlas, 1);
+    atlas->stride = cairo_format_stride_for_width (CAIRO_FORMAT_A8, width);
+    atlas->data = g_malloc0 (atlas->stride * height);
+    atlas->surface = cairo_image_surface_create_for_data (atlas->data,
+                                                          CAIRO_FORMAT_A8,
+                                                          width, height,
+                                                          atlas->stride);
+    atlas->size = atlas->stride * height;
+    mdvi_add_image_memory (atlas->size);
+    return atlas;
+}
+
+static void
+dvi_cairo_atlas_unref (DviCairoAtlas *atlas)
+{
+    if (g_atomic_int_dec_and_test (&atlas->refs)) {
+        mdvi_add_image_memory (-atlas->size);
+        cairo_surface_destroy (atlas->surface);
+        g_free (atlas->data);
+        g_free (atlas);
+    }
+}
+
+static DviCairoImage *
+dvi_cairo_atlas_alloc (gint width, gint height)
+{
+    DviCairoImage *image;
+    DviCairoAtlas *atlas;
+
+    image = g_new0 (DviCairoImage, 1);
+    image->w = width;
+    image->h = height;
+    image->refs = 1;
+
+    g_mutex_lock (&atlas_mutex);
+    if (width > DVI_ATLAS_SIZE || height > DVI_ATLAS_SIZE) {
+        /* too big to share */
+        atlas = dvi_cairo_atlas_new (MAX (width, 1), MAX (height, 1));
+    } else {
+        atlas = atlas_current;
+        if (atlas && atlas->x + width > DVI_ATLAS_SIZE) {
+            /* start a new shelf */
+            atlas->y += atlas->shelf;
+            atlas->x = 0;
+            atlas->shelf = 0;
+        }
+        if (atlas == NULL || atlas->y + height > DVI_ATLAS_SIZE) {
+            if (atlas)
+                dvi_cairo_atlas_unref (atlas);
+            atlas = dvi_cairo_atlas_new (DVI_ATLAS_SIZE, DVI_ATLAS_SIZE);
+            atlas->refs = 1;
+            atlas_current = atlas;
+        }
+        image->x = atlas->x;
+        image->y = atlas->y;
+        atlas->x += width;
+        atlas->shelf = MAX (atlas->shelf, height);
+    }
+    g_atomic_int_inc (&atlas->refs);
+    image->atlas = atlas;
+    g_mutex_unlock (&atlas_mutex);
+
+    image->mask = cairo_surface_create_for_rectangle (atlas->surface,
+                                                      image->x, image->y,
+                                                      width, height);
+
+    return image;
+}
+
+static void
+dvi_cairo_image_unref (DviCairoImage *image)
+{
+    if (g_atomic_int_dec_and_test (&image->refs)) {
+        cairo_surface_destroy (image->mask);
+        dvi_cairo_atlas_unref (image->atlas);
+        g_free (image);
+    }
+}
+
+/* composite the glyphs drawn so far, through their masks */
+static void
+dvi_cairo_flush_glyphs (DviCairoDevice *cairo_device)
+{
+    Ulong            color = 0;
+    gint             i;
+
+    if (cairo_device->npending == 0)
+        return;
+
+    cairo_save (cairo_device->cr);
+    cairo_scale (cairo_device->cr, cairo_device->xscale, cairo_device->yscale);
+    for (i = 0; i < cairo_device->npending; i++) {
+        DviCairoGlyphDraw *draw = &cairo_device->pending[i];
+
+        if (i == 0 || draw->fg != color) {
+            color = draw->fg;
+            cairo_set_source_rgb (cairo_device->cr,
+                          ((color >> 16) & 0xff) / 255.,
+                          ((color >> 8) & 0xff) / 255.,
+                          ((color >> 0) & 0xff) / 255.);
+        }
+        cairo_mask_surface (cairo_device->cr, draw->image->mask,
+                            draw->x, draw->y);
+    }
+    cairo_restore (cairo_device->cr);
+
+    /* the glyphs may be evicted from the font cache now */
+    for (i = 0; i < cairo_device->npending; i++)
+        dvi_cairo_image_unref (cairo_device->pending[i].image);
+    cairo_device->npending = 0;
+}
+
 static void
 dvi_cairo_draw_glyph (DviContext  *dvi,
               DviFontChar *ch,
@@ -50,6 +214,7 @@ dvi_cairo_draw_glyph (DviContext  *dvi,
     gboolean         isbox;
     DviGlyph        *glyph;
     cairo_surface_t *surface;
+    DviCairoGlyphDraw *draw;
 
     cairo_device = (DviCairoDevice *) dvi->device.device_data;
 
@@ -70,23 +235,27 @@ dvi_cairo_draw_glyph (DviContext  *dvi,
         || y + h > cairo_image_surface_get_height (surface))
         return;
 
-    cairo_save (cairo_device->cr);
-    cairo_scale (cairo_device->cr, cairo_device->xscale, cairo_device->yscale);
     if (isbox) {
+        dvi_cairo_flush_glyphs (cairo_device);
+        cairo_save (cairo_device->cr);
+        cairo_scale (cairo_device->cr, cairo_device->xscale, cairo_device->yscale);
         cairo_rectangle (cairo_device->cr,
                  x - cairo_device->xmargin,
                  y - cairo_device->ymargin,
                  w, h);
         cairo_stroke (cairo_device->cr);
-    } else {
-        cairo_translate (cairo_device->cr, x, y);
-        cairo_set_source_surface (cairo_device->cr,
-                      (cairo_surface_t *) glyph->data,
-                      0, 0);
-        cairo_paint (cairo_device->cr);
+        cairo_restore (cairo_device->cr);
+        return;
     }
 
-    cairo_restore (cairo_device->cr);
+    if (cairo_device->npending == DVI_GLYPH_BATCH)
+        dvi_cairo_flush_glyphs (cairo_device);
+    draw = &cairo_device->pending[cairo_device->npending++];
+    draw->image = (DviCairoImage *) glyph->data;
+    draw->x = x;
+    draw->y = y;
+    draw->fg = cairo_device->fg;
+    g_atomic_int_inc (&draw->image->refs);
 }
 
 static void
@@ -101,6 +270,7 @@ dvi_cairo_draw_rule (DviContext *dvi,
     Ulong           color;
 
     cairo_device = (DviCairoDevice *) dvi->device.device_data;
+    dvi_cairo_flush_glyphs (cairo_device);
 
     color = cairo_device->fg;
     
@@ -145,6 +315,7 @@ dvi_cairo_draw_ps (DviContext *dvi,
     cairo_surface_t      *image;
 
     cairo_device = (DviCairoDevice *) dvi->device.device_data;
+    dvi_cairo_flush_glyphs (cairo_device);
 
     psdoc = spectre_document_new ();
     spectre_document_load (psdoc, filename);
@@ -203,26 +374,16 @@ dvi_cairo_alloc_colors (void  *device_data,
             int    density)
 {
     double  frac;
-    GdkColor color, color_fg;
     int     i, n;
-    unsigned int alpha;
-
-    color_fg.red = (fg >> 16) & 0xff;
-    color_fg.green = (fg >> 8) & 0xff;
-    color_fg.blue = (fg >> 0) & 0xff;
 
+    /* glyphs are coverage masks, the colors are applied when drawing */
     n = npixels - 1;
     for (i = 0; i < npixels; i++) {
         frac = (gamma > 0) ?
             pow ((double)i / n, 1 / gamma) :
             1 - pow ((double)(n - i) / n, -gamma);
         
-        color.red = frac * color_fg.red;
-        color.green = frac * color_fg.green;
-        color.blue = frac * color_fg.blue;
-        alpha = frac * 0xFF;
-
-        pixels[i] = (alpha << 24) + (color.red << 16) + (color.green << 8) + color.blue;
+        pixels[i] = frac * 0xFF;
     }
 
     return npixels;
@@ -234,36 +395,56 @@ dvi_cairo_create_image (void *device_data,
             Uint  height,
             Uint  bpp)
 {
-    return cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+    return dvi_cairo_atlas_alloc (width, height);
 }
 
 static void
 dvi_cairo_free_image (void *ptr)
 {
-    cairo_surface_destroy ((cairo_surface_t *)ptr);
+    dvi_cairo_image_unref ((DviCairoImage *)ptr);
 }
 
 static void
-dvi_cairo_put_pixel (void *image, int x, int y, Ulong color)
+dvi_cairo_ref_image (void *ptr)
 {
-    cairo_surface_t *surface;
-    gint             rowstride;
-    guint32         *p;
+    g_atomic_int_inc (&((DviCairoImage *)ptr)->refs);
+}
+
+static void *
+dvi_cairo_image_group (void *ptr)
+{
+    return ((DviCairoImage *)ptr)->atlas;
+}
+
+/* the atlas data is ours, cairo keeps nothing derived from it */
+static void
+dvi_cairo_put_pixel (void *ptr, int x, int y, Ulong color)
+{
+    DviCairoImage *image;
+
+    image = (DviCairoImage *) ptr;
+
+    image->atlas->data[(image->y + y) * image->atlas->stride + image->x + x] =
+        (guchar) color;
+}
 
-    surface = (cairo_surface_t *) image;
+static void
+dvi_cairo_put_row (void *ptr, int y, const Ulong *colors, int n)
+{
+    DviCairoImage *image;
+    guchar        *p;
+    int            x;
 
-    rowstride = cairo_image_surface_get_stride (surface);
-    p = (guint32*) (cairo_image_surface_get_data (surface) + y * rowstride + x * 4);
+    image = (DviCairoImage *) ptr;
 
-        /* per cairo docs, must flush before modifying outside of cairo */
-        cairo_surface_flush(surface);
-    *p = color;
+    p = image->atlas->data + (image->y + y) * image->atlas->stride + image->x;
+    for (x = 0; x < n; x++)
+        p[x] = (guchar) colors[x];
 }
 
 static void
 dvi_cairo_image_done (void *ptr)
 {
-        cairo_surface_mark_dirty((cairo_surface_t *)ptr);
 }
 
 static void
@@ -286,7 +467,10 @@ mdvi_cairo_device_init (DviDevice *device)
     device->alloc_colors = dvi_cairo_alloc_colors;
     device->create_image = dvi_cairo_create_image;
     device->free_image = dvi_cairo_free_image;
+    device->ref_image = dvi_cairo_ref_image;
+    device->image_group = dvi_cairo_image_group;
     device->put_pixel = dvi_cairo_put_pixel;
+    device->put_row = dvi_cairo_put_row;
         device->image_done = dvi_cairo_image_done;
     device->set_color = dvi_cairo_set_color;
 #ifdef HAVE_SPECTRE
@@ -295,6 +479,7 @@ mdvi_cairo_device_init (DviDevice *device)
     device->draw_ps = NULL;
 #endif
     device->refresh = NULL;
+    device->flags = MDVI_DEVICE_ALPHA;
 }
 
 void
@@ -304,6 +489,8 @@ mdvi_cairo_device_free (DviDevice *device)
 
     cairo_device = (DviCairoDevice *) device->device_data;
 
+    while (cairo_device->npending > 0)
+        dvi_cairo_image_unref (cairo_device->pending[--cairo_device->npending].image);
     g_free (cairo_device);
 }
 
@@ -321,6 +508,7 @@ void
 mdvi_cairo_device_render (DviContext* dvi, cairo_t *cairo)
 {
     DviCairoDevice  *cairo_device;
+    gdouble          x1, y1, x2, y2;
 
     cairo_device = (DviCairoDevice *) dvi->device.device_data;
 
@@ -329,7 +517,21 @@ mdvi_cairo_device_render (DviContext* dvi, cairo_t *cairo)
     cairo_set_source_rgb (cairo_device->cr, 1., 1., 1.);
     cairo_paint (cairo_device->cr);
 
+    /* only what shows through the clip, in page pixels, is drawn */
+    cairo_clip_extents (cairo, &x1, &y1, &x2, &y2);
+    x1 = CLAMP (x1 / cairo_device->xscale - cairo_device->xmargin,
+                -G_MAXINT / 2, G_MAXINT / 2);
+    y1 = CLAMP (y1 / cairo_device->yscale - cairo_device->ymargin,
+                -G_MAXINT / 2, G_MAXINT / 2);
+    x2 = CLAMP (x2 / cairo_device->xscale - cairo_device->xmargin,
+                -G_MAXINT / 2, G_MAXINT / 2);
+    y2 = CLAMP (y2 / cairo_device->yscale - cairo_device->ymargin,
+                -G_MAXINT / 2, G_MAXINT / 2);
+    mdvi_set_clip (dvi, floor (x1), floor (y1),
+                   ceil (x2) - floor (x1), ceil (y2) - floor (y1));
+
     mdvi_dopage (dvi, dvi->currpage);
+    dvi_cairo_flush_glyphs (cairo_device);
 }
 
 void
@@ -33,7 +33,7 @@ PLUGINDIR = ${LIBDIR}/zathura
 endif
 
 INCS = ${CAIRO_INC} ${ZATHURA_INC} ${GIRARA_INC}
-LIBS = ${GIRARA_LIB} ${CAIRO_LIB} -lkpathsea
+LIBS = ${GIRARA_LIB} ${CAIRO_LIB} -lkpathsea -lpthread
 
 # flags
 CFLAGS += -std=c99 -fPIC -pedantic -Wall -Wno-format-zero-length $(INCS)
@@ -44,6 +44,15 @@ DFLAGS ?= -g
 # build with cairo support?
 WITH_CAIRO ?= 1
 
+# memory for rendered pages, in MiB (0 keeps none)
+PAGE_CACHE_SIZE ?= 64
+
+# keep glyphs on disk between sessions? (under $XDG_CACHE_HOME/zathura-dvi)
+GLYPH_CACHE ?= 1
+
+# remember font lookups between sessions? (in the same directory)
+LOOKUP_CACHE ?= 1
+
 # compiler
 CC ?= gcc
 LD ?= ld
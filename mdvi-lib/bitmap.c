@@ -19,6 +19,8 @@
 /* Bitmap manipulation routines */
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "mdvi.h"
 #include "color.h"
@@ -748,55 +750,106 @@ void    bitmap_transform(BITMAP *map, DviOrientation orient)
 #endif
 
 /*
- * Count the number of non-zero bits in a box of dimensions w x h, starting
- * at column `step' in row `data'.
- * 
- * Shamelessly stolen from xdvi.
+ * Sample a band of `rows' rows of a glyph `w' columns wide, for a whole
+ * row of the shrunk glyph at once: counts[k] is set to the number of
+ * non-zero bits in box k, where the first box is `first' columns wide and
+ * the others `hs' columns (the last one is clipped). At most `n' boxes
+ * are sampled, and the number of boxes is returned.
+ *
+ * The counting is done a word at a time. On x86 we pick, at runtime, a
+ * version that uses the hardware popcount instruction.
  */
-static int do_sample(BmUnit *data, int stride, int step, int w, int h)
-{
-    BmUnit    *ptr, *end, *cp;
-    int    shift, n;
-    int    bits_left;
-    int    wid;
-    
-    ptr = data + step / BITMAP_BITS;
-    end = bm_offset(data, h * stride);
-    shift = FIRSTSHIFTAT(step);
-    bits_left = w;
-    n = 0;
-    while(bits_left) {
-#ifndef WORD_BIG_ENDIAN
-        wid = BITMAP_BITS - shift;
-#else
-        wid = shift;
-#endif
-        if(wid > bits_left)
-            wid = bits_left;
-        if(wid > 8)
-            wid = 8;
+typedef int (*SampleRow) __PROTO((BmUnit *, int, int, int, int, int, int *, int));
+
 #ifdef WORD_BIG_ENDIAN
-        shift -= wid;
+#define UNIT_BITS(u, s, n)    (((u) >> (BITMAP_BITS - (s) - (n))) & bit_masks[n])
+#else
+#define UNIT_BITS(u, s, n)    (((u) >> (s)) & bit_masks[n])
 #endif
-        for(cp = ptr; cp < end; cp = bm_offset(cp, stride))
-            n += sample_count[(*cp >> shift) & bit_masks[wid]];
-#ifndef WORD_BIG_ENDIAN
-        shift += wid;
+
+#define TABLE_COUNT(u)    \
+    (sample_count[(u) & 0xff] + sample_count[((u) >> 8) & 0xff] + \
+     sample_count[((u) >> 16) & 0xff] + sample_count[((u) >> 24) & 0xff])
+
+#define SAMPLE_ROW_BODY(COUNT) \
+    BmUnit    *row, *ptr; \
+    int    r, k, start, cols, left, shift, wid, count; \
+    \
+    for(k = 0; k < n; k++) \
+        counts[k] = 0; \
+    for(r = 0, row = data; r < rows; r++, row = bm_offset(row, stride)) { \
+        cols = first; \
+        for(k = 0, start = 0; start < w && k < n; k++, start += cols, cols = hs) { \
+            left = Min(cols, w - start); \
+            ptr = row + start / BITMAP_BITS; \
+            shift = start % BITMAP_BITS; \
+            count = 0; \
+            while(left > 0) { \
+                wid = Min(BITMAP_BITS - shift, left); \
+                count += COUNT(UNIT_BITS(*ptr, shift, wid)); \
+                left -= wid; \
+                shift = 0; \
+                ptr++; \
+            } \
+            counts[k] += count; \
+        } \
+    } \
+    return k
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAMPLE_ROW_DISPATCH
 #endif
-#ifdef WORD_BIG_ENDIAN
-        if(shift == 0) {
-            shift = BITMAP_BITS;
-            ptr++;
-        }
+
+#if defined(__GNUC__) && !defined(SAMPLE_ROW_DISPATCH)
+/* let the compiler pick the best popcount for the target */
+static int sample_row_generic(BmUnit *data, int stride, int rows, int w,
+    int first, int hs, int *counts, int n)
+{
+    SAMPLE_ROW_BODY(__builtin_popcount);
+}
 #else
-        if(shift == BITMAP_BITS) {
-            shift = 0;
-            ptr++;
-        }
+static int sample_row_generic(BmUnit *data, int stride, int rows, int w,
+    int first, int hs, int *counts, int n)
+{
+    SAMPLE_ROW_BODY(TABLE_COUNT);
+}
+#endif
+
+#ifdef SAMPLE_ROW_DISPATCH
+__attribute__((target("popcnt")))
+static int sample_row_popcnt(BmUnit *data, int stride, int rows, int w,
+    int first, int hs, int *counts, int n)
+{
+    SAMPLE_ROW_BODY(__builtin_popcount);
+}
 #endif
-        bits_left -= wid;
+
+static SampleRow sample_row = sample_row_generic;
+static pthread_once_t sample_row_once = PTHREAD_ONCE_INIT;
+
+static void select_sample_row(void)
+{
+#ifdef SAMPLE_ROW_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("popcnt")) {
+        DEBUG((DBG_BITMAPS, "using hardware popcount for shrinking\n"));
+        sample_row = sample_row_popcnt;
     }
-    return n;
+#endif
+}
+
+static void frac_geometry __PROTO((DviGlyph *, double, double,
+    DviGlyph *, double *, double *));
+
+/* 
+ * Get the shrinking factors. Returns nonzero if they are not whole numbers,
+ * in which case the glyph has to be sampled through its integral image.
+ */
+static int get_shrink(DviContext *dvi, double *hs, double *vs)
+{
+    *hs = MDVI_HSHRINK(&dvi->params);
+    *vs = MDVI_VSHRINK(&dvi->params);
+    return (*hs != floor(*hs) || *vs != floor(*vs));
 }
 
 void    mdvi_shrink_box(DviContext *dvi, DviFont *font, 
@@ -805,10 +858,16 @@ void    mdvi_shrink_box(DviContext *dvi, DviFont *font,
     int    x, y, z;
     DviGlyph *glyph;
     int    hs, vs;
+    double    fhs, fvs, left, top;
     
-    hs = dvi->params.hshrink;
-    vs = dvi->params.vshrink;
     glyph = &pk->glyph;
+    if(get_shrink(dvi, &fhs, &fvs)) {
+        frac_geometry(glyph, fhs, fvs, dest, &left, &top);
+        dest->data = MDVI_GLYPH_EMPTY;
+        return;
+    }
+    hs = (int)fhs;
+    vs = (int)fvs;
     
     x = (int)glyph->x / hs;
     if((int)glyph->x - x * hs > 0)
@@ -832,20 +891,26 @@ void    mdvi_shrink_glyph(DviContext *dvi, DviFont *font,
     DviFontChar *pk, DviGlyph *dest)
 {
     int    rows_left, rows, init_cols;
-    int    cols_left, cols;
+    int    cols;
     BmUnit    *old_ptr, *new_ptr;
     BITMAP    *oldmap, *newmap;
     BmUnit    m, *cp;
     DviGlyph *glyph;
-    int    sample, min_sample;
+    int    *counts, n;
+    int    min_sample;
     int    old_stride;
     int    new_stride;
     int    x, y;
     int    w, h;
     int    hs, vs;
+    double    fhs, fvs;
     
-    hs = dvi->params.hshrink;
-    vs = dvi->params.vshrink;
+    if(get_shrink(dvi, &fhs, &fvs)) {
+        mdvi_shrink_glyph_frac(dvi, font, pk, dest, fhs, fvs);
+        return;
+    }
+    hs = (int)fhs;
+    vs = (int)fvs;
     
     min_sample = vs * hs * dvi->params.density / 100;
 
@@ -882,34 +947,31 @@ void    mdvi_shrink_glyph(DviContext *dvi, DviFont *font,
     new_ptr = newmap->data;
     new_stride = newmap->stride;
     rows_left = glyph->h;
+    counts = xnalloc(int, w);
+    pthread_once(&sample_row_once, select_sample_row);
 
     while(rows_left) {
         if(rows > rows_left)
             rows = rows_left;
-        cols_left = glyph->w;
         m = FIRSTMASK;
         cp = new_ptr;
-        cols = init_cols;
-        while(cols_left > 0) {
-            if(cols > cols_left)
-                cols = cols_left;
-            sample = do_sample(old_ptr, old_stride,
-                glyph->w - cols_left, cols, rows);
-            if(sample >= min_sample)
+        n = sample_row(old_ptr, old_stride, rows, glyph->w,
+            init_cols, hs, counts, w);
+        for(x = 0; x < n; x++) {
+            if(counts[x] >= min_sample)
                 *cp |= m;
             if(m == LASTMASK) {
                 m = FIRSTMASK;
                 cp++;
             } else
                 NEXTMASK(m);
-            cols_left -= cols;
-            cols = hs;
         }
         new_ptr = bm_offset(new_ptr, new_stride);
         old_ptr = bm_offset(old_ptr, rows * old_stride);
         rows_left -= rows;
         rows = vs;
     }    
+    mdvi_free(counts);
     DEBUG((DBG_BITMAPS, "shrink_glyph: (%dw,%dh,%dx,%dy) -> (%dw,%dh,%dx,%dy)\n",
         glyph->w, glyph->h, glyph->x, glyph->y,
         dest->w, dest->h, dest->x, dest->y));
@@ -917,28 +979,74 @@ void    mdvi_shrink_glyph(DviContext *dvi, DviFont *font,
         bitmap_print(stderr, newmap);
 }
 
-void    mdvi_shrink_glyph_grey(DviContext *dvi, DviFont *font,
-    DviFontChar *pk, DviGlyph *dest)
+static void put_row(DviDevice *dev, void *image, int y, Ulong *row, int w)
+{
+    int    x;
+
+    if(dev->put_row)
+        dev->put_row(image, y, row, w);
+    else for(x = 0; x < w; x++)
+        dev->put_pixel(image, x, y, row[x]);
+}
+
+/* 
+ * Turn coverage values (0 to 255, one per pixel) into a grey glyph for
+ * the device. `dest' must have the glyph's geometry already. Returns -1 if 
+ * the device can't make images.
+ */
+int    mdvi_grey_glyph(DviContext *dvi, DviFontChar *pk, DviGlyph *dest,
+    const Uchar *cov)
+{
+    DviDevice *dev;
+    void    *image;
+    Ulong    *pixels;
+    Ulong    *row;
+    int    x, y, i;
+
+    dev = &dvi->device;
+    image = dev->create_image(dev->device_data, dest->w, dest->h, BITMAP_BITS);
+    if(image == NULL)
+        return -1;
+
+    /* save these colors */
+    pk->fg = MDVI_GLYPHFG(dvi);
+    pk->bg = MDVI_GLYPHBG(dvi);
+
+    pixels = xnalloc(Ulong, MDVI_GREY_LEVELS);
+    if(get_color_table(dev, pixels, MDVI_GREY_LEVELS, pk->fg, pk->bg,
+            dvi->params.gamma, dvi->params.density) < 0) {
+        for(i = 0; i < MDVI_GREY_LEVELS; i++)
+            pixels[i] = (i < MDVI_GREY_LEVELS / 2) ? pk->fg : pk->bg;
+    }
+    dest->data = image;
+
+    /* we build each row, and hand it to the device in one go */
+    row = xnalloc(Ulong, dest->w);
+    for(y = 0; y < dest->h; y++) {
+        for(x = 0; x < dest->w; x++)
+            row[x] = pixels[*cov++];
+        put_row(dev, image, y, row, dest->w);
+    }
+    dev->image_done(image);
+    mdvi_free(row);
+    mdvi_free(pixels);
+    return 0;
+}
+
+/* how much of each shrunk pixel is covered, by whole shrinking factors */
+static Uchar *grey_coverage(DviFontChar *pk, int hs, int vs, DviGlyph *dest)
 {
     int    rows_left, rows;
-    int    cols_left, cols, init_cols;
-    long    sampleval, samplemax;
+    int    cols, init_cols;
+    int    *counts, n;
+    int    samplemax;
     BmUnit    *old_ptr;
-    void    *image;
+    Uchar    *cov, *ptr;
     int    w, h;
     int    x, y;
     DviGlyph *glyph;
     BITMAP     *map;
-    Ulong    *pixels;
-    int    npixels;
-    Ulong    colortab[2];
-    int    hs, vs;
-    DviDevice *dev;
 
-    hs = dvi->params.hshrink;
-    vs = dvi->params.vshrink;
-    dev = &dvi->device;
-    
     glyph = &pk->glyph;
     map = (BITMAP *)glyph->data;
     
@@ -959,76 +1067,242 @@ void    mdvi_shrink_glyph_grey(DviContext *dvi, DviFont *font,
     }
     h = y + ROUND((int)glyph->h - cols, vs) + 1;
     ASSERT(w && h);
-    
-    /* before touching anything, do this */
-    image = dev->create_image(dev->device_data, w, h, BITMAP_BITS);
-    if(image == NULL) {
-        mdvi_shrink_glyph(dvi, font, pk, dest);
-        return;
-    }
-    
-    /* save these colors */
-    pk->fg = MDVI_CURRFG(dvi);
-    pk->bg = MDVI_CURRBG(dvi);
-    
-    samplemax = vs * hs;
-    npixels = samplemax + 1;
-    pixels = get_color_table(&dvi->device, npixels, pk->fg, pk->bg,
-            dvi->params.gamma, dvi->params.density);
-    if(pixels == NULL) {
-        npixels = 2;
-        colortab[0] = pk->fg;
-        colortab[1] = pk->bg;
-        pixels = &colortab[0];
-    }
-    
-    /* setup the new glyph */
-    dest->data = image;
+
     dest->x = x;
     dest->y = glyph->y / vs;
     dest->w = w;
     dest->h = h;
 
+    cov = xnalloc(Uchar, w * h);
+    memset(cov, 0, w * h);
+    samplemax = vs * hs;
+    counts = xnalloc(int, w);
+    pthread_once(&sample_row_once, select_sample_row);
     y = 0;
     old_ptr = map->data;
     rows_left = glyph->h;
 
     while(rows_left && y < h) {
-        x = 0;
         if(rows > rows_left)
             rows = rows_left;
-        cols_left = glyph->w;
-        cols = init_cols;
-        while(cols_left && x < w) {
-            if(cols > cols_left)
-                cols = cols_left;
-            sampleval = do_sample(old_ptr, map->stride,
-                glyph->w - cols_left, cols, rows);
-            /* scale the sample value by the number of grey levels */
-            if(npixels - 1 != samplemax)
-                sampleval = ((npixels-1) * sampleval) / samplemax;
-            ASSERT(sampleval < npixels);
-            dev->put_pixel(image, x, y, pixels[sampleval]);
-            cols_left -= cols;
-            cols = hs;
-            x++;
-        }
-        for(; x < w; x++)
-            dev->put_pixel(image, x, y, pixels[0]);
+        n = sample_row(old_ptr, map->stride, rows, glyph->w,
+            init_cols, hs, counts, w);
+        ptr = cov + y * w;
+        for(x = 0; x < n; x++)
+            ptr[x] = (counts[x] * 255 + samplemax / 2) / samplemax;
         old_ptr = bm_offset(old_ptr, rows * map->stride);
         rows_left -= rows;
         rows = vs;
         y++;
     }
-    
-    for(; y < h; y++) {
-        for(x = 0; x < w; x++)
-            dev->put_pixel(image, x, y, pixels[0]);
-    }
+    mdvi_free(counts);
+    return cov;
+}
+
+void    mdvi_shrink_glyph_grey(DviContext *dvi, DviFont *font,
+    DviFontChar *pk, DviGlyph *dest)
+{
+    Uchar    *cov;
+    DviGlyph *glyph;
 
-        dev->image_done(image);
+    glyph = &pk->glyph;
+    cov = mdvi_glyph_coverage(dvi, pk, dest);
+    if(mdvi_grey_glyph(dvi, pk, dest, cov) < 0)
+        mdvi_shrink_glyph(dvi, font, pk, dest);
+    mdvi_free(cov);
     DEBUG((DBG_BITMAPS, "shrink_glyph_grey: (%dw,%dh,%dx,%dy) -> (%dw,%dh,%dx,%dy)\n",
         glyph->w, glyph->h, glyph->x, glyph->y,
         dest->w, dest->h, dest->x, dest->y));
 }
 
+
+/*
+ * Shrinking by arbitrary, not necessarily integer, factors. The glyph is
+ * expanded once into an integral image (a summed-area table), from which
+ * the number of bits set in any box comes in constant time. The glyph is
+ * constant over each of its pixels, so interpolating the table linearly
+ * gives the exact coverage of boxes with fractional edges too.
+ */
+
+typedef struct {
+    Uint    *sum;    /* sum[y * (w + 1) + x] = bits set in [0,x) x [0,y) */
+    int    w;
+    int    h;
+} GlyphIntegral;
+
+/* the number of output pixels needed for `n' input pixels */
+#define FRAC_CEIL(n)    ((int)ceil((n) - 1e-6))
+
+static void glyph_integral(BITMAP *map, GlyphIntegral *gi)
+{
+    BmUnit    *row, *unit, mask;
+    Uint    *prev, *curr, acc;
+    int    x, y;
+
+    gi->w = map->width;
+    gi->h = map->height;
+    gi->sum = xnalloc(Uint, (gi->w + 1) * (gi->h + 1));
+    memset(gi->sum, 0, (gi->w + 1) * sizeof(Uint));
+    row = map->data;
+    for(y = 0; y < gi->h; y++) {
+        prev = gi->sum + y * (gi->w + 1);
+        curr = prev + gi->w + 1;
+        curr[0] = 0;
+        acc = 0;
+        unit = row;
+        mask = FIRSTMASK;
+        for(x = 0; x < gi->w; x++) {
+            if(*unit & mask)
+                acc++;
+            curr[x + 1] = prev[x + 1] + acc;
+            if(mask == LASTMASK) {
+                mask = FIRSTMASK;
+                unit++;
+            } else
+                NEXTMASK(mask);
+        }
+        row = bm_offset(row, map->stride);
+    }
+}
+
+/* bits set in [0,x) x [0,y), for real x and y */
+static double integral_at(GlyphIntegral *gi, double x, double y)
+{
+    Uint    *r0, *r1;
+    double    fx, fy;
+    int    ix, iy;
+
+    if(x <= 0 || y <= 0 || gi->w == 0 || gi->h == 0)
+        return 0;
+    if(x > gi->w)
+        x = gi->w;
+    if(y > gi->h)
+        y = gi->h;
+    ix = Min((int)x, gi->w - 1);
+    iy = Min((int)y, gi->h - 1);
+    fx = x - ix;
+    fy = y - iy;
+    r0 = gi->sum + iy * (gi->w + 1);
+    r1 = r0 + gi->w + 1;
+    return (1 - fy) * ((1 - fx) * r0[ix] + fx * r0[ix + 1]) +
+        fy * ((1 - fx) * r1[ix] + fx * r1[ix + 1]);
+}
+
+static double box_sum(GlyphIntegral *gi, double x0, double y0, double x1, double y1)
+{
+    return integral_at(gi, x1, y1) - integral_at(gi, x0, y1) -
+        integral_at(gi, x1, y0) + integral_at(gi, x0, y0);
+}
+
+/* 
+ * Same layout as the integer shrinkers: box edges fall on the reference 
+ * point. (*left, *top) is where the first box starts in the glyph. 
+ */
+static void frac_geometry(DviGlyph *glyph, double hs, double vs, 
+    DviGlyph *dest, double *left, double *top)
+{
+    int    cols, rows;
+
+    cols = FRAC_CEIL(glyph->x / hs);
+    *left = glyph->x - cols * hs;
+    dest->x = cols;
+    dest->w = Max(cols + FRAC_CEIL(((int)glyph->w - glyph->x) / hs), 1);
+
+    rows = FRAC_CEIL((glyph->y + 1) / vs);
+    *top = glyph->y + 1 - rows * vs;
+    dest->y = rows - 1;
+    dest->h = Max(rows + FRAC_CEIL(((int)glyph->h - glyph->y - 1) / vs), 1);
+}
+
+void    mdvi_shrink_glyph_frac(DviContext *dvi, DviFont *font,
+    DviFontChar *pk, DviGlyph *dest, double hs, double vs)
+{
+    DviGlyph *glyph;
+    GlyphIntegral gi;
+    BITMAP    *newmap;
+    BmUnit    *ptr, m;
+    double    left, top, min_sample;
+    int    x, y;
+
+    glyph = &pk->glyph;
+    frac_geometry(glyph, hs, vs, dest, &left, &top);
+    min_sample = hs * vs * dvi->params.density / 100;
+
+    newmap = bitmap_alloc(dest->w, dest->h);
+    dest->data = newmap;
+    glyph_integral((BITMAP *)glyph->data, &gi);
+    for(y = 0; y < dest->h; y++) {
+        ptr = bm_offset(newmap->data, y * newmap->stride);
+        m = FIRSTMASK;
+        for(x = 0; x < dest->w; x++) {
+            if(box_sum(&gi, left + x * hs, top + y * vs, 
+                   left + (x + 1) * hs, top + (y + 1) * vs) >= min_sample)
+                *ptr |= m;
+            if(m == LASTMASK) {
+                m = FIRSTMASK;
+                ptr++;
+            } else
+                NEXTMASK(m);
+        }
+    }
+    mdvi_free(gi.sum);
+    DEBUG((DBG_BITMAPS, "shrink_glyph_frac: (%dw,%dh,%dx,%dy) -> (%dw,%dh,%dx,%dy)\n",
+        glyph->w, glyph->h, glyph->x, glyph->y,
+        dest->w, dest->h, dest->x, dest->y));
+}
+
+/* same as grey_coverage(), for any shrinking factors */
+static Uchar *frac_coverage(DviFontChar *pk, double hs, double vs, DviGlyph *dest)
+{
+    DviGlyph *glyph;
+    GlyphIntegral gi;
+    Uchar    *cov;
+    double    left, top, area;
+    int    x, y, level;
+
+    glyph = &pk->glyph;
+    frac_geometry(glyph, hs, vs, dest, &left, &top);
+    cov = xnalloc(Uchar, dest->w * dest->h);
+
+    glyph_integral((BITMAP *)glyph->data, &gi);
+    area = hs * vs;
+    for(y = 0; y < dest->h; y++) {
+        for(x = 0; x < dest->w; x++) {
+            level = (int)(255 * box_sum(&gi, 
+                left + x * hs, top + y * vs,
+                left + (x + 1) * hs, top + (y + 1) * vs) / area + 0.5);
+            cov[y * dest->w + x] = Max(0, Min(level, 255));
+        }
+    }
+    mdvi_free(gi.sum);
+    return cov;
+}
+
+void    mdvi_shrink_glyph_grey_frac(DviContext *dvi, DviFont *font,
+    DviFontChar *pk, DviGlyph *dest, double hs, double vs)
+{
+    DviGlyph *glyph;
+    Uchar    *cov;
+
+    glyph = &pk->glyph;
+    cov = frac_coverage(pk, hs, vs, dest);
+    if(mdvi_grey_glyph(dvi, pk, dest, cov) < 0)
+        mdvi_shrink_glyph_frac(dvi, font, pk, dest, hs, vs);
+    mdvi_free(cov);
+    DEBUG((DBG_BITMAPS, "shrink_glyph_grey_frac: (%dw,%dh,%dx,%dy) -> (%dw,%dh,%dx,%dy)\n",
+        glyph->w, glyph->h, glyph->x, glyph->y,
+        dest->w, dest->h, dest->x, dest->y));
+}
+
+/* 
+ * The coverage of the glyph shrunk by the current factors, as a new array
+ * of dest->w * dest->h values, which mdvi_grey_glyph() turns into an image.
+ */
+Uchar    *mdvi_glyph_coverage(DviContext *dvi, DviFontChar *pk, DviGlyph *dest)
+{
+    double    fhs, fvs;
+
+    if(get_shrink(dvi, &fhs, &fvs))
+        return frac_coverage(pk, fhs, fvs, dest);
+    return grey_coverage(pk, (int)fhs, (int)fvs, dest);
+}
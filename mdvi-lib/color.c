@@ -16,6 +16,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <string.h>
+#include <pthread.h>
+
 #include "mdvi.h"
 #include "color.h"
 
@@ -33,19 +36,24 @@ typedef struct {
 #define CCSIZE        256
 static ColorCache    color_cache[CCSIZE];
 static int        cc_entries;
+static pthread_mutex_t    cc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define GAMMA_DIFF    0.005
 
 
-/* create a color table */
-Ulong    *get_color_table(DviDevice *dev, 
+/* 
+ * fill `pixels' with a color table. The table is copied out of the 
+ * cache, since another thread may evict the entry once we let go.
+ */
+int    get_color_table(DviDevice *dev, Ulong *pixels,
              int nlevels, Ulong fg, Ulong bg, double gamma, int density)
 {
     ColorCache    *cc, *tofree;
     int        lohits;
-    Ulong        *pixels;
+    Ulong        *table;
     int        status;
 
+    pthread_mutex_lock(&cc_mutex);
     lohits = color_cache[0].hits;
     tofree = &color_cache[0];
     /* look in the cache and see if we have one that matches this request */
@@ -61,7 +69,9 @@ Ulong    *get_color_table(DviDevice *dev,
 
     if(cc < &color_cache[cc_entries]) {
         cc->hits++;
-        return cc->pixels;
+        memcpy(pixels, cc->pixels, nlevels * sizeof(Ulong));
+        pthread_mutex_unlock(&cc_mutex);
+        return 0;
     }
 
     DEBUG((DBG_DEVICE, "Adding color table to cache (fg=%lu, bg=%lu, n=%d)\n",
@@ -73,21 +83,29 @@ Ulong    *get_color_table(DviDevice *dev,
         cc->pixels = NULL;
     } else {
         cc = tofree;
-        mdvi_free(cc->pixels);
+        if(cc->pixels)
+            mdvi_free(cc->pixels);
     }
-    pixels = xnalloc(Ulong, nlevels);
+    table = xnalloc(Ulong, nlevels);
     status = dev->alloc_colors(dev->device_data, 
-        pixels, nlevels, fg, bg, gamma, density);
+        table, nlevels, fg, bg, gamma, density);
     if(status < 0) {
-        mdvi_free(pixels);
-        return NULL;
+        mdvi_free(table);
+        /* don't leave a freed table behind */
+        cc->pixels = NULL;
+        cc->nlevels = 0;
+        cc->hits = 0;
+        pthread_mutex_unlock(&cc_mutex);
+        return -1;
     }
     cc->fg = fg;
     cc->bg = bg;
     cc->gamma = gamma;
     cc->density = density;
     cc->nlevels = nlevels;
-    cc->pixels = pixels;
+    cc->pixels = table;
     cc->hits = 1;
-    return pixels;    
+    memcpy(pixels, table, nlevels * sizeof(Ulong));
+    pthread_mutex_unlock(&cc_mutex);
+    return 0;
 }
@@ -23,7 +23,7 @@
 #include "common.h"
 #include "mdvi.h"
 
-extern Ulong    *get_color_table(DviDevice *dev,
+extern int    get_color_table(DviDevice *dev, Ulong *pixels,
                  int nlevels, Ulong fg, Ulong bg, double gamma, int density);
 
 extern void mdvi_set_color __PROTO((DviContext *, Ulong, Ulong));
@@ -53,6 +53,15 @@
 /* default gamma correction */
 #define MDVI_DEFAULT_GAMMA    1.0
 
+/* scaled versions of each glyph kept for other shrinking factors/colors */
+#define MDVI_GLYPH_VARIANTS    4
+
+/* memory (in bytes) glyphs may take before some are dropped, 0 = no limit */
+#define MDVI_GLYPH_BUDGET    (64 << 20)
+
+/* grey levels glyphs are made with, and kept in the glyph cache */
+#define MDVI_GREY_LEVELS    256
+
 /* default window geometry */
 #define MDVI_GEOMETRY    NULL
 
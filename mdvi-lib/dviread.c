@@ -16,14 +16,20 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+/* for fmemopen() */
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "mdvi.h"
 #include "private.h"
@@ -127,7 +133,17 @@ static const DviCommand dvi_commands[] = {
 
 #define DVI_BUFLEN    4096
 
-static int    mdvi_run_macro(DviContext *dvi, Uchar *macro, size_t len);
+static int    mdvi_run_macro(DviContext *dvi, DviFont *font, Uchar *macro, size_t len);
+static int    run_commands(DviContext *dvi);
+static DviDisplayList *vf_get_code(DviFont *font, int code);
+static void    vf_play(DviContext *dvi, DviDisplayList *code);
+static int    replay_page(DviContext *dvi, DviDisplayList *dl, Uchar *visible);
+static DviDisplayList *compile_page(DviContext *dvi, int pageno);
+static void    dlist_index(DviContext *dvi, DviDisplayList *dl);
+static Uchar    *clip_page(DviContext *dvi, DviDisplayList *dl);
+static void    preload_glyphs(DviContext *dvi, DviDisplayList *dl, Uchar *visible);
+static int    push_state(DviContext *dvi);
+static int    pop_state(DviContext *dvi);
 
 static void dummy_draw_glyph(DviContext *dvi, DviFontChar *ch, int x, int y)
 {
@@ -167,6 +183,232 @@ static void dummy_dev_set_color(void *a, Ulong b, Ulong c)
 {
 }
 
+static void set_dummy_device(DviDevice *dev)
+{
+    dev->draw_glyph   = dummy_draw_glyph;
+    dev->draw_rule    = dummy_draw_rule;
+    dev->alloc_colors = dummy_alloc_colors;
+    dev->create_image = dummy_create_image;
+    dev->free_image   = dummy_free_image;
+    dev->ref_image    = NULL;
+    dev->image_group  = NULL;
+    dev->dev_destroy  = dummy_dev_destroy;
+    dev->put_pixel    = dummy_dev_putpixel;
+    dev->put_row      = NULL;
+    dev->refresh      = dummy_dev_refresh;
+    dev->set_color    = dummy_dev_set_color;
+    dev->flags        = 0;
+    dev->device_data  = NULL;
+}
+
+/*
+ * Display lists. The first time a page is interpreted, we record what it
+ * does, in DVI units, with fonts already resolved and virtual font macros
+ * already expanded. Later renderings of the page, at any shrink factor,
+ * replay the list instead of reading and decoding the file again.
+ */
+
+typedef enum {
+    DL_SETCHAR,    /* a = code, data = font */
+    DL_PUTCHAR,    /* same, but don't move */
+    DL_ADVANCE,    /* a = width of a virtual character */
+    DL_SETRULE,    /* a = height, b = width */
+    DL_PUTRULE,    /* same, but don't move */
+    DL_RIGHT,    /* a = amount */
+    DL_DOWN,    /* a = amount */
+    DL_PUSH,
+    DL_POP,
+    DL_ENTER,    /* start of a virtual font macro */
+    DL_LEAVE,    /* end of a virtual font macro */
+    DL_SPECIAL    /* data = special string */
+} DviDisplayOpType;
+
+#define DL_DRAWS(t)    ((t) == DL_SETCHAR || (t) == DL_PUTCHAR || \
+             (t) == DL_SETRULE || (t) == DL_PUTRULE)
+
+typedef struct {
+    Uchar    type;
+    Int32    a;
+    union {
+        Int32    b;
+        void    *data;
+    } u;
+} DviDisplayOp;
+
+/* 
+ * Where the ops that draw something fall on the page, so that a clipped
+ * page only draws those that may show (see mdvi_set_clip). It's a coarse
+ * grid over the bounding box of the page, in DVI units.
+ */
+#define DL_GRID        32
+
+typedef struct {
+    Int32    h0, v0, h1, v1;
+    int    op;        /* index in the list */
+} DviOpBox;
+
+typedef struct {
+    Int32    h0, v0;        /* top left corner of the grid */
+    Int32    cellw, cellh;
+    DviOpBox *boxes;
+    int    *starts;    /* where each cell starts in `cells' */
+    int    *cells;        /* boxes in each cell */
+    int    firstspecial;    /* first and last specials that may draw */
+    int    lastspecial;
+} DviPageIndex;
+
+/* 
+ * Checkpoints: the interpreter's state every DL_CHECKPOINT ops, taken
+ * the first time the page is drawn whole, so that a clipped page can
+ * start from the last one before what shows. Pixel positions depend on
+ * the parameters, so they only serve while those don't change.
+ */
+#define DL_CHECKPOINT    256
+
+typedef struct {
+    int    op;        /* the op it was taken before */
+    DviState pos;
+    int    depth;
+    int    layer;
+    int    stacktop;
+    int    stackpos;    /* where its stack starts in `stack' */
+    Ulong    fg;
+    Ulong    bg;
+    int    color_top;
+    int    colorpos;    /* where its colors start in `colors' */
+} DviCheckpoint;
+
+typedef struct {
+    /* what they were taken with */
+    double    conv;
+    double    vconv;
+    int    hdrift;
+    int    vdrift;
+    int    thinsp;
+    int    vsmallsp;
+    DviCheckpoint *points;
+    int    count;
+    int    size;
+    DviState *stack;
+    int    nstack;
+    int    stacksize;
+    DviColorPair *colors;
+    int    ncolors;
+    int    colorsize;
+} DviCheckpoints;
+
+struct _DviDisplayList {
+    DviDisplayOp *ops;
+    int    count;
+    int    size;
+    DviPageIndex *index;    /* NULL if the page can't be clipped */
+    DviCheckpoints *checkpoints; /* under checkpoint_lock */
+};
+
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct _DviPageCache {
+    pthread_mutex_t lock;
+    int    npages;
+    DviDisplayList **pages;
+};
+
+static DviDisplayOp *dlist_add(DviDisplayList *dl, int type, Int32 a)
+{
+    DviDisplayOp *op;
+
+    if(dl->count == dl->size) {
+        dl->size = dl->size ? 2 * dl->size : 256;
+        dl->ops = xresize(dl->ops, DviDisplayOp, dl->size);
+    }
+    op = &dl->ops[dl->count++];
+    op->type = type;
+    op->a = a;
+    op->u.data = NULL;
+    return op;
+}
+
+static void checkpoints_free(DviCheckpoints *cps)
+{
+    if(cps->points)
+        mdvi_free(cps->points);
+    if(cps->stack)
+        mdvi_free(cps->stack);
+    if(cps->colors)
+        mdvi_free(cps->colors);
+    mdvi_free(cps);
+}
+
+static void dlist_free(DviDisplayList *dl)
+{
+    int    i;
+
+    for(i = 0; i < dl->count; i++) {
+        if(dl->ops[i].type == DL_SPECIAL)
+            mdvi_free(dl->ops[i].u.data);
+    }
+    if(dl->ops)
+        mdvi_free(dl->ops);
+    if(dl->index) {
+        mdvi_free(dl->index->boxes);
+        mdvi_free(dl->index->starts);
+        mdvi_free(dl->index->cells);
+        mdvi_free(dl->index);
+    }
+    if(dl->checkpoints)
+        checkpoints_free(dl->checkpoints);
+    mdvi_free(dl);
+}
+
+static DviPageCache *pagecache_new(int npages)
+{
+    DviPageCache *cache;
+
+    cache = xalloc(DviPageCache);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->npages = npages;
+    cache->pages = xnalloc(DviDisplayList *, npages);
+    memset(cache->pages, 0, npages * sizeof(DviDisplayList *));
+    return cache;
+}
+
+static void pagecache_free(DviPageCache *cache)
+{
+    int    i;
+
+    for(i = 0; i < cache->npages; i++) {
+        if(cache->pages[i])
+            dlist_free(cache->pages[i]);
+    }
+    mdvi_free(cache->pages);
+    pthread_mutex_destroy(&cache->lock);
+    mdvi_free(cache);
+}
+
+/* lists are never modified once they are in the cache, but for checkpoints */
+static DviDisplayList *pagecache_get(DviPageCache *cache, int pageno)
+{
+    DviDisplayList *dl;
+
+    pthread_mutex_lock(&cache->lock);
+    dl = cache->pages[pageno];
+    pthread_mutex_unlock(&cache->lock);
+    return dl;
+}
+
+static void pagecache_put(DviPageCache *cache, int pageno, DviDisplayList *dl)
+{
+    pthread_mutex_lock(&cache->lock);
+    /* another context may have compiled this page meanwhile */
+    if(cache->pages[pageno] == NULL) {
+        cache->pages[pageno] = dl;
+        dl = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if(dl)
+        dlist_free(dl);
+}
+
 /* functions to report errors */
 static void dvierr(DviContext *dvi, const char *format, ...)
 {
@@ -291,9 +533,76 @@ static long dugetn(DviContext *dvi, size_t n)
 
 static long dtell(DviContext *dvi)
 {
-    return dvi->depth ? 
-        dvi->buffer.pos : 
-        ftell(dvi->in) - dvi->buffer.length + dvi->buffer.pos;
+    if(dvi->depth)
+        return dvi->buffer.pos;
+    if(dvi->map)
+        return dvi->buffer.data - dvi->map + dvi->buffer.pos;
+    return ftell(dvi->in) - dvi->buffer.length + dvi->buffer.pos;
+}
+
+/* 
+ * Read the whole file into memory. The file is checked again afterwards
+ * against `st', taken when it was opened, so we don't keep a file that TeX
+ * was still writing: returns -1 if it changed, or does not end like a DVI file.
+ */
+static int copy_file(DviContext *dvi, struct stat *st)
+{
+    struct stat now;
+    Uchar    *data;
+    size_t    done;
+
+    data = mdvi_malloc(st->st_size);
+    fseek(dvi->in, 0L, SEEK_SET);
+    done = fread(data, 1, st->st_size, dvi->in);
+    if(done < (size_t)st->st_size || fstat(fileno(dvi->in), &now) < 0 ||
+       now.st_size != st->st_size || now.st_mtime != st->st_mtime ||
+       data[done - 1] != DVI_TRAILER) {
+        DEBUG((DBG_FILES, "%s: changed while we read it\n", dvi->filename));
+        mdvi_free(data);
+        return -1;
+    }
+    dvi->map = data;
+    dvi->maplen = done;
+    dvi->mapcopy = 1;
+    DEBUG((DBG_FILES, "%s: read %lu bytes\n",
+        dvi->filename, (Ulong)dvi->maplen));
+    return 0;
+}
+
+/* map the whole file, so that pages can be read in place */
+static int map_file(DviContext *dvi, struct stat *st)
+{
+    void    *map;
+
+    if(st->st_size == 0)
+        return -1;
+    if(MDVI_ENABLED(dvi, MDVI_PARAM_COPYFILE))
+        return copy_file(dvi, st);
+    map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, 
+           fileno(dvi->in), 0);
+    if(map == MAP_FAILED) {
+        DEBUG((DBG_FILES, "%s: mmap failed (%s), using stdio\n",
+            dvi->filename, strerror(errno)));
+        return 0;
+    }
+    dvi->map = (Uchar *)map;
+    dvi->maplen = st->st_size;
+    dvi->mapcopy = 0;
+    DEBUG((DBG_FILES, "%s: mapped %lu bytes\n",
+        dvi->filename, (Ulong)dvi->maplen));
+    return 0;
+}
+
+static void unmap_file(DviContext *dvi)
+{
+    if(dvi->map == NULL)
+        return;
+    if(dvi->mapcopy)
+        mdvi_free(dvi->map);
+    else
+        munmap(dvi->map, dvi->maplen);
+    dvi->map = NULL;
+    dvi->maplen = 0;
 }
 
 static void dreset(DviContext *dvi)
@@ -337,6 +646,194 @@ static void dviprint(DviContext *dvi, const char *command, int sub, const char *
 #define SHOWCMD(x)    do { } while(0)
 #endif
 
+/* 
+ * Color specials can span page breaks, so the colors a page starts with
+ * depend on the pages before it. They are found once, by running the
+ * color specials of every page in file order, and each page starts with
+ * its own, whichever context draws it and whatever it drew before.
+ */
+typedef struct {
+    long    offset;        /* of the page's BOP */
+    Ulong    fg;
+    Ulong    bg;
+    int    color_top;
+    int    colorpos;    /* where its stack starts in `colors' */
+} DviPageColor;
+
+struct _DviPageColors {
+    DviPageColor *pages;    /* in file order */
+    int    npages;
+    DviColorPair *colors;
+    int    ncolors;
+    int    colorsize;
+};
+
+static void pagecolors_free(DviPageColors *pc)
+{
+    if(pc->colors)
+        mdvi_free(pc->colors);
+    mdvi_free(pc->pages);
+    mdvi_free(pc);
+}
+
+/* skip the arguments of anything but a special; -1 on bad opcodes */
+static int scan_skip(DviContext *dvi, int op)
+{
+    long    n;
+
+    if(op <= DVI_SET_CHAR_MAX || op == DVI_NOOP || op == DVI_PUSH ||
+       op == DVI_POP || op == DVI_W0 || op == DVI_X0 || op == DVI_Y0 ||
+       op == DVI_Z0 || (op >= DVI_FNT_NUM0 && op <= DVI_FNT_NUM_MAX))
+        return 0;
+    if(op == DVI_SET_RULE || op == DVI_PUT_RULE)
+        n = 8;
+    else if(op >= DVI_SET1 && op <= DVI_SET4)
+        n = op - DVI_SET1 + 1;
+    else if(op >= DVI_PUT1 && op <= DVI_PUT4)
+        n = op - DVI_PUT1 + 1;
+    else if(op >= DVI_RIGHT1 && op <= DVI_RIGHT4)
+        n = op - DVI_RIGHT1 + 1;
+    else if(op >= DVI_W1 && op <= DVI_W4)
+        n = op - DVI_W1 + 1;
+    else if(op >= DVI_X1 && op <= DVI_X4)
+        n = op - DVI_X1 + 1;
+    else if(op >= DVI_DOWN1 && op <= DVI_DOWN4)
+        n = op - DVI_DOWN1 + 1;
+    else if(op >= DVI_Y1 && op <= DVI_Y4)
+        n = op - DVI_Y1 + 1;
+    else if(op >= DVI_Z1 && op <= DVI_Z4)
+        n = op - DVI_Z1 + 1;
+    else if(op >= DVI_FNT1 && op <= DVI_FNT4)
+        n = op - DVI_FNT1 + 1;
+    else if(op >= DVI_FNT_DEF1 && op <= DVI_FNT_DEF4) {
+        /* id, checksum, scale, design size, then the name */
+        if(dskip(dvi, op - DVI_FNT_DEF1 + 1 + 12) < 0)
+            return -1;
+        n = duget1(dvi);
+        n += duget1(dvi);
+        if(n == 0)
+            return 0;
+    } else
+        return -1;
+    return dskip(dvi, n);
+}
+
+/* run the color specials of one page */
+static int scan_page(DviContext *dvi, long offset)
+{
+    char    *s, *p;
+    long    len;
+    int    op;
+
+    dreset(dvi);
+    if(fseek(dvi->in, offset + 45, SEEK_SET) < 0)
+        return -1;
+    while((op = duget1(dvi)) != DVI_EOP) {
+        if(op < DVI_XXX1 || op > DVI_XXX4) {
+            if(op < 0 || scan_skip(dvi, op) < 0)
+                return -1;
+            continue;
+        }
+        len = dugetn(dvi, op - DVI_XXX1 + 1);
+        if(len <= 0)
+            return -1;
+        s = mdvi_malloc(len + 1);
+        if(dread(dvi, s, len) < 0) {
+            mdvi_free(s);
+            return -1;
+        }
+        s[len] = 0;
+        for(p = s; *p == ' '; p++)
+            ;
+        if(STRNCEQ(p, "color", 5))
+            mdvi_do_special(dvi, s);
+        mdvi_free(s);
+    }
+    return 0;
+}
+
+/* `offsets' are the BOPs of all pages, selected or not, in file order */
+static int scan_page_colors(DviContext *dvi, long *offsets, int count)
+{
+    DviPageColors *pc;
+    DviPageColor *page;
+    int    i;
+
+    pc = xalloc(DviPageColors);
+    pc->pages = xnalloc(DviPageColor, count);
+    pc->npages = count;
+    pc->colors = NULL;
+    pc->ncolors = 0;
+    pc->colorsize = 0;
+    dvi->pagecolors = pc;
+    for(i = 0; i < count; i++) {
+        page = &pc->pages[i];
+        page->offset = offsets[i];
+        page->fg = dvi->curr_fg;
+        page->bg = dvi->curr_bg;
+        page->color_top = dvi->color_top;
+        page->colorpos = pc->ncolors;
+        if(pc->ncolors + dvi->color_top > pc->colorsize) {
+            pc->colorsize = 2 * (pc->ncolors + dvi->color_top);
+            pc->colors = mdvi_realloc(pc->colors,
+                pc->colorsize * sizeof(DviColorPair));
+        }
+        memcpy(pc->colors + pc->ncolors, dvi->color_stack,
+            dvi->color_top * sizeof(DviColorPair));
+        pc->ncolors += dvi->color_top;
+        if(scan_page(dvi, page->offset) < 0) {
+            dreset(dvi);
+            return -1;
+        }
+    }
+    dreset(dvi);
+    /* drawing starts over from these */
+    dvi->curr_fg = dvi->params.fg;
+    dvi->curr_bg = dvi->params.bg;
+    dvi->color_top = 0;
+    return 0;
+}
+
+/* start a page with the colors it starts with in the file */
+static void restore_page_colors(DviContext *dvi, int pageno)
+{
+    DviPageColors *pc = dvi->pagecolors;
+    DviPageColor *page = NULL;
+    long    offset = dvi->pagemap[pageno][0];
+    int    lo, hi, mid;
+
+    for(lo = 0, hi = pc ? pc->npages - 1 : -1; lo <= hi; ) {
+        mid = (lo + hi) / 2;
+        if(pc->pages[mid].offset == offset) {
+            page = &pc->pages[mid];
+            break;
+        } else if(pc->pages[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    if(page == NULL) {
+        dvi->curr_fg = dvi->params.fg;
+        dvi->curr_bg = dvi->params.bg;
+        dvi->color_top = 0;
+    } else {
+        if(page->color_top > dvi->color_size) {
+            dvi->color_size = page->color_top + 32;
+            dvi->color_stack = mdvi_realloc(dvi->color_stack,
+                dvi->color_size * sizeof(DviColorPair));
+        }
+        memcpy(dvi->color_stack, pc->colors + page->colorpos,
+            page->color_top * sizeof(DviColorPair));
+        dvi->color_top = page->color_top;
+        dvi->curr_fg = page->fg;
+        dvi->curr_bg = page->bg;
+    }
+    /* the device may still have the colors of another page */
+    if(dvi->device.set_color)
+        dvi->device.set_color(dvi->device.device_data, 
+            dvi->curr_fg, dvi->curr_bg);
+}
+
 int    mdvi_find_tex_page(DviContext *dvi, int tex_page)
 {
     int    i;
@@ -463,26 +960,237 @@ static char *opendvi(const char *name)
     return NULL;
 }
 
-int    mdvi_reload(DviContext *dvi, DviParams *np)
+/*
+ * When the file is rewritten, most pages usually stay the same. Pages are
+ * matched by their counters and their bytes, and the fonts they select,
+ * so those that did not change keep their display lists, and clients can
+ * keep what they drew (see mdvi_page_origin).
+ */
+
+typedef struct {
+    Uint32    hash;
+    Uint32    length;
+    int    pageno;
+} PageHash;
+
+/* argument lengths of opcodes 128 to 255, -1 if variable, -2 if invalid */
+static const signed char page_arglen[128] = {
+    1, 2, 3, 4, 8, 1, 2, 3, 4, 8,    /* set, set_rule, put, put_rule */
+    0, 44, 0, 0, 0,            /* nop, bop, eop, push, pop */
+    1, 2, 3, 4,            /* right */
+    0, 1, 2, 3, 4,            /* w */
+    0, 1, 2, 3, 4,            /* x */
+    1, 2, 3, 4,            /* down */
+    0, 1, 2, 3, 4,            /* y */
+    0, 1, 2, 3, 4,            /* z */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,    /* fnt_num */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 2, 3, 4,            /* fnt */
+    -1, -1, -1, -1,            /* xxx */
+    -1, -1, -1, -1,            /* fnt_def */
+    -2, -2, -2, -2, -2, -2, -2, -2, -2    /* pre, post, post_post */
+};
+
+static Uint32 page_arg(const Uchar *p, int n)
+{
+    Uint32    v = 0;
+
+    while(n-- > 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+static Uint32 page_hash_bytes(Uint32 h, const void *data, size_t n)
+{
+    const Uchar *p = (const Uchar *)data;
+
+    /* FNV-1a */
+    while(n-- > 0)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+/* 
+ * Hash a page, from its BOP to its EOP, along with the fonts it selects.
+ * Returns -1 if the page can't be read from the mapped file.
+ */
+static int hash_page(DviContext *dvi, int pageno, PageHash *ph)
+{
+    const Uchar *start, *end, *p;
+    DviFontRef *ref;
+    Uint32    h = 2166136261U;
+    Int32    id;
+    int    op, n, k;
+
+    if(dvi->map == NULL || (size_t)dvi->pagemap[pageno][0] >= dvi->maplen)
+        return -1;
+    start = dvi->map + dvi->pagemap[pageno][0];
+    end = dvi->map + dvi->maplen;
+    if(*start != DVI_BOP)
+        return -1;
+    for(p = start; p < end && *p != DVI_EOP; p += n) {
+        op = *p++;
+        if(op < DVI_SET1)
+            n = 0;
+        else if((n = page_arglen[op - DVI_SET1]) == -2)
+            return -1;
+        else if(n == -1 && op < DVI_FNT_DEF1) {
+            k = op - DVI_XXX1 + 1;
+            if(end - p < k)
+                return -1;
+            n = k + page_arg(p, k);
+        } else if(n == -1) {
+            k = op - DVI_FNT_DEF1 + 1;
+            if(end - p < k + 14)
+                return -1;
+            n = k + 14 + p[k + 12] + p[k + 13];
+        }
+        if(n < 0 || end - p < n)
+            return -1;
+        /* the same bytes can mean other fonts now */
+        if(op >= DVI_FNT_NUM0 && op <= DVI_FNT4) {
+            if(op < DVI_FNT1)
+                id = op - DVI_FNT_NUM0;
+            else
+                id = (Int32)page_arg(p, op - DVI_FNT1 + 1);
+            if((ref = dvi->findref(dvi, id)) == NULL)
+                return -1;
+            h = page_hash_bytes(h, &ref->ref, sizeof(DviFont *));
+        }
+    }
+    if(p >= end)
+        return -1;
+    ph->length = p - start;
+    ph->hash = page_hash_bytes(h, start, ph->length);
+    ph->pageno = pageno;
+    return 0;
+}
+
+static int compare_hashes(const void *p1, const void *p2)
+{
+    const PageHash *a = (const PageHash *)p1;
+    const PageHash *b = (const PageHash *)p2;
+
+    if(a->hash != b->hash)
+        return (a->hash < b->hash ? -1 : 1);
+    return a->pageno - b->pageno;
+}
+
+static int same_page(DviContext *old, PageHash *a, DviContext *new, PageHash *b)
+{
+    return (a->hash == b->hash && a->length == b->length &&
+        memcmp(&old->pagemap[a->pageno][1], &new->pagemap[b->pageno][1],
+            10 * sizeof(long)) == 0 &&
+        memcmp(old->map + old->pagemap[a->pageno][0],
+            new->map + new->pagemap[b->pageno][0], a->length) == 0);
+}
+
+/* 
+ * Find the pages of `new' that are also in `old', and move their display
+ * lists over. Both contexts must hold their fonts.
+ */
+static int *match_pages(DviContext *old, DviContext *new)
+{
+    PageHash *hashes;
+    PageHash ph;
+    Uchar    *used;
+    int    *origin;
+    int    i, j, lo, hi, n, same;
+
+    origin = xnalloc(int, new->npages);
+    for(i = 0; i < new->npages; i++)
+        origin[i] = -1;
+    if(old->map == NULL || new->map == NULL)
+        return origin;
+
+    hashes = xnalloc(PageHash, old->npages + 1);
+    for(i = n = 0; i < old->npages; i++) {
+        if(hash_page(old, i, &hashes[n]) == 0)
+            n++;
+    }
+    qsort(hashes, n, sizeof(PageHash), compare_hashes);
+    used = xnalloc(Uchar, old->npages + 1);
+    memset(used, 0, old->npages + 1);
+
+    for(i = same = 0; i < new->npages; i++) {
+        if(hash_page(new, i, &ph) < 0)
+            continue;
+        /* find the first old page with this hash */
+        for(lo = 0, hi = n; lo < hi; ) {
+            j = (lo + hi) / 2;
+            if(hashes[j].hash < ph.hash)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        /* prefer a page that is not taken yet */
+        for(j = lo; j < n && hashes[j].hash == ph.hash; j++) {
+            if(!used[hashes[j].pageno] && same_page(old, &hashes[j], new, &ph))
+                break;
+        }
+        if(j == n || hashes[j].hash != ph.hash)
+            continue;
+        origin[i] = hashes[j].pageno;
+        used[origin[i]] = 1;
+        same++;
+        new->pagecache->pages[i] = old->pagecache->pages[origin[i]];
+        old->pagecache->pages[origin[i]] = NULL;
+    }
+    DEBUG((DBG_DVI, "%s: %d of %d pages did not change\n",
+        new->filename, same, new->npages));
+    mdvi_free(used);
+    mdvi_free(hashes);
+    return origin;
+}
+
+/* the page `pageno' was before the last reload, or -1 if it changed */
+int    mdvi_page_origin(DviContext *dvi, int pageno)
+{
+    if(dvi->pageorigin == NULL || pageno < 0 || pageno >= dvi->npages)
+        return -1;
+    return dvi->pageorigin[pageno];
+}
+
+/*
+ * Reloading takes two steps, so that the slow one can run on another 
+ * thread while `dvi' is still in use. mdvi_reload_prepare() reads the 
+ * file again into a context of its own, and mdvi_reload_finish() moves 
+ * that into `dvi'. A prepared context that is not wanted anymore can
+ * be destroyed with mdvi_destroy_context().
+ */
+DviContext *mdvi_reload_prepare(DviContext *dvi, DviParams *np)
 {
     DviContext *newdvi;
-    DviParams  *pars;
-    
-    /* close our file */
-    if(dvi->in) {
-        fclose(dvi->in);
-        dvi->in = NULL;
+
+    /* clones share their file data, only the original can reload it */
+    if(dvi->parent) {
+        mdvi_warning(_("%s: cannot reload a cloned context\n"), 
+                 dvi->filename);
+        return NULL;
     }
 
-    pars = np ? np : &dvi->params;
     DEBUG((DBG_DVI, "%s: reloading\n", dvi->filename));    
-    
-    /* load it again */
-    newdvi = mdvi_init_context(pars, dvi->pagesel, dvi->filename);
-    if(newdvi == NULL) {
+    newdvi = mdvi_init_context(np ? np : &dvi->params, 
+        dvi->pagesel, dvi->filename);
+    if(newdvi == NULL)
         mdvi_warning(_("could not reload `%s'\n"), dvi->filename);
-        return -1;
-    }
+    return newdvi;
+}
+
+/* no clones of `dvi' may exist while this is done */
+int    mdvi_reload_finish(DviContext *dvi, DviContext *newdvi)
+{
+    /* use the file we just read */
+    if(dvi->in)
+        fclose(dvi->in);
+    dvi->in = newdvi->in;
+
+    /* keep what we can, while both sets of fonts are held */
+    if(dvi->pageorigin)
+        mdvi_free(dvi->pageorigin);
+    dvi->pageorigin = match_pages(dvi, newdvi);
 
     /* drop all our font references */
     font_drop_chain(dvi->fonts);
@@ -494,6 +1202,7 @@ int    mdvi_reload(DviContext *dvi, DviParams *np)
     /* and use the ones we just loaded */
     dvi->fonts = newdvi->fonts;
     dvi->fontmap = newdvi->fontmap;
+    dvi->fontmask = newdvi->fontmask;
     dvi->nfonts = newdvi->nfonts;
 
     /* copy the new information */
@@ -514,6 +1223,16 @@ int    mdvi_reload(DviContext *dvi, DviParams *np)
     mdvi_free(dvi->pagemap);
     dvi->pagemap = newdvi->pagemap;
     dvi->npages = newdvi->npages;
+    if(dvi->pagecolors)
+        pagecolors_free(dvi->pagecolors);
+    dvi->pagecolors = newdvi->pagecolors;
+    /* the lists that were not moved over are out of date */
+    pagecache_free(dvi->pagecache);
+    dvi->pagecache = newdvi->pagecache;
+    unmap_file(dvi);
+    dvi->map = newdvi->map;
+    dvi->maplen = newdvi->maplen;
+    dvi->mapcopy = newdvi->mapcopy;
     if(dvi->currpage > dvi->npages-1)
         dvi->currpage = 0;
         
@@ -524,6 +1243,9 @@ int    mdvi_reload(DviContext *dvi, DviParams *np)
     /* remove fonts that are not being used anymore */
     font_free_unused(&dvi->device);
         
+    dreset(newdvi);
+    if(newdvi->color_stack)
+        mdvi_free(newdvi->color_stack);
     mdvi_free(newdvi->filename);        
     mdvi_free(newdvi);
 
@@ -534,6 +1256,16 @@ int    mdvi_reload(DviContext *dvi, DviParams *np)
     return 0;
 }
 
+int    mdvi_reload(DviContext *dvi, DviParams *np)
+{
+    DviContext *newdvi;
+
+    newdvi = mdvi_reload_prepare(dvi, np);
+    if(newdvi == NULL)
+        return -1;
+    return mdvi_reload_finish(dvi, newdvi);
+}
+
 /* function to change parameters ia DVI context 
  * The DVI context is modified ONLY if this function is successful */
 int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
@@ -561,17 +1293,28 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
         case MDVI_SET_YDPI:
             np.vdpi = va_arg(ap, Uint);
             break;
+        /* 
+         * glyphs keep scaled versions for several shrinking factors,
+         * colors and gammas (see font_get_glyph), so we need not reset
+         * them here
+         */
         case MDVI_SET_SHRINK:
             np.hshrink = np.vshrink = va_arg(ap, Uint);
-            reset_font = MDVI_FONTSEL_GREY|MDVI_FONTSEL_BITMAP;
             break;
         case MDVI_SET_XSHRINK:
             np.hshrink = va_arg(ap, Uint);
-            reset_font = MDVI_FONTSEL_GREY|MDVI_FONTSEL_BITMAP;
             break;
         case MDVI_SET_YSHRINK:
             np.vshrink = va_arg(ap, Uint);
-            reset_font = MDVI_FONTSEL_GREY|MDVI_FONTSEL_BITMAP;
+            break;
+        case MDVI_SET_SCALE:
+            np.hscale = np.vscale = va_arg(ap, double);
+            break;
+        case MDVI_SET_XSCALE:
+            np.hscale = va_arg(ap, double);
+            break;
+        case MDVI_SET_YSCALE:
+            np.vscale = va_arg(ap, double);
             break;
         case MDVI_SET_ORIENTATION:
             np.orientation = va_arg(ap, DviOrientation);
@@ -579,7 +1322,6 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
             break;
         case MDVI_SET_GAMMA:
             np.gamma = va_arg(ap, double);
-            reset_font = MDVI_FONTSEL_GREY;
             break;
         case MDVI_SET_DENSITY:
             np.density = va_arg(ap, Uint);
@@ -600,11 +1342,9 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
             break;
         case MDVI_SET_FOREGROUND:
             np.fg = va_arg(ap, Ulong);
-            reset_font = MDVI_FONTSEL_GREY;
             break;
         case MDVI_SET_BACKGROUND:
             np.bg = va_arg(ap, Ulong);
-            reset_font = MDVI_FONTSEL_GREY;
             break;
         default:
             break;
@@ -622,6 +1362,8 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
         return -1;
     if(np.hshrink < 1 || np.vshrink < 1)
         return -1;
+    if(np.hscale <= 0.0 || np.vscale <= 0.0)
+        return -1;
     if(np.hdrift < 0 || np.vdrift < 0)
         return -1;    
     if(np.fg == np.bg)
@@ -635,16 +1377,10 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
     if(reset_all)
         return (mdvi_reload(dvi, &np) == 0);
 
-    if(np.hshrink != dvi->params.hshrink) {
-        np.conv = dvi->dviconv;
-        if(np.hshrink)
-            np.conv /= np.hshrink;
-    }
-    if(np.vshrink != dvi->params.vshrink) {
-        np.vconv = dvi->dvivconv;
-        if(np.vshrink)
-            np.vconv /= np.vshrink;
-    }
+    if(np.hshrink != dvi->params.hshrink || np.hscale != dvi->params.hscale)
+        np.conv = dvi->dviconv / MDVI_HSHRINK(&np);
+    if(np.vshrink != dvi->params.vshrink || np.vscale != dvi->params.vscale)
+        np.vconv = dvi->dvivconv / MDVI_VSHRINK(&np);
 
     if(reset_font) {
         font_reset_chain_glyphs(&dvi->device, dvi->fonts, reset_font);
@@ -666,6 +1402,8 @@ int mdvi_configure(DviContext *dvi, DviParamCode option, ...)
 DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *file)
 {
     FILE    *p;
+    FILE    *in;
+    struct stat st;
     Int32    arg;
     int    op;
     long    offset;
@@ -673,6 +1411,7 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
     DviContext *dvi;
     char    *filename;
     int    pagecount;
+    long    *offsets = NULL;
 
     /*
      * 1. Open the file and initialize the DVI context
@@ -683,9 +1422,15 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
         perror(file);
         return NULL;
     }
-    p = fopen(filename, "rb");
-    if(p == NULL) {
+    in = fopen(filename, "rb");
+    if(in == NULL) {
+        perror(file);
+        mdvi_free(filename);
+        return NULL;
+    }
+    if(fstat(fileno(in), &st) < 0) {
         perror(file);
+        fclose(in);
         mdvi_free(filename);
         return NULL;
     }
@@ -694,10 +1439,31 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
     dvi->pagemap = NULL;
     dvi->filename = filename;
     dvi->stack = NULL;
-    dvi->modtime = get_mtime(fileno(p));    
+    dvi->modtime = (Ulong)st.st_mtime;
     dvi->buffer.data = NULL;
     dvi->pagesel = spec;
-    dvi->in = p; /* now we can use the dget*() functions */
+    dvi->params.flags = par->flags;
+    dvi->in = in; /* now we can use the dget*() functions */
+    p = in;
+
+    /*
+     * Map or copy the file before reading anything, and parse it from
+     * there: the page map must describe the bytes we render from, not
+     * whatever TeX has written to the file in the meantime.
+     */
+    if(MDVI_ENABLED(dvi, MDVI_PARAM_MAPFILE|MDVI_PARAM_COPYFILE)) {
+        if(map_file(dvi, &st) < 0) {
+            mdvi_warning(_("%s: file is being written, try again later\n"),
+                file);
+            goto error;
+        }
+        if(dvi->map && (p = fmemopen(dvi->map, dvi->maplen, "rb")) == NULL) {
+            DEBUG((DBG_FILES, "%s: fmemopen failed (%s)\n",
+                filename, strerror(errno)));
+            goto error;
+        }
+        dvi->in = p;
+    }
 
     /* 
      * 2. Read the preamble, extract scaling information, and 
@@ -729,6 +1495,8 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
     dvi->params.vdpi    = par->vdpi ? par->vdpi : par->dpi;
     dvi->params.hshrink = par->hshrink;
     dvi->params.vshrink = par->vshrink;
+    dvi->params.hscale  = par->hscale > 0 ? par->hscale : 1.0;
+    dvi->params.vscale  = par->vscale > 0 ? par->vscale : 1.0;
     dvi->params.density = par->density;
     dvi->params.gamma   = par->gamma;
     dvi->params.conv    = (double)dvi->num / dvi->den;
@@ -753,9 +1521,9 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
     dvi->dviconv = dvi->params.conv;
     dvi->dvivconv = dvi->params.vconv;
     if(dvi->params.hshrink)
-        dvi->params.conv /= dvi->params.hshrink;
+        dvi->params.conv /= MDVI_HSHRINK(&dvi->params);
     if(dvi->params.vshrink)
-        dvi->params.vconv /= dvi->params.vshrink;
+        dvi->params.vconv /= MDVI_VSHRINK(&dvi->params);
 
     /* get the comment from the preamble */
     n = fuget1(p);
@@ -839,6 +1607,7 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
 
     dvi->pagemap = xnalloc(PageNum, dvi->npages);
     memset(dvi->pagemap, 0, sizeof(PageNum) * dvi->npages);
+    offsets = xnalloc(long, dvi->npages);
         
     n = dvi->npages - 1;
     pagecount = n;
@@ -853,6 +1622,7 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
         for(i = 1; i <= 10; i++)
             page[i] = fsget4(p);
         page[0] = offset;
+        offsets[n] = offset;
         offset = fsget4(p);
         /* check if the page is selected */
         if(spec && mdvi_page_selected(spec, page, n) == 0) {
@@ -866,6 +1636,12 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
         n--;
     }
     pagecount++;
+    /* before unselected pages are dropped, their colors count too */
+    n = scan_page_colors(dvi, offsets, dvi->npages);
+    mdvi_free(offsets);
+    offsets = NULL;
+    if(n < 0)
+        goto bad_dvi;
     if(pagecount >= dvi->npages) {
         mdvi_error(_("no pages selected\n"));
         goto error;
@@ -884,17 +1660,14 @@ DviContext *mdvi_init_context(DviParams *par, DviPageSpec *spec, const char *fil
 
     dvi->curr_layer = 0;
     dvi->stack = xnalloc(DviState, dvi->stacksize + 8);
+    dvi->pagecache = pagecache_new(dvi->npages);
+    /* from now on pages are read from the map, or the file itself */
+    if(p != in) {
+        fclose(p);
+        dvi->in = in;
+    }
 
-    dvi->device.draw_glyph   = dummy_draw_glyph;
-    dvi->device.draw_rule    = dummy_draw_rule;
-    dvi->device.alloc_colors = dummy_alloc_colors;
-    dvi->device.create_image = dummy_create_image;
-    dvi->device.free_image   = dummy_free_image;
-    dvi->device.dev_destroy  = dummy_dev_destroy;
-    dvi->device.put_pixel    = dummy_dev_putpixel;
-    dvi->device.refresh      = dummy_dev_refresh;
-    dvi->device.set_color    = dummy_dev_set_color;
-    dvi->device.device_data  = NULL;
+    set_dummy_device(&dvi->device);
 
     DEBUG((DBG_DVI, "%s read successfully\n", filename));
     return dvi;
@@ -904,18 +1677,88 @@ bad_dvi:
 error:
     /* if we came from the font definitions, this will be non-trivial */
     dreset(dvi);
+    if(offsets)
+        mdvi_free(offsets);
+    if(p != NULL && p != in) {
+        fclose(p);
+        dvi->in = in;
+    }
     mdvi_destroy_context(dvi);
     return NULL;
 }
 
+/* 
+ * Make a context that shares the file data (page table, fonts, etc.) of
+ * `dvi', but has its own reading state, stack and device. Each clone
+ * can be used to render pages in a different thread. The clone must be 
+ * destroyed before `dvi' is destroyed or reloaded.
+ */
+DviContext *mdvi_clone_context(DviContext *dvi)
+{
+    DviContext *clone;
+
+    clone = xalloc(DviContext);
+    memcpy(clone, dvi, sizeof(DviContext));
+    /* the file is reopened when the first page is rendered, 
+     * unless we can read it from the parent's mapping */
+    clone->in = NULL;
+    clone->depth = 0;
+    clone->buffer.data = NULL;
+    clone->buffer.length = 0;
+    clone->buffer.pos = 0;
+    clone->buffer.frozen = 0;
+    clone->currfont = NULL;
+    clone->curr_layer = 0;
+    clone->stacktop = 0;
+    clone->stack = xnalloc(DviState, dvi->stacksize + 8);
+    clone->color_stack = NULL;
+    clone->color_top = 0;
+    clone->color_size = 0;
+    clone->user_data = NULL;
+    clone->parent = dvi;
+    clone->dlist = NULL;
+    set_dummy_device(&clone->device);
+
+    DEBUG((DBG_DVI, "%s: cloned context\n", dvi->filename));
+    return clone;
+}
+
+/* returns 1 if the file has been modified since we last read it */
+int    mdvi_file_changed(DviContext *dvi)
+{
+    int    fd;
+    Ulong    mtime;
+
+    fd = open(dvi->filename, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    mtime = get_mtime(fd);
+    close(fd);
+    return mtime > dvi->modtime;
+}
+
 void    mdvi_destroy_context(DviContext *dvi)
 {
     if(dvi->device.dev_destroy)
         dvi->device.dev_destroy(dvi->device.device_data);
-    /* release all fonts */
+    /* the file data belongs to the context we were cloned from */
+    if(dvi->parent) {
+        if(dvi->stack)
+            mdvi_free(dvi->stack);
+        if(dvi->in)
+            fclose(dvi->in);
+        if(dvi->buffer.data && !dvi->buffer.frozen)
+            mdvi_free(dvi->buffer.data);
+        if(dvi->color_stack)
+            mdvi_free(dvi->color_stack);
+        mdvi_free(dvi);
+        return;
+    }
+    /* release all fonts; the ones still in use save their glyphs now */
     if(dvi->fonts) {
         font_drop_chain(dvi->fonts);
         font_free_unused(&dvi->device);
+        font_flush_glyph_cache();
     }
     if(dvi->fontmap)
         mdvi_free(dvi->fontmap);
@@ -925,6 +1768,13 @@ void    mdvi_destroy_context(DviContext *dvi)
         mdvi_free(dvi->stack);
     if(dvi->pagemap)
         mdvi_free(dvi->pagemap);
+    if(dvi->pagecache)
+        pagecache_free(dvi->pagecache);
+    if(dvi->pageorigin)
+        mdvi_free(dvi->pageorigin);
+    if(dvi->pagecolors)
+        pagecolors_free(dvi->pagecolors);
+    unmap_file(dvi);
     if(dvi->fileid)
         mdvi_free(dvi->fileid);
     if(dvi->in)
@@ -946,16 +1796,19 @@ void    mdvi_setpage(DviContext *dvi, int pageno)
     dvi->currpage = pageno;
 }
 
-static int    mdvi_run_macro(DviContext *dvi, Uchar *macro, size_t len)
+static int    mdvi_run_macro(DviContext *dvi, DviFont *font, Uchar *macro, size_t len)
 {
     DviFontRef *curr, *fonts;
+    DviFont    *saved_font;
     DviBuffer saved_buffer;
     FILE    *saved_file;
     int    opcode;
     int    oldtop;
 
     dvi->depth++;    
-    push(dvi, DVI_PUSH);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_ENTER, 0);
+    push_state(dvi);
     dvi->pos.w = 0;
     dvi->pos.x = 0;
     dvi->pos.y = 0;
@@ -964,10 +1817,12 @@ static int    mdvi_run_macro(DviContext *dvi, Uchar *macro, size_t len)
     /* save our state */
     curr = dvi->currfont;
     fonts = dvi->fonts;
+    saved_font = dvi->macrofont;
     saved_buffer = dvi->buffer;
     saved_file = dvi->in;
-    dvi->currfont = curr->ref->subfonts;
-    dvi->fonts = curr->ref->subfonts;
+    dvi->currfont = font->subfonts;
+    dvi->fonts = font->subfonts;
+    dvi->macrofont = font;
     dvi->buffer.data = macro;
     dvi->buffer.pos = 0;
     dvi->buffer.length = len;
@@ -976,21 +1831,21 @@ static int    mdvi_run_macro(DviContext *dvi, Uchar *macro, size_t len)
     oldtop = dvi->stacktop;
 
     /* execute commands */
-    while((opcode = duget1(dvi)) != DVI_EOP) {
-        if(dvi_commands[opcode](dvi, opcode) < 0)
-            break;
-    }
+    opcode = run_commands(dvi);
     if(opcode != DVI_EOP)
         dviwarn(dvi, _("%s: vf macro had errors\n"), 
-            curr->ref->fontname);
+            font->fontname);
     if(dvi->stacktop != oldtop)
         dviwarn(dvi, _("%s: stack not empty after vf macro\n"),
-            curr->ref->fontname);
+            font->fontname);
 
     /* restore things */
-    pop(dvi, DVI_POP);
+    pop_state(dvi);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_LEAVE, 0);
     dvi->currfont = curr;
     dvi->fonts = fonts;
+    dvi->macrofont = saved_font;
     dvi->buffer = saved_buffer;
     dvi->in = saved_file;
     dvi->depth--;
@@ -1003,9 +1858,12 @@ int    mdvi_dopage(DviContext *dvi, int pageno)
     int    op;
     int    ppi;
     int    reloaded = 0;
+    DviDisplayList *dl;
+    Uchar    *visible;
 
 again:    
-    if(dvi->in == NULL) {
+    /* clones only need the file if it's not mapped */
+    if(dvi->in == NULL && !(dvi->parent && dvi->map)) {
         /* try reopening the file */
         dvi->in = fopen(dvi->filename, "rb");
         if(dvi->in == NULL) {
@@ -1017,8 +1875,8 @@ again:
         DEBUG((DBG_FILES, "reopen(%s) -> Ok\n", dvi->filename));
     }
     
-    /* check if we need to reload the file */
-    if(!reloaded && get_mtime(fileno(dvi->in)) > dvi->modtime) {
+    /* check if we need to reload the file (the owner of clones does that) */
+    if(!reloaded && !dvi->parent && get_mtime(fileno(dvi->in)) > dvi->modtime) {
         mdvi_reload(dvi, &dvi->params);
         /* we have to reopen the file, again */
         reloaded = 1;
@@ -1031,15 +1889,26 @@ again:
         return -1;
     }
     
-    fseek(dvi->in, (long)dvi->pagemap[pageno][0], SEEK_SET);
-    if((op = fuget1(dvi->in)) != DVI_BOP) {
-        mdvi_error(_("%s: bad offset at page %d\n"),
-               dvi->filename, pageno+1);
-        return -1;
-    }
+    /* if we have seen this page before, we don't need the file */
+    dl = pagecache_get(dvi->pagecache, pageno);
+    if(dl == NULL && dvi->map) {
+        if((size_t)dvi->pagemap[pageno][0] + 45 > dvi->maplen ||
+           dvi->map[dvi->pagemap[pageno][0]] != DVI_BOP) {
+            mdvi_error(_("%s: bad offset at page %d\n"),
+                   dvi->filename, pageno+1);
+            return -1;
+        }
+    } else if(dl == NULL) {
+        fseek(dvi->in, (long)dvi->pagemap[pageno][0], SEEK_SET);
+        if((op = fuget1(dvi->in)) != DVI_BOP) {
+            mdvi_error(_("%s: bad offset at page %d\n"),
+                   dvi->filename, pageno+1);
+            return -1;
+        }
     
-    /* skip bop */
-    fseek(dvi->in, (long)44, SEEK_CUR);
+        /* skip bop */
+        fseek(dvi->in, (long)44, SEEK_CUR);
+    }
 
     /* reset state */
     dvi->currfont = NULL;
@@ -1052,19 +1921,25 @@ again:
         mdvi_free(dvi->buffer.data);
 
     /* reset our buffer */
-    dvi->buffer.data   = NULL;
-    dvi->buffer.length = 0;
-    dvi->buffer.pos    = 0;
-    dvi->buffer.frozen = 0;
+    if(dvi->map) {
+        /* read the page in place, skipping the bop */
+        dvi->buffer.data   = dvi->map + dvi->pagemap[pageno][0] + 45;
+        dvi->buffer.length = dvi->maplen - dvi->pagemap[pageno][0] - 45;
+        dvi->buffer.pos    = 0;
+        dvi->buffer.frozen = 1;
+    } else {
+        dvi->buffer.data   = NULL;
+        dvi->buffer.length = 0;
+        dvi->buffer.pos    = 0;
+        dvi->buffer.frozen = 0;
+    }
 
-#if 0 /* make colors survive page breaks */
-    /* reset color stack */
-    mdvi_reset_color(dvi);
-#endif
+    /* colors survive page breaks, as they were in the file */
+    restore_page_colors(dvi, pageno);
         
     /* set max horizontal and vertical drift (from dvips) */
     if(dvi->params.hdrift < 0) {
-        ppi = dvi->params.dpi / dvi->params.hshrink; /* shrunk pixels per inch */
+        ppi = dvi->params.dpi / MDVI_HSHRINK(&dvi->params); /* shrunk pixels per inch */
         if(ppi < 600)
             dvi->params.hdrift = ppi / 100;
         else if(ppi < 1200)
@@ -1073,7 +1948,7 @@ again:
             dvi->params.hdrift = ppi / 400;
     }
     if(dvi->params.vdrift < 0) {
-        ppi = dvi->params.vdpi / dvi->params.vshrink; /* shrunk pixels per inch */
+        ppi = dvi->params.vdpi / MDVI_VSHRINK(&dvi->params); /* shrunk pixels per inch */
         if(ppi < 600)
             dvi->params.vdrift = ppi / 100;
         else if(ppi < 1200)
@@ -1085,11 +1960,34 @@ again:
     dvi->params.thinsp   = FROUND(0.025 * dvi->params.dpi / dvi->params.conv);
     dvi->params.vsmallsp = FROUND(0.025 * dvi->params.vdpi / dvi->params.vconv);
         
-    /* execute all the commands in the page */
-    while((op = duget1(dvi)) != DVI_EOP) {
-        if(dvi_commands[op](dvi, op) < 0)
-            break;
+    if(dl == NULL && MDVI_ENABLED(dvi, MDVI_PARAM_PRELOAD)) {
+        /* find out what the page needs before drawing any of it */
+        if((dl = compile_page(dvi, pageno)) == NULL)
+            return -1;
     }
+    if(dl) {
+        /* when clipped, only what may show is loaded and drawn */
+        visible = clip_page(dvi, dl);
+        if(MDVI_ENABLED(dvi, MDVI_PARAM_PRELOAD))
+            preload_glyphs(dvi, dl, visible);
+        op = replay_page(dvi, dl, visible);
+        if(visible)
+            mdvi_free(visible);
+    } else {
+        /* execute all the commands in the page, and remember them */
+        dvi->dlist = xalloc(DviDisplayList);
+        memset(dvi->dlist, 0, sizeof(DviDisplayList));
+        op = run_commands(dvi);
+        if(op == DVI_EOP) {
+            dlist_index(dvi, dvi->dlist);
+            pagecache_put(dvi->pagecache, pageno, dvi->dlist);
+        } else
+            dlist_free(dvi->dlist);
+        dvi->dlist = NULL;
+    }
+
+    /* we are not holding any glyphs now */
+    font_enforce_budget(&dvi->device);
     
     fflush(stdout);
     fflush(stderr);
@@ -1240,68 +2138,149 @@ static void draw_box(DviContext *dvi, DviFontChar *ch)
     draw_shrink_rule(dvi, dvi->pos.hh - x, dvi->pos.vv - y, w, h, 1);
 }
 
-int    set_char(DviContext *dvi, int opcode)
+static void char_advance(DviContext *dvi, Int32 tfmwidth)
 {
-    int    num;
-    int    h;
-    int    hh;
-    DviFontChar *ch;
-    DviFont    *font;
+    dvi->pos.h  += tfmwidth;
+    dvi->pos.hh += pixel_round(dvi, tfmwidth);
+    fix_after_horizontal(dvi);
+}
+
+/* move past a character that is not drawn */
+static void skip_char(DviContext *dvi, DviFont *font, int code)
+{
+    DviFontChar *ch;
+    Int32    tfmwidth;
+
+    font_lock(font);
+    ch = FONTCHAR(font, code);
+    if(!glyph_present(ch)) {
+        font_unlock(font);
+        return;
+    }
+    tfmwidth = ch->tfmwidth;
+    font_unlock(font);
+    char_advance(dvi, tfmwidth);
+}
+
+static int render_char(DviContext *dvi, DviFont *font, int num, int opcode)
+{
+    int    h;
+    int    hh;
+    int    macro;
+    int    grey;
+    Int32    tfmwidth;
+    DviFontChar *ch;
+    DviFontChar glyph;
+    DviDisplayList *code = NULL;
     
-    if(opcode < 128)
-        num = opcode;
+    /* 
+     * The glyph may be reset by other contexts sharing this font, so
+     * we work on a copy, and keep a reference on the image we draw.
+     * Devices that draw bitmaps read them from the font, which then
+     * stays locked until they are done.
+     */
+    font_lock(font);
+    if(dvi->compiling && !ISVIRTUAL(font))
+        /* the glyph is loaded when the page is drawn */
+        ch = font_get_char(dvi, font, num);
     else
-        num = dugetn(dvi, opcode - DVI_SET1 + 1);
-    if(dvi->currfont == NULL) {
-        dvierr(dvi, _("no default font set yet\n"));
-        return -1;
-    }
-    font = dvi->currfont->ref;
-    ch = font_get_glyph(dvi, font, num);
+        ch = font_get_glyph(dvi, font, num);
+    /* virtual characters are recorded as the macro they expand to */
+    macro = (ch && !ch->missing && ISVIRTUAL(font) &&
+         dvi->curr_layer <= dvi->params.layer);
+    if(dvi->dlist && !macro)
+        dlist_add(dvi->dlist, opcode >= DVI_PUT1 && opcode <= DVI_PUT4 ?
+              DL_PUTCHAR : DL_SETCHAR, num)->u.data = font;
     if(ch == NULL || ch->missing) {
         /* try to display something anyway */
         ch = FONTCHAR(font, num);
         if(!glyph_present(ch)) {
-            dviwarn(dvi, 
-            _("requested character %d does not exist in `%s'\n"), 
-                num, font->fontname);
+            font_unlock(font);
+            if(!dvi->compiling)
+                dviwarn(dvi, 
+                _("requested character %d does not exist in `%s'\n"), 
+                    num, font->fontname);
             return 0;
         }
         draw_box(dvi, ch);
+        tfmwidth = ch->tfmwidth;
+        font_unlock(font);
     } else if(dvi->curr_layer <= dvi->params.layer) {
+        glyph = *ch;
+        tfmwidth = ch->tfmwidth;
+        grey = (!ISVIRTUAL(font) && dvi->device.ref_image &&
+            glyph.grey.data && !MDVI_GLYPH_ISEMPTY(glyph.grey.data));
         if(ISVIRTUAL(font))
-            mdvi_run_macro(dvi, (Uchar *)font->private + 
-                ch->offset, ch->width);
-        else if(ch->width && ch->height)
-            dvi->device.draw_glyph(dvi, ch, 
+            code = vf_get_code(font, num);
+        if(grey)
+            dvi->device.ref_image(glyph.grey.data);
+        if(grey || ISVIRTUAL(font))
+            font_unlock(font);
+        if(code)
+            vf_play(dvi, code);
+        else if(ISVIRTUAL(font))
+            /* let the interpreter report what's wrong with it */
+            mdvi_run_macro(dvi, font, (Uchar *)font->private + 
+                glyph.offset, glyph.width);
+        else if(glyph.width && glyph.height) {
+            dvi->device.draw_glyph(dvi, &glyph, 
                 dvi->pos.hh, dvi->pos.vv);
+            /* drop our reference */
+            if(grey)
+                dvi->device.free_image(glyph.grey.data);
+        }
+        if(!grey && !ISVIRTUAL(font))
+            font_unlock(font);
+    } else {
+        tfmwidth = ch->tfmwidth;
+        font_unlock(font);
     }
     if(opcode >= DVI_PUT1 && opcode <= DVI_PUT4) {
         SHOWCMD((dvi, "putchar", opcode - DVI_PUT1 + 1,
             "char %d (%s)\n",
-            num, dvi->currfont->ref->fontname));
+            num, font->fontname));
     } else {
-        h = dvi->pos.h + ch->tfmwidth;
-        hh = dvi->pos.hh + pixel_round(dvi, ch->tfmwidth);
+        h = dvi->pos.h + tfmwidth;
+        hh = dvi->pos.hh + pixel_round(dvi, tfmwidth);
         SHOWCMD((dvi, "setchar", num, "(%d,%d) h:=%d%c%d=%d, hh:=%d (%s)\n",
             dvi->pos.hh, dvi->pos.vv,
-            DBGSUM(dvi->pos.h, ch->tfmwidth, h), hh,
+            DBGSUM(dvi->pos.h, tfmwidth, h), hh,
             font->fontname));
         dvi->pos.h  = h;
         dvi->pos.hh = hh;
         fix_after_horizontal(dvi);
+        if(macro && dvi->dlist)
+            dlist_add(dvi->dlist, DL_ADVANCE, tfmwidth);
     }
     
     return 0;
 }
 
-int    set_rule(DviContext *dvi, int opcode)
+int    set_char(DviContext *dvi, int opcode)
+{
+    int    num;
+    
+    if(opcode < 128)
+        num = opcode;
+    else if(opcode >= DVI_PUT1)
+        num = dugetn(dvi, opcode - DVI_PUT1 + 1);
+    else
+        num = dugetn(dvi, opcode - DVI_SET1 + 1);
+    if(dvi->currfont == NULL) {
+        dvierr(dvi, _("no default font set yet\n"));
+        return -1;
+    }
+    return render_char(dvi, dvi->currfont->ref, num, opcode);
+}
+
+static int render_rule(DviContext *dvi, Int32 a, Int32 b, int opcode)
 {
-    Int32    a, b;
     int    h, w;
     
-    a = dsget4(dvi);
-    b = dsget4(dvi); w = rule_round(dvi, b);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, opcode == DVI_SET_RULE ?
+              DL_SETRULE : DL_PUTRULE, a)->u.b = b;
+    w = rule_round(dvi, b);
     if(a > 0 && b > 0) {
         h = vrule_round(dvi, a); 
         SHOWCMD((dvi, opcode == DVI_SET_RULE ? "setrule" : "putrule", -1,
@@ -1326,13 +2305,22 @@ int    set_rule(DviContext *dvi, int opcode)
     return 0;
 }
 
+int    set_rule(DviContext *dvi, int opcode)
+{
+    Int32    a, b;
+    
+    a = dsget4(dvi);
+    b = dsget4(dvi);
+    return render_rule(dvi, a, b, opcode);
+}
+
 int    no_op(DviContext *dvi, int opcode)
 {
     SHOWCMD((dvi, "noop", -1, ""));
     return 0;
 }
 
-int    push(DviContext *dvi, int opcode)
+static int push_state(DviContext *dvi)
 {
     if(dvi->stacktop == dvi->stacksize) {
         if(!dvi->depth)
@@ -1351,7 +2339,7 @@ int    push(DviContext *dvi, int opcode)
     return 0;
 }
 
-int    pop(DviContext *dvi, int opcode)
+static int pop_state(DviContext *dvi)
 {
     if(dvi->stacktop == 0) {
         dvierr(dvi, _("stack underflow\n"));
@@ -1367,12 +2355,28 @@ int    pop(DviContext *dvi, int opcode)
     return 0;
 }
 
+int    push(DviContext *dvi, int opcode)
+{
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_PUSH, 0);
+    return push_state(dvi);
+}
+
+int    pop(DviContext *dvi, int opcode)
+{
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_POP, 0);
+    return pop_state(dvi);
+}
+
 int    move_right(DviContext *dvi, int opcode)
 {
     Int32    arg;
     int    h, hh;
     
     arg = dsgetn(dvi, opcode - DVI_RIGHT1 + 1);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_RIGHT, arg);
     h = dvi->pos.h;
     hh = move_horizontal(dvi, arg);
     SHOWCMD((dvi, "right", opcode - DVI_RIGHT1 + 1,
@@ -1388,6 +2392,8 @@ int    move_down(DviContext *dvi, int opcode)
     int    v, vv;
     
     arg = dsgetn(dvi, opcode - DVI_DOWN1 + 1);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_DOWN, arg);
     v = dvi->pos.v;
     vv = move_vertical(dvi, arg);
     SHOWCMD((dvi, "down", opcode - DVI_DOWN1 + 1,
@@ -1403,6 +2409,8 @@ int    move_w(DviContext *dvi, int opcode)
     
     if(opcode != DVI_W0)
         dvi->pos.w = dsgetn(dvi, opcode - DVI_W0);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_RIGHT, dvi->pos.w);
     h = dvi->pos.h;
     hh = move_horizontal(dvi, dvi->pos.w);
     SHOWCMD((dvi, "w", opcode - DVI_W0,
@@ -1418,6 +2426,8 @@ int    move_x(DviContext *dvi, int opcode)
     
     if(opcode != DVI_X0)
         dvi->pos.x = dsgetn(dvi, opcode - DVI_X0);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_RIGHT, dvi->pos.x);
     h = dvi->pos.h;
     hh = move_horizontal(dvi, dvi->pos.x);
     SHOWCMD((dvi, "x", opcode - DVI_X0,
@@ -1433,6 +2443,8 @@ int    move_y(DviContext *dvi, int opcode)
     
     if(opcode != DVI_Y0)
         dvi->pos.y = dsgetn(dvi, opcode - DVI_Y0);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_DOWN, dvi->pos.y);
     v = dvi->pos.v;
     vv = move_vertical(dvi, dvi->pos.y);
     SHOWCMD((dvi, "y", opcode - DVI_Y0,
@@ -1448,6 +2460,8 @@ int    move_z(DviContext *dvi, int opcode)
 
     if(opcode != DVI_Z0)
         dvi->pos.z = dsgetn(dvi, opcode - DVI_Z0);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_DOWN, dvi->pos.z);
     v = dvi->pos.v;
     vv = move_vertical(dvi, dvi->pos.z);
     SHOWCMD((dvi, "z", opcode - DVI_Z0,
@@ -1464,7 +2478,7 @@ int    sel_font(DviContext *dvi, int opcode)
     
     ndx = opcode - DVI_FNT_NUM0;
     if(dvi->depth)
-        ref = font_find_flat(dvi, ndx);
+        ref = font_find_sub(dvi, ndx);
     else
         ref = dvi->findref(dvi, ndx);
     if(ref == NULL) {
@@ -1486,7 +2500,7 @@ int    sel_fontn(DviContext *dvi, int opcode)
     
     arg = dugetn(dvi, opcode - DVI_FNT1 + 1);
     if(dvi->depth)
-        ref = font_find_flat(dvi, arg);
+        ref = font_find_sub(dvi, arg);
     else
         ref = dvi->findref(dvi, arg);
     if(ref == NULL) {
@@ -1513,7 +2527,11 @@ int    special(DviContext *dvi, int opcode)
     s = mdvi_malloc(arg + 1);
     dread(dvi, s, arg);
     s[arg] = 0;
-    mdvi_do_special(dvi, s);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_SPECIAL, 0)->u.data = mdvi_strdup(s);
+    /* specials change the state, so they only run when drawing */
+    if(!dvi->compiling)
+        mdvi_do_special(dvi, s);
     SHOWCMD((dvi, "XXXX", opcode - DVI_XXX1 + 1,
         "[%s]", s));
     mdvi_free(s);
@@ -1527,7 +2545,7 @@ int    def_font(DviContext *dvi, int opcode)
     
     arg = dugetn(dvi, opcode - DVI_FNT_DEF1 + 1);
     if(dvi->depth)
-        ref = font_find_flat(dvi, arg);
+        ref = font_find_sub(dvi, arg);
     else
         ref = dvi->findref(dvi, arg);
     /* skip the rest */
@@ -1556,3 +2574,1118 @@ int    undefined(DviContext *dvi, int opcode)
     return -1;
 }
 
+/* 
+ * Execute commands up to the end of the page or macro, and return
+ * DVI_EOP, or -1 on errors. With GCC, the opcodes most pages are made
+ * of are decoded right here, straight from the buffer, and dispatched
+ * through a table of labels; the rest go through dvi_commands[], as
+ * do all of them while opcodes are being traced.
+ */
+#ifdef __GNUC__
+#define DISPATCH(op)    __extension__ ({ goto *dispatch[op]; })
+
+static int run_commands(DviContext *dvi)
+{
+    __extension__ static const void *const dispatch[256] = {
+        [0 ... DVI_SET1 - 1] = &&set_char,
+        [DVI_SET1 ... DVI_BOP] = &&table,
+        [DVI_EOP] = &&eop,
+        [DVI_PUSH] = &&push,
+        [DVI_POP] = &&pop,
+        [DVI_RIGHT1 ... DVI_RIGHT4] = &&right,
+        [DVI_W0 ... DVI_W4] = &&move_w,
+        [DVI_X0 ... DVI_X4] = &&move_x,
+        [DVI_DOWN1 ... DVI_DOWN4] = &&down,
+        [DVI_Y0 ... DVI_Y4] = &&move_y,
+        [DVI_Z0 ... DVI_Z4] = &&move_z,
+        [DVI_FNT_NUM0 ... 255] = &&table
+    };
+    Uchar    *p;
+    Int32    arg;
+    int    op, n;
+
+    if(DEBUGGING(OPCODE))
+        goto slow;
+next:
+    /* with room for the longest argument, nothing needs checking */
+    if(NEEDBYTES(dvi, 5))
+        goto slow_once;
+    p = dvi->buffer.data + dvi->buffer.pos;
+    op = *p;
+    DISPATCH(op);
+
+set_char:
+    if(dvi->currfont == NULL)
+        goto table;
+    dvi->buffer.pos++;
+    /* this may run a macro, which uses the buffer */
+    if(render_char(dvi, dvi->currfont->ref, op, op) < 0)
+        return -1;
+    goto next;
+push:
+    dvi->buffer.pos++;
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_PUSH, 0);
+    push_state(dvi);
+    goto next;
+pop:
+    dvi->buffer.pos++;
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_POP, 0);
+    if(pop_state(dvi) < 0)
+        return -1;
+    goto next;
+right:
+    n = op - DVI_RIGHT1 + 1;
+    arg = msgetn(p + 1, n);
+    goto horizontal;
+move_w:
+    n = op - DVI_W0;
+    if(n)
+        dvi->pos.w = msgetn(p + 1, n);
+    arg = dvi->pos.w;
+    goto horizontal;
+move_x:
+    n = op - DVI_X0;
+    if(n)
+        dvi->pos.x = msgetn(p + 1, n);
+    arg = dvi->pos.x;
+horizontal:
+    dvi->buffer.pos += n + 1;
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_RIGHT, arg);
+    dvi->pos.hh = move_horizontal(dvi, arg);
+    goto next;
+down:
+    n = op - DVI_DOWN1 + 1;
+    arg = msgetn(p + 1, n);
+    goto vertical;
+move_y:
+    n = op - DVI_Y0;
+    if(n)
+        dvi->pos.y = msgetn(p + 1, n);
+    arg = dvi->pos.y;
+    goto vertical;
+move_z:
+    n = op - DVI_Z0;
+    if(n)
+        dvi->pos.z = msgetn(p + 1, n);
+    arg = dvi->pos.z;
+vertical:
+    dvi->buffer.pos += n + 1;
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_DOWN, arg);
+    dvi->pos.vv = move_vertical(dvi, arg);
+    goto next;
+table:
+    dvi->buffer.pos++;
+    if(dvi_commands[op](dvi, op) < 0)
+        return -1;
+    goto next;
+eop:
+    dvi->buffer.pos++;
+    return DVI_EOP;
+
+slow_once:
+    /* near the end of the buffer, let the table refill it */
+    if((op = duget1(dvi)) == DVI_EOP)
+        return DVI_EOP;
+    if(op < 0 || dvi_commands[op](dvi, op) < 0)
+        return -1;
+    goto next;
+
+slow:
+    while((op = duget1(dvi)) != DVI_EOP) {
+        if(op < 0 || dvi_commands[op](dvi, op) < 0)
+            return -1;
+    }
+    return DVI_EOP;
+}
+#else /* __GNUC__ */
+static int run_commands(DviContext *dvi)
+{
+    int    op;
+
+    while((op = duget1(dvi)) != DVI_EOP) {
+        if(op < 0 || dvi_commands[op](dvi, op) < 0)
+            return -1;
+    }
+    return DVI_EOP;
+}
+#endif /* __GNUC__ */
+
+/* 
+ * Virtual font characters are compiled into display ops the first time
+ * they are used, with their fonts resolved and their w, x, y and z moves
+ * turned into plain ones. Characters from subfonts that are virtual too
+ * are left as such, and expanded when they are played.
+ */
+
+typedef struct {
+    Int32    w, x, y, z;
+} VfRegisters;
+
+/* a compiled macro that would not compile */
+static DviDisplayList vf_bad_code;
+
+static DviDisplayList *vf_compile(DviFont *font, const Uchar *p, int len)
+{
+    DviDisplayList *code;
+    DviFontRef *ref;
+    DviFont    *curr;
+    VfRegisters regs;
+    VfRegisters *stack;
+    const Uchar *end = p + len;
+    Int32    a, b;
+    int    op, n, sp;
+    char    *s;
+
+    code = xalloc(DviDisplayList);
+    memset(code, 0, sizeof(DviDisplayList));
+    stack = xnalloc(VfRegisters, len + 1);
+    memset(&regs, 0, sizeof(VfRegisters));
+    curr = font->subfonts ? font->subfonts->ref : NULL;
+    sp = 0;
+
+#define VFNEED(n)    if(end - p < (n)) goto error
+    while(p < end) {
+        op = *p++;
+        if(op < DVI_SET1) {
+            if(curr == NULL)
+                goto error;
+            dlist_add(code, DL_SETCHAR, op)->u.data = curr;
+            continue;
+        }
+        switch(op) {
+        case DVI_SET1: case DVI_SET2: case DVI_SET3: case DVI_SET4:
+        case DVI_PUT1: case DVI_PUT2: case DVI_PUT3: case DVI_PUT4:
+            n = (op >= DVI_PUT1 ? op - DVI_PUT1 : op - DVI_SET1) + 1;
+            VFNEED(n);
+            a = MUGETN(p, n);
+            if(curr == NULL)
+                goto error;
+            dlist_add(code, op >= DVI_PUT1 ? DL_PUTCHAR : DL_SETCHAR,
+                a)->u.data = curr;
+            break;
+        case DVI_SET_RULE:
+        case DVI_PUT_RULE:
+            VFNEED(8);
+            a = MSGETN(p, 4);
+            b = MSGETN(p, 4);
+            dlist_add(code, op == DVI_SET_RULE ? 
+                DL_SETRULE : DL_PUTRULE, a)->u.b = b;
+            break;
+        case DVI_NOOP:
+            break;
+        case DVI_PUSH:
+            stack[sp++] = regs;
+            dlist_add(code, DL_PUSH, 0);
+            break;
+        case DVI_POP:
+            if(sp == 0)
+                goto error;
+            regs = stack[--sp];
+            dlist_add(code, DL_POP, 0);
+            break;
+        case DVI_RIGHT1: case DVI_RIGHT2: case DVI_RIGHT3: case DVI_RIGHT4:
+            n = op - DVI_RIGHT1 + 1;
+            VFNEED(n);
+            dlist_add(code, DL_RIGHT, MSGETN(p, n));
+            break;
+        case DVI_W0: case DVI_W1: case DVI_W2: case DVI_W3: case DVI_W4:
+            n = op - DVI_W0;
+            VFNEED(n);
+            if(n)
+                regs.w = MSGETN(p, n);
+            dlist_add(code, DL_RIGHT, regs.w);
+            break;
+        case DVI_X0: case DVI_X1: case DVI_X2: case DVI_X3: case DVI_X4:
+            n = op - DVI_X0;
+            VFNEED(n);
+            if(n)
+                regs.x = MSGETN(p, n);
+            dlist_add(code, DL_RIGHT, regs.x);
+            break;
+        case DVI_DOWN1: case DVI_DOWN2: case DVI_DOWN3: case DVI_DOWN4:
+            n = op - DVI_DOWN1 + 1;
+            VFNEED(n);
+            dlist_add(code, DL_DOWN, MSGETN(p, n));
+            break;
+        case DVI_Y0: case DVI_Y1: case DVI_Y2: case DVI_Y3: case DVI_Y4:
+            n = op - DVI_Y0;
+            VFNEED(n);
+            if(n)
+                regs.y = MSGETN(p, n);
+            dlist_add(code, DL_DOWN, regs.y);
+            break;
+        case DVI_Z0: case DVI_Z1: case DVI_Z2: case DVI_Z3: case DVI_Z4:
+            n = op - DVI_Z0;
+            VFNEED(n);
+            if(n)
+                regs.z = MSGETN(p, n);
+            dlist_add(code, DL_DOWN, regs.z);
+            break;
+        case DVI_FNT1: case DVI_FNT2: case DVI_FNT3: case DVI_FNT4:
+            n = op - DVI_FNT1 + 1;
+            VFNEED(n);
+            a = MUGETN(p, n);
+            goto select;
+        case DVI_XXX1: case DVI_XXX2: case DVI_XXX3: case DVI_XXX4:
+            n = op - DVI_XXX1 + 1;
+            VFNEED(n);
+            a = MUGETN(p, n);
+            if(a <= 0)
+                goto error;
+            VFNEED(a);
+            s = mdvi_malloc(a + 1);
+            memcpy(s, p, a);
+            s[a] = 0;
+            p += a;
+            dlist_add(code, DL_SPECIAL, 0)->u.data = s;
+            break;
+        case DVI_EOP:
+            if(sp)
+                goto error;
+            mdvi_free(stack);
+            return code;
+        default:
+            if(op < DVI_FNT_NUM0 || op >= DVI_FNT1)
+                goto error;
+            a = op - DVI_FNT_NUM0;
+        select:
+            ref = font_map_find(font->submap, font->submask, a);
+            if(ref == NULL)
+                goto error;
+            curr = ref->ref;
+            break;
+        }
+    }
+#undef VFNEED
+error:
+    /* the EOP the loader appends was not reached */
+    mdvi_free(stack);
+    dlist_free(code);
+    return NULL;
+}
+
+/* must be called with the font locked */
+static DviDisplayList *vf_get_code(DviFont *font, int code)
+{
+    DviDisplayList **table;
+    DviFontChar *ch;
+    int    i;
+
+    ch = FONTCHAR(font, code);
+    if(!glyph_present(ch))
+        return NULL;
+    table = font->vfcode;
+    if(table == NULL) {
+        table = xnalloc(DviDisplayList *, FONT_GLYPH_COUNT(font));
+        for(i = 0; i < FONT_GLYPH_COUNT(font); i++)
+            table[i] = NULL;
+        font->vfcode = table;
+    }
+    i = code - font->loc;
+    if(table[i] == NULL) {
+        table[i] = vf_compile(font, (Uchar *)font->private + ch->offset,
+            ch->width);
+        if(table[i] == NULL)
+            table[i] = &vf_bad_code;
+        DEBUG((DBG_GLYPHS, "(vf) %s: compiled character %d\n",
+            font->fontname, code));
+    }
+    return table[i] == &vf_bad_code ? NULL : table[i];
+}
+
+void    vf_free_code(DviFont *font)
+{
+    DviDisplayList **table = font->vfcode;
+    int    i;
+
+    if(table == NULL)
+        return;
+    for(i = 0; i < FONT_GLYPH_COUNT(font); i++) {
+        if(table[i] && table[i] != &vf_bad_code)
+            dlist_free(table[i]);
+    }
+    mdvi_free(table);
+    font->vfcode = NULL;
+}
+
+/* what mdvi_run_macro() would do, from the compiled macro */
+static void vf_play(DviContext *dvi, DviDisplayList *code)
+{
+    DviDisplayOp *op;
+    char    *s;
+    int    i;
+
+    dvi->depth++;
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_ENTER, 0);
+    push_state(dvi);
+    for(i = 0; i < code->count; i++) {
+        op = &code->ops[i];
+        switch(op->type) {
+        case DL_SETCHAR:
+            render_char(dvi, op->u.data, op->a, DVI_SET1);
+            break;
+        case DL_PUTCHAR:
+            render_char(dvi, op->u.data, op->a, DVI_PUT1);
+            break;
+        case DL_SETRULE:
+            render_rule(dvi, op->a, op->u.b, DVI_SET_RULE);
+            break;
+        case DL_PUTRULE:
+            render_rule(dvi, op->a, op->u.b, DVI_PUT_RULE);
+            break;
+        case DL_RIGHT:
+            if(dvi->dlist)
+                dlist_add(dvi->dlist, DL_RIGHT, op->a);
+            dvi->pos.hh = move_horizontal(dvi, op->a);
+            break;
+        case DL_DOWN:
+            if(dvi->dlist)
+                dlist_add(dvi->dlist, DL_DOWN, op->a);
+            dvi->pos.vv = move_vertical(dvi, op->a);
+            break;
+        case DL_PUSH:
+            if(dvi->dlist)
+                dlist_add(dvi->dlist, DL_PUSH, 0);
+            push_state(dvi);
+            break;
+        case DL_POP:
+            if(dvi->dlist)
+                dlist_add(dvi->dlist, DL_POP, 0);
+            pop_state(dvi);
+            break;
+        case DL_SPECIAL:
+            if(dvi->dlist)
+                dlist_add(dvi->dlist, DL_SPECIAL, 0)->u.data = 
+                    mdvi_strdup(op->u.data);
+            if(!dvi->compiling) {
+                s = mdvi_strdup(op->u.data);
+                mdvi_do_special(dvi, s);
+                mdvi_free(s);
+            }
+            break;
+        }
+    }
+    pop_state(dvi);
+    if(dvi->dlist)
+        dlist_add(dvi->dlist, DL_LEAVE, 0);
+    dvi->depth--;
+}
+
+
+static DviCheckpoints *checkpoints_new(DviContext *dvi)
+{
+    DviCheckpoints *cps;
+
+    cps = xalloc(DviCheckpoints);
+    memset(cps, 0, sizeof(DviCheckpoints));
+    cps->conv = dvi->params.conv;
+    cps->vconv = dvi->params.vconv;
+    cps->hdrift = dvi->params.hdrift;
+    cps->vdrift = dvi->params.vdrift;
+    cps->thinsp = dvi->params.thinsp;
+    cps->vsmallsp = dvi->params.vsmallsp;
+    return cps;
+}
+
+static int checkpoints_match(DviCheckpoints *cps, DviContext *dvi)
+{
+    return cps->conv == dvi->params.conv &&
+        cps->vconv == dvi->params.vconv &&
+        cps->hdrift == dvi->params.hdrift &&
+        cps->vdrift == dvi->params.vdrift &&
+        cps->thinsp == dvi->params.thinsp &&
+        cps->vsmallsp == dvi->params.vsmallsp;
+}
+
+static void checkpoint_take(DviContext *dvi, DviCheckpoints *cps, int op)
+{
+    DviCheckpoint *cp;
+
+    if(cps->count == cps->size) {
+        cps->size = cps->size ? 2 * cps->size : 16;
+        cps->points = xresize(cps->points, DviCheckpoint, cps->size);
+    }
+    if(cps->nstack + dvi->stacktop > cps->stacksize) {
+        cps->stacksize = 2 * (cps->nstack + dvi->stacktop);
+        cps->stack = xresize(cps->stack, DviState, cps->stacksize);
+    }
+    if(cps->ncolors + dvi->color_top > cps->colorsize) {
+        cps->colorsize = 2 * (cps->ncolors + dvi->color_top);
+        cps->colors = xresize(cps->colors, DviColorPair, cps->colorsize);
+    }
+    cp = &cps->points[cps->count++];
+    cp->op = op;
+    cp->pos = dvi->pos;
+    cp->depth = dvi->depth;
+    cp->layer = dvi->curr_layer;
+    cp->stacktop = dvi->stacktop;
+    cp->stackpos = cps->nstack;
+    memcpy(cps->stack + cps->nstack, dvi->stack, 
+        dvi->stacktop * sizeof(DviState));
+    cps->nstack += dvi->stacktop;
+    cp->fg = dvi->curr_fg;
+    cp->bg = dvi->curr_bg;
+    cp->color_top = dvi->color_top;
+    cp->colorpos = cps->ncolors;
+    memcpy(cps->colors + cps->ncolors, dvi->color_stack,
+        dvi->color_top * sizeof(DviColorPair));
+    cps->ncolors += dvi->color_top;
+}
+
+/* 
+ * Restore the state of the last checkpoint no later than `limit', and
+ * return the op it was taken before (0 if there is none).
+ */
+static int checkpoint_resume(DviContext *dvi, DviDisplayList *dl, int limit)
+{
+    DviCheckpoints *cps;
+    DviCheckpoint *cp;
+    int    lo, hi, mid;
+    int    op = 0;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    cps = dl->checkpoints;
+    if(cps == NULL || !checkpoints_match(cps, dvi))
+        goto done;
+    cp = NULL;
+    lo = 0;
+    hi = cps->count - 1;
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(cps->points[mid].op <= limit) {
+            cp = &cps->points[mid];
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    if(cp == NULL)
+        goto done;
+
+    if(cp->stacktop > dvi->stacksize) {
+        dvi->stacksize = cp->stacktop + 8;
+        dvi->stack = xresize(dvi->stack, DviState, dvi->stacksize);
+    }
+    memcpy(dvi->stack, cps->stack + cp->stackpos, 
+        cp->stacktop * sizeof(DviState));
+    dvi->stacktop = cp->stacktop;
+    dvi->pos = cp->pos;
+    dvi->depth = cp->depth;
+    dvi->curr_layer = cp->layer;
+    if(cp->color_top > dvi->color_size) {
+        dvi->color_size = cp->color_top + 32;
+        dvi->color_stack = mdvi_realloc(dvi->color_stack,
+            dvi->color_size * sizeof(DviColorPair));
+    }
+    memcpy(dvi->color_stack, cps->colors + cp->colorpos,
+        cp->color_top * sizeof(DviColorPair));
+    dvi->color_top = cp->color_top;
+    mdvi_set_color(dvi, cp->fg, cp->bg);
+    op = cp->op;
+done:
+    pthread_mutex_unlock(&checkpoint_lock);
+    return op;
+}
+
+/* 
+ * The ops a clipped page has to run: from the first one that shows, or
+ * may draw, to the last one.
+ */
+static void clip_range(DviDisplayList *dl, Uchar *visible, 
+    int *first, int *last)
+{
+    int    i;
+
+    *first = dl->index->firstspecial;
+    *last = dl->index->lastspecial;
+    for(i = 0; i < *first; i++) {
+        if(visible[i] && DL_DRAWS(dl->ops[i].type)) {
+            *first = i;
+            break;
+        }
+    }
+    for(i = dl->count - 1; i > *last; i--) {
+        if(visible[i] && DL_DRAWS(dl->ops[i].type)) {
+            *last = i;
+            break;
+        }
+    }
+}
+
+/* replay a page compiled by mdvi_dopage() */
+static int replay_page(DviContext *dvi, DviDisplayList *dl, Uchar *visible)
+{
+    DviDisplayOp *op;
+    DviCheckpoints *cps = NULL;
+    char    *s;
+    int    i, first, last;
+    
+    if(visible) {
+        /* start as late, and stop as soon, as we can */
+        clip_range(dl, visible, &first, &last);
+        first = checkpoint_resume(dvi, dl, first);
+    } else {
+        first = 0;
+        last = dl->count - 1;
+        pthread_mutex_lock(&checkpoint_lock);
+        if(dl->checkpoints == NULL || 
+           !checkpoints_match(dl->checkpoints, dvi))
+            cps = checkpoints_new(dvi);
+        pthread_mutex_unlock(&checkpoint_lock);
+    }
+
+    for(i = first; i <= last; i++) {
+        op = &dl->ops[i];
+        if(cps && i && i % DL_CHECKPOINT == 0)
+            checkpoint_take(dvi, cps, i);
+        switch(op->type) {
+        case DL_SETCHAR:
+            if(visible && !visible[i])
+                skip_char(dvi, op->u.data, op->a);
+            else
+                render_char(dvi, op->u.data, op->a, DVI_SET1);
+            break;
+        case DL_PUTCHAR:
+            if(!visible || visible[i])
+                render_char(dvi, op->u.data, op->a, DVI_PUT1);
+            break;
+        case DL_ADVANCE:
+            char_advance(dvi, op->a);
+            break;
+        case DL_SETRULE:
+            if(visible && !visible[i])
+                render_rule(dvi, 0, op->u.b, DVI_SET_RULE);
+            else
+                render_rule(dvi, op->a, op->u.b, DVI_SET_RULE);
+            break;
+        case DL_PUTRULE:
+            if(!visible || visible[i])
+                render_rule(dvi, op->a, op->u.b, DVI_PUT_RULE);
+            break;
+        case DL_RIGHT:
+            dvi->pos.hh = move_horizontal(dvi, op->a);
+            break;
+        case DL_DOWN:
+            dvi->pos.vv = move_vertical(dvi, op->a);
+            break;
+        case DL_PUSH:
+            push_state(dvi);
+            break;
+        case DL_POP:
+            if(pop_state(dvi) < 0) {
+                if(cps)
+                    checkpoints_free(cps);
+                return -1;
+            }
+            break;
+        case DL_ENTER:
+            dvi->depth++;
+            push_state(dvi);
+            break;
+        case DL_LEAVE:
+            pop_state(dvi);
+            dvi->depth--;
+            break;
+        case DL_SPECIAL:
+            /* handlers may modify the string */
+            s = mdvi_strdup(op->u.data);
+            mdvi_do_special(dvi, s);
+            mdvi_free(s);
+            break;
+        }
+    }
+    if(last < dl->count - 1) {
+        /* what was left would have emptied these */
+        dvi->stacktop = 0;
+        dvi->depth = 0;
+    }
+    if(cps) {
+        pthread_mutex_lock(&checkpoint_lock);
+        if(dl->checkpoints)
+            checkpoints_free(dl->checkpoints);
+        dl->checkpoints = cps;
+        pthread_mutex_unlock(&checkpoint_lock);
+    }
+    return DVI_EOP;
+}
+
+/* 
+ * Compile a page without drawing it. The glyphs are not loaded either;
+ * that is left to preload_glyphs().
+ */
+static DviDisplayList *compile_page(DviContext *dvi, int pageno)
+{
+    DviDevice device;
+    DviDisplayList *dl;
+    int    op;
+
+    device = dvi->device;
+    set_dummy_device(&dvi->device);
+    dvi->compiling = 1;
+    dvi->dlist = dl = xalloc(DviDisplayList);
+    memset(dl, 0, sizeof(DviDisplayList));
+    op = run_commands(dvi);
+    dvi->dlist = NULL;
+    dvi->compiling = 0;
+    dvi->device = device;
+    if(op != DVI_EOP) {
+        dlist_free(dl);
+        return NULL;
+    }
+    dlist_index(dvi, dl);
+    pagecache_put(dvi->pagecache, pageno, dl);
+
+    /* start over for drawing */
+    dvi->currfont = NULL;
+    memset(&dvi->pos, 0, sizeof(DviState));
+    dvi->stacktop = 0;
+    dvi->curr_layer = 0;
+    return pagecache_get(dvi->pagecache, pageno);
+}
+
+/* 
+ * Page indexing. We walk the list keeping track of the position in DVI
+ * units only, and box every glyph and rule with the glyph's metrics. The
+ * pixel position of a glyph may drift from the DVI one by a few pixels,
+ * which the clip takes into account (see clip_page).
+ */
+
+/* unshrunk pixels around each glyph, for rounding */
+#define DL_BOXPAD    2
+
+static int box_char(DviContext *dvi, DviFont *font, int code, 
+    Int32 h, Int32 v, DviOpBox *box, Int32 *tfmwidth)
+{
+    DviFontChar *ch;
+    int    drawn = 0;
+
+    font_lock(font);
+    ch = FONTCHAR(font, code);
+    if(glyph_present(ch)) {
+        *tfmwidth = ch->tfmwidth;
+        if(!ISVIRTUAL(font)) {
+            box->h0 = h - (Int32)((ch->x + DL_BOXPAD) / dvi->dviconv);
+            box->h1 = h + (Int32)((ch->width - ch->x + DL_BOXPAD) / 
+                dvi->dviconv);
+            box->v0 = v - (Int32)((ch->y + DL_BOXPAD) / dvi->dvivconv);
+            box->v1 = v + (Int32)((ch->height - ch->y + DL_BOXPAD) / 
+                dvi->dvivconv);
+            drawn = 1;
+        }
+    } else
+        *tfmwidth = 0;
+    font_unlock(font);
+    return drawn;
+}
+
+/* 
+ * Specials whose only effect is on the color stack or the layer, which
+ * checkpoints keep. Anything else may draw, so it is never skipped.
+ */
+static int special_keeps_state(const char *s)
+{
+    while(*s == ' ')
+        s++;
+    return STRNCEQ(s, "color", 5) || STRNCEQ(s, "layer", 5);
+}
+
+static void dlist_index(DviContext *dvi, DviDisplayList *dl)
+{
+    DviPageIndex *ix;
+    DviDisplayOp *op;
+    DviOpBox *boxes;
+    Int32    *stack;
+    Int32    h, v, w;
+    Int32    h0, v0, h1, v1;
+    int    i, n, sp, c, r, c0, c1, r0, r1;
+    int    first, last;
+    int    *fill;
+
+    /* glyphs are not boxed by their metrics if they are flipped */
+    if(dvi->params.orientation != MDVI_ORIENT_TBLR)
+        return;
+    boxes = xnalloc(DviOpBox, dl->count + 1);
+    stack = xnalloc(Int32, 2 * dl->count + 2);
+    h = v = 0;
+    h0 = v0 = h1 = v1 = 0;
+    first = dl->count;
+    last = -1;
+    for(i = n = sp = 0; i < dl->count; i++) {
+        op = &dl->ops[i];
+        switch(op->type) {
+        case DL_SPECIAL:
+            if(!special_keeps_state(op->u.data)) {
+                if(first == dl->count)
+                    first = i;
+                last = i;
+            }
+            break;
+        case DL_SETCHAR:
+        case DL_PUTCHAR:
+            if(box_char(dvi, op->u.data, op->a, h, v, &boxes[n], &w))
+                boxes[n++].op = i;
+            if(op->type == DL_SETCHAR)
+                h += w;
+            break;
+        case DL_ADVANCE:
+            h += op->a;
+            break;
+        case DL_SETRULE:
+        case DL_PUTRULE:
+            if(op->a > 0 && op->u.b > 0) {
+                boxes[n].h0 = h;
+                boxes[n].h1 = h + op->u.b;
+                boxes[n].v0 = v - op->a;
+                boxes[n].v1 = v;
+                boxes[n++].op = i;
+            }
+            if(op->type == DL_SETRULE)
+                h += op->u.b;
+            break;
+        case DL_RIGHT:
+            h += op->a;
+            break;
+        case DL_DOWN:
+            v += op->a;
+            break;
+        case DL_PUSH:
+        case DL_ENTER:
+            stack[sp++] = h;
+            stack[sp++] = v;
+            break;
+        case DL_POP:
+        case DL_LEAVE:
+            if(sp > 0) {
+                v = stack[--sp];
+                h = stack[--sp];
+            }
+            break;
+        }
+    }
+    mdvi_free(stack);
+    if(n == 0) {
+        mdvi_free(boxes);
+        return;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(!i || boxes[i].h0 < h0) h0 = boxes[i].h0;
+        if(!i || boxes[i].v0 < v0) v0 = boxes[i].v0;
+        if(!i || boxes[i].h1 > h1) h1 = boxes[i].h1;
+        if(!i || boxes[i].v1 > v1) v1 = boxes[i].v1;
+    }
+    ix = xalloc(DviPageIndex);
+    ix->h0 = h0;
+    ix->v0 = v0;
+    ix->cellw = (h1 - h0) / DL_GRID + 1;
+    ix->cellh = (v1 - v0) / DL_GRID + 1;
+    ix->boxes = boxes;
+    ix->firstspecial = first;
+    ix->lastspecial = last;
+
+    /* count what goes in each cell, then fill them */
+    ix->starts = xnalloc(int, DL_GRID * DL_GRID + 1);
+    memset(ix->starts, 0, (DL_GRID * DL_GRID + 1) * sizeof(int));
+    for(i = 0; i < n; i++) {
+        c0 = (boxes[i].h0 - h0) / ix->cellw;
+        c1 = (boxes[i].h1 - h0) / ix->cellw;
+        r0 = (boxes[i].v0 - v0) / ix->cellh;
+        r1 = (boxes[i].v1 - v0) / ix->cellh;
+        for(r = r0; r <= r1; r++)
+            for(c = c0; c <= c1; c++)
+                ix->starts[r * DL_GRID + c + 1]++;
+    }
+    for(i = 0; i < DL_GRID * DL_GRID; i++)
+        ix->starts[i + 1] += ix->starts[i];
+    ix->cells = xnalloc(int, ix->starts[DL_GRID * DL_GRID] + 1);
+    fill = xnalloc(int, DL_GRID * DL_GRID);
+    memcpy(fill, ix->starts, DL_GRID * DL_GRID * sizeof(int));
+    for(i = 0; i < n; i++) {
+        c0 = (boxes[i].h0 - h0) / ix->cellw;
+        c1 = (boxes[i].h1 - h0) / ix->cellw;
+        r0 = (boxes[i].v0 - v0) / ix->cellh;
+        r1 = (boxes[i].v1 - v0) / ix->cellh;
+        for(r = r0; r <= r1; r++)
+            for(c = c0; c <= c1; c++)
+                ix->cells[fill[r * DL_GRID + c]++] = i;
+    }
+    mdvi_free(fill);
+    DEBUG((DBG_DVI, "indexed %d boxes in %d cells of %dx%d\n",
+        n, DL_GRID * DL_GRID, ix->cellw, ix->cellh));
+    dl->index = ix;
+}
+
+/* pixels to DVI units, without overflowing */
+static Int32 clip_units(double pixels, double conv)
+{
+    double    units = pixels / conv;
+
+    if(units > 0x3fffffff)
+        return 0x3fffffff;
+    else if(units < -0x3fffffff)
+        return -0x3fffffff;
+    return (Int32)units;
+}
+
+/* 
+ * Which ops of the page may draw inside the clip, or NULL if all of them
+ * might. Ops that draw nothing are always marked.
+ */
+static Uchar *clip_page(DviContext *dvi, DviDisplayList *dl)
+{
+    DviPageIndex *ix = dl->index;
+    DviOpBox *box;
+    Uchar    *visible;
+    Int32    h0, v0, h1, v1;
+    int    i, c, r, c0, c1, r0, r1;
+    int    hpad, vpad;
+
+    if(dvi->clip_w <= 0 || dvi->clip_h <= 0 || ix == NULL)
+        return NULL;
+    /* the clip is in device pixels, like pos.hh and pos.vv */
+    hpad = dvi->params.hdrift + DL_BOXPAD;
+    vpad = dvi->params.vdrift + DL_BOXPAD;
+    h0 = clip_units((double)dvi->clip_x - hpad, dvi->params.conv);
+    h1 = clip_units((double)dvi->clip_x + dvi->clip_w + hpad, 
+        dvi->params.conv);
+    v0 = clip_units((double)dvi->clip_y - vpad, dvi->params.vconv);
+    v1 = clip_units((double)dvi->clip_y + dvi->clip_h + vpad, 
+        dvi->params.vconv);
+    /* nothing to leave out */
+    if(h0 <= ix->h0 && v0 <= ix->v0 &&
+       h1 >= ix->h0 + DL_GRID * ix->cellw && 
+       v1 >= ix->v0 + DL_GRID * ix->cellh)
+        return NULL;
+
+    visible = xnalloc(Uchar, dl->count + 1);
+    for(i = 0; i < dl->count; i++) {
+        visible[i] = !DL_DRAWS(dl->ops[i].type);
+    }
+    c0 = (h0 - ix->h0) / ix->cellw;
+    c1 = (h1 - ix->h0) / ix->cellw;
+    r0 = (v0 - ix->v0) / ix->cellh;
+    r1 = (v1 - ix->v0) / ix->cellh;
+    c0 = Max(c0, 0);
+    r0 = Max(r0, 0);
+    c1 = Min(c1, DL_GRID - 1);
+    r1 = Min(r1, DL_GRID - 1);
+    for(r = r0; r <= r1; r++) {
+        for(c = c0; c <= c1; c++) {
+            for(i = ix->starts[r * DL_GRID + c];
+                i < ix->starts[r * DL_GRID + c + 1]; i++) {
+                box = &ix->boxes[ix->cells[i]];
+                if(box->h1 >= h0 && box->h0 <= h1 &&
+                   box->v1 >= v0 && box->v0 <= v1)
+                    visible[box->op] = 1;
+            }
+        }
+    }
+    return visible;
+}
+
+void    mdvi_set_clip(DviContext *dvi, int x, int y, int w, int h)
+{
+    dvi->clip_x = x;
+    dvi->clip_y = y;
+    dvi->clip_w = w;
+    dvi->clip_h = h;
+}
+
+/* 
+ * Glyph preloading. The glyphs a page needs are loaded by a pool of
+ * threads shared by all contexts, one per processor counting the thread
+ * drawing the page, which loads glyphs of its own page too. Glyphs are
+ * handed out one at a time, and those of the same font are scaled in
+ * parallel (see font_preload_glyph).
+ */
+
+typedef struct {
+    DviFont    *font;
+    int    code;
+} GlyphRef;
+
+typedef struct _GlyphBatch GlyphBatch;
+
+/* the glyphs of one page */
+struct _GlyphBatch {
+    GlyphBatch *next;
+    DviContext *dvi;
+    GlyphRef *refs;
+    int    count;
+    int    taken;        /* glyphs handed out */
+    int    pending;    /* glyphs not loaded yet */
+};
+
+/* 0 means one per processor; only looked at when the pool starts */
+static int glyph_threads = 0;
+
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preload_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t preload_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static GlyphBatch *preload_queue = NULL;
+static int preload_workers = 0;
+
+void    mdvi_set_glyph_threads(int n)
+{
+    glyph_threads = n;
+}
+
+static int compare_refs(const void *p1, const void *p2)
+{
+    const GlyphRef *a = (const GlyphRef *)p1;
+    const GlyphRef *b = (const GlyphRef *)p2;
+
+    if(a->font != b->font)
+        return (a->font < b->font) ? -1 : 1;
+    return a->code - b->code;
+}
+
+/* whether drawing the glyph now would have to load or scale it */
+static int glyph_pending(DviContext *dvi, DviFont *font, int code)
+{
+    DviFontChar *ch;
+    int    pending;
+
+    font_lock(font);
+    ch = FONTCHAR(font, code);
+    pending = (ch == NULL || 
+        (glyph_present(ch) && !ch->missing && ch->width && ch->height &&
+         ((!ch->loaded && MDVI_GLYPH_UNSET(ch->grey.data)) || 
+          ch->hshrink != MDVI_HSHRINK(&dvi->params) ||
+          ch->vshrink != MDVI_VSHRINK(&dvi->params))));
+    font_unlock(font);
+    return pending;
+}
+
+/* next glyph of `batch', called with preload_lock held */
+static GlyphRef *preload_take(GlyphBatch *batch)
+{
+    GlyphBatch **bp;
+
+    if(batch->taken == batch->count)
+        return NULL;
+    /* when its last glyph goes, nothing is left to hand out */
+    if(batch->taken + 1 == batch->count) {
+        for(bp = &preload_queue; *bp != batch; bp = &(*bp)->next)
+            ;
+        *bp = batch->next;
+    }
+    return &batch->refs[batch->taken++];
+}
+
+static void preload_one(DviContext *dvi, GlyphRef *ref)
+{
+    DviContext copy;
+
+    /* loading a glyph may change the parameters while it works */
+    copy = *dvi;
+    font_preload_glyph(&copy, ref->font, ref->code);
+}
+
+static void *preload_worker(void *arg)
+{
+    GlyphBatch *batch;
+    GlyphRef *ref;
+
+    pthread_mutex_lock(&preload_lock);
+    for(;;) {
+        while(preload_queue == NULL)
+            pthread_cond_wait(&preload_work, &preload_lock);
+        batch = preload_queue;
+        ref = preload_take(batch);
+        pthread_mutex_unlock(&preload_lock);
+        preload_one(batch->dvi, ref);
+        pthread_mutex_lock(&preload_lock);
+        if(--batch->pending == 0)
+            pthread_cond_broadcast(&preload_done);
+    }
+    return NULL;
+}
+
+static void preload_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int    n;
+
+    n = glyph_threads;
+    if(n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* the thread drawing the page is the other one */
+    while(preload_workers < n - 1 &&
+          pthread_create(&thread, &attr, preload_worker, NULL) == 0)
+        preload_workers++;
+    pthread_attr_destroy(&attr);
+    DEBUG((DBG_FONTS, "%d glyph preloading threads\n", preload_workers));
+}
+
+static void preload_glyphs(DviContext *dvi, DviDisplayList *dl, Uchar *visible)
+{
+    GlyphBatch batch;
+    GlyphBatch **bp;
+    GlyphRef *refs;
+    GlyphRef *ref;
+    int    i, n, kept;
+
+    pthread_once(&preload_once, preload_start);
+    if(preload_workers == 0)
+        return;
+
+    /* the different glyphs the page uses */
+    refs = xnalloc(GlyphRef, dl->count + 1);
+    for(i = n = 0; i < dl->count; i++) {
+        if((dl->ops[i].type != DL_SETCHAR && 
+            dl->ops[i].type != DL_PUTCHAR) ||
+           (visible && !visible[i]) ||
+           ISVIRTUAL((DviFont *)dl->ops[i].u.data))
+            continue;
+        refs[n].font = dl->ops[i].u.data;
+        refs[n].code = dl->ops[i].a;
+        n++;
+    }
+    qsort(refs, n, sizeof(GlyphRef), compare_refs);
+
+    /* keep the ones not ready yet */
+    for(i = kept = 0; i < n; i++) {
+        if(i > 0 && !compare_refs(&refs[i], &refs[i - 1]))
+            continue;
+        if(glyph_pending(dvi, refs[i].font, refs[i].code))
+            refs[kept++] = refs[i];
+    }
+    DEBUG((DBG_FONTS, "preloading %d glyphs\n", kept));
+    if(kept < 2) {
+        /* drawing the page will do */
+        mdvi_free(refs);
+        return;
+    }
+
+    batch.next = NULL;
+    batch.dvi = dvi;
+    batch.refs = refs;
+    batch.count = kept;
+    batch.taken = 0;
+    batch.pending = kept;
+    pthread_mutex_lock(&preload_lock);
+    for(bp = &preload_queue; *bp; bp = &(*bp)->next)
+        ;
+    *bp = &batch;
+    pthread_cond_broadcast(&preload_work);
+    /* we do our share, and wait for the glyphs the pool took */
+    while((ref = preload_take(&batch)) != NULL) {
+        pthread_mutex_unlock(&preload_lock);
+        preload_one(dvi, ref);
+        pthread_mutex_lock(&preload_lock);
+        batch.pending--;
+    }
+    while(batch.pending > 0)
+        pthread_cond_wait(&preload_done, &preload_lock);
+    pthread_mutex_unlock(&preload_lock);
+    mdvi_free(refs);
+}
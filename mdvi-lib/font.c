@@ -16,13 +16,49 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+/* for recursive mutexes */
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "mdvi.h"
 #include "private.h"
 
 static ListHead fontlist;
 
+static pthread_mutex_t fontlist_mutex;
+static pthread_once_t fontlist_mutex_once = PTHREAD_ONCE_INIT;
+
+/* 
+ * Memory held by glyphs. When it goes over the budget, font_enforce_budget
+ * drops the least recently used glyphs; they are simply loaded again if 
+ * they are needed later.
+ */
+static DviGlyphMemory glyph_mem = {0, 0, 0, MDVI_GLYPH_BUDGET};
+static Ulong glyph_clock = 0;
+static pthread_mutex_t glyph_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define BITMAP_MEM(p)    \
+    (MDVI_GLYPH_NONEMPTY(p) ? \
+    (size_t)((BITMAP *)(p))->stride * ((BITMAP *)(p))->height : 0)
+/* 
+ * Devices use 32-bit pixels, or 8-bit coverage. Devices that pack images
+ * together count what they really hold (see mdvi_add_image_memory).
+ */
+#define IMAGE_MEM(dev, g)    \
+    (MDVI_GLYPH_NONEMPTY((g)->data) && !(dev)->image_group ? \
+     (size_t)(g)->w * (g)->h * \
+     (((dev)->flags & MDVI_DEVICE_ALPHA) ? 1 : 4) : 0)
+
+typedef struct {
+    DviFont    *font;
+    int    code;
+    Ulong    lastuse;
+    void    *group;        /* storage its image shares, if any */
+    Ulong    grouped;    /* last use of anything in that storage */
+} GlyphUse;
+
 extern char *_mdvi_fallback_font;
 
 extern void vf_free_macros(DviFont *);
@@ -31,6 +67,115 @@ extern void vf_free_macros(DviFont *);
 #define TYPENAME(font)    \
     ((font)->finfo ? (font)->finfo->name : "none")
 
+/* grey glyphs that can be kept in the on-disk cache */
+#define CACHES_GREY(dvi, font, ch) \
+    (MDVI_ENABLED((dvi), MDVI_PARAM_ANTIALIASED) && \
+     (ch)->width && (ch)->height && (font)->finfo->getglyph && \
+     (font)->finfo->shrink1 == mdvi_shrink_glyph_grey)
+
+static void init_recursive_mutex(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void fontlist_mutex_init(void)
+{
+    /* loading a virtual font references its subfonts */
+    init_recursive_mutex(&fontlist_mutex);
+}
+
+static void fontlist_lock(void)
+{
+    pthread_once(&fontlist_mutex_once, fontlist_mutex_init);
+    pthread_mutex_lock(&fontlist_mutex);
+}
+
+static void fontlist_unlock(void)
+{
+    pthread_mutex_unlock(&fontlist_mutex);
+}
+
+/* 
+ * Locks are taken in this order: a font's lock, then its subfonts' locks
+ * (for virtual fonts), then the font list lock, which loading a virtual
+ * font takes to reference its subfonts. Code that holds the list lock 
+ * only ever tries a font's lock, and skips the font if it is busy.
+ */
+void    font_lock(DviFont *font)
+{
+    pthread_mutex_lock(&font->lock);
+}
+
+void    font_unlock(DviFont *font)
+{
+    pthread_mutex_unlock(&font->lock);
+}
+
+static void glyph_mem_add(size_t *tier, size_t bytes)
+{
+    if(bytes == 0)
+        return;
+    pthread_mutex_lock(&glyph_mem_mutex);
+    *tier += bytes;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+}
+
+static void glyph_mem_sub(size_t *tier, size_t bytes)
+{
+    if(bytes == 0)
+        return;
+    pthread_mutex_lock(&glyph_mem_mutex);
+    *tier -= Min(*tier, bytes);
+    pthread_mutex_unlock(&glyph_mem_mutex);
+}
+
+static size_t glyph_mem_total(void)
+{
+    size_t    total;
+
+    pthread_mutex_lock(&glyph_mem_mutex);
+    total = glyph_mem.raw + glyph_mem.shrunk + glyph_mem.grey;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+    return total;
+}
+
+static Ulong glyph_tick(void)
+{
+    Ulong    now;
+
+    pthread_mutex_lock(&glyph_mem_mutex);
+    now = ++glyph_clock;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+    return now;
+}
+
+void    mdvi_get_glyph_memory(DviGlyphMemory *mem)
+{
+    pthread_mutex_lock(&glyph_mem_mutex);
+    *mem = glyph_mem;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+}
+
+void    mdvi_add_image_memory(long bytes)
+{
+    if(bytes > 0)
+        glyph_mem_add(&glyph_mem.grey, bytes);
+    else
+        glyph_mem_sub(&glyph_mem.grey, -bytes);
+}
+
+void    mdvi_set_glyph_budget(size_t bytes)
+{
+    pthread_mutex_lock(&glyph_mem_mutex);
+    glyph_mem.budget = bytes;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+}
+
 int    font_reopen(DviFont *font)
 {
     if(font->in)
@@ -73,6 +218,7 @@ void    font_drop_one(DviFontRef *ref)
 {
     DviFont *font;
     
+    fontlist_lock();
     font = ref->ref;
     mdvi_free(ref);
     /* drop all children */
@@ -98,6 +244,7 @@ void    font_drop_one(DviFontRef *ref)
     }
     DEBUG((DBG_FONTS, "%s: reference dropped, %d more left\n",
         font->fontname, font->links));
+    fontlist_unlock();
 }
 
 void    font_drop_chain(DviFontRef *head)
@@ -110,15 +257,45 @@ void    font_drop_chain(DviFontRef *head)
     }
 }
 
+/* `dev' may be NULL if the font was never drawn */
+static void destroy_font(DviDevice *dev, DviFont *font)
+{
+    DviFontRef *ref;
+
+    if(font->in)
+        fclose(font->in);
+    /* get rid of subfonts (but can't use `drop_chain' here) */
+    for(; (ref = font->subfonts); ) {
+        font->subfonts = ref->next;
+        mdvi_free(ref);
+    }
+    /* remove this font */
+    font_reset_font_glyphs(dev, font, MDVI_FONTSEL_GLYPH);
+    glcache_close(font);
+    vf_free_code(font);
+    /* let the font destroy its private data */
+    if(font->finfo->freedata)
+        font->finfo->freedata(font);
+    /* destroy characters */
+    if(font->chars)
+        mdvi_free(font->chars);
+    mdvi_free(font->fontname);
+    mdvi_free(font->filename);
+    pthread_mutex_destroy(&font->lock);
+    mdvi_free(font);
+}
+
 int    font_free_unused(DviDevice *dev)
 {
     DviFont    *font, *next;
     int    count = 0;
 
+    ListHead unused;
+
     DEBUG((DBG_FONTS, "destroying unused fonts\n"));    
+    listh_init(&unused);
+    fontlist_lock();
     for(font = (DviFont *)fontlist.head; font; font = next) {
-        DviFontRef *ref;
-        
         next = font->next;
         if(font->links)
             continue;
@@ -126,30 +303,41 @@ int    font_free_unused(DviDevice *dev)
         DEBUG((DBG_FONTS, "removing unused %s font `%s'\n", 
             TYPENAME(font), font->fontname));
         listh_remove(&fontlist, LIST(font));
-        if(font->in)
-            fclose(font->in);
-        /* get rid of subfonts (but can't use `drop_chain' here) */
-        for(; (ref = font->subfonts); ) {
-            font->subfonts = ref->next;
-            mdvi_free(ref);
-        }
-        /* remove this font */
-        font_reset_font_glyphs(dev, font, MDVI_FONTSEL_GLYPH);
-        /* let the font destroy its private data */
-        if(font->finfo->freedata)
-            font->finfo->freedata(font);
-        /* destroy characters */
-        if(font->chars)
-            mdvi_free(font->chars);
-        mdvi_free(font->fontname);
-        mdvi_free(font->filename);
-        mdvi_free(font);
+        listh_append(&unused, LIST(font));
+    }
+    fontlist_unlock();
+    /* nobody can find them now, and destroying them takes their locks */
+    for(font = (DviFont *)unused.head; font; font = next) {
+        next = font->next;
+        destroy_font(dev, font);
     }
     DEBUG((DBG_FONTS, "%d unused fonts removed\n", count));
     return count;
 }
 
-/* used from context: params and device */
+static DviFont *find_font(const char *name, Int32 sum, int hdpi, int vdpi,
+    Int32 scale)
+{
+    DviFont    *font;
+
+    for(font = (DviFont *)fontlist.head; font; font = font->next) {
+        if(strcmp(name, font->fontname) == 0
+           && (!sum || !font->checksum || font->checksum == sum)
+           && font->hdpi == hdpi
+           && font->vdpi == vdpi
+           && font->scale == scale)
+               break;
+    }
+    return font;
+}
+
+/* 
+ * used from context: params and device
+ *
+ * Fonts are looked up and loaded without the font list lock, since that
+ * may have to run mktexpk. Only loaded fonts are put in the list, so if
+ * another thread got there first, we use its copy and throw ours away.
+ */
 DviFontRef *
 font_reference(
     DviParams *params,     /* rendering parameters */
@@ -161,28 +349,48 @@ font_reference(
     Int32 scale)        /* scaling factor (from DVI or VF) */
 {
     DviFont    *font;
+    DviFont    *other;
     DviFontRef *ref;
     DviFontRef *subfont_ref;
     
+    fontlist_lock();
     /* see if there is a font with the same characteristics */
-    for(font = (DviFont *)fontlist.head; font; font = font->next) {
-        if(strcmp(name, font->fontname) == 0
-           && (!sum || !font->checksum || font->checksum == sum)
-           && font->hdpi == hdpi
-           && font->vdpi == vdpi
-           && font->scale == scale)
-               break;
-    }
-    /* try to load the font */
+    font = find_font(name, sum, hdpi, vdpi, scale);
     if(font == NULL) {
+        fontlist_unlock();
+        /* try to load the font */
         font = mdvi_add_font(name, sum, hdpi, vdpi, scale);
         if(font == NULL)
             return NULL;
-        listh_append(&fontlist, LIST(font));
-    }
-    if(!font->links && !font->chars && load_font_file(params, font) < 0) {
-        DEBUG((DBG_FONTS, "font_reference(%s) -> Error\n", name));
-        return NULL;
+        init_recursive_mutex(&font->lock);
+        if(load_font_file(params, font) < 0) {
+            DEBUG((DBG_FONTS, "font_reference(%s) -> Error\n", name));
+            /* the font type already freed its own data */
+            if(font->in)
+                fclose(font->in);
+            font_drop_chain(font->subfonts);
+            mdvi_free(font->fontname);
+            mdvi_free(font->filename);
+            pthread_mutex_destroy(&font->lock);
+            mdvi_free(font);
+            return NULL;
+        }
+        fontlist_lock();
+        other = find_font(name, sum, hdpi, vdpi, scale);
+        if(other) {
+            DEBUG((DBG_FONTS, "%s: loaded twice, using the first one\n",
+                name));
+            /* keep `other' while the list is unlocked */
+            other->links++;
+            fontlist_unlock();
+            font_drop_chain(font->subfonts);
+            font->subfonts = NULL;
+            destroy_font(NULL, font);
+            fontlist_lock();
+            other->links--;
+            font = other;
+        } else
+            listh_append(&fontlist, LIST(font));
     }
     ref = xalloc(DviFontRef);
     ref->ref = font;
@@ -199,6 +407,7 @@ font_reference(
         listh_remove(&fontlist, LIST(font));
         listh_prepend(&fontlist, LIST(font));
     }
+    fontlist_unlock();
 
     DEBUG((DBG_FONTS, "font_reference(%s) -> %d links\n",
         font->fontname, font->links));
@@ -309,6 +518,7 @@ static int load_one_glyph(DviContext *dvi, DviFont *font, int code)
         vs = d / font->vdpi;
         if(ch->width && ch->height && (hs > 1 || vs > 1)) {
             int    h, v;
+            double    hsc, vsc;
             DviGlyph glyph;
             
             DEBUG((DBG_FONTS, 
@@ -316,15 +526,21 @@ static int load_one_glyph(DviContext *dvi, DviFont *font, int code)
                 font->fontname, code, font->hdpi, font->vdpi));
             h = dvi->params.hshrink;
             v = dvi->params.vshrink;
+            hsc = dvi->params.hscale;
+            vsc = dvi->params.vscale;
             d = dvi->params.density;
             dvi->params.hshrink = hs;
             dvi->params.vshrink = vs;
+            dvi->params.hscale = 1.0;
+            dvi->params.vscale = 1.0;
             dvi->params.density = 50;
             /* shrink it */
             font->finfo->shrink0(dvi, font, ch, &glyph);
             /* restore parameters */
             dvi->params.hshrink = h;
             dvi->params.vshrink = v;
+            dvi->params.hscale = hsc;
+            dvi->params.vscale = vsc;
             dvi->params.density = d;
             /* update glyph data */
             if(!MDVI_GLYPH_ISEMPTY(ch->glyph.data))
@@ -342,9 +558,156 @@ static int load_one_glyph(DviContext *dvi, DviFont *font, int code)
     return 0;
 }
 
-DviFontChar *font_get_glyph(DviContext *dvi, DviFont *font, int code)
+/* 
+ * Scaled glyphs are kept for the last few shrinking factors and colors
+ * they were requested with, so that going back and forth between zoom 
+ * levels doesn't shrink everything again. The glyph's `shrunk' and `grey'
+ * always hold the ones for the current request.
+ */
+#define VARIANT_MATCHES(v, hs, vs, fg, bg, gamma, aa) \
+    ((v)->hshrink == (hs) && (v)->vshrink == (vs) && \
+     (!(aa) || (v)->grey.data == NULL || \
+      ((v)->fg == (fg) && (v)->bg == (bg) && (v)->gamma == (gamma))))
+
+static void free_variant(DviDevice *dev, DviGlyphVariant *v)
+{
+    glyph_mem_sub(&glyph_mem.shrunk, BITMAP_MEM(v->shrunk.data));
+    glyph_mem_sub(&glyph_mem.grey, IMAGE_MEM(dev, &v->grey));
+    if(MDVI_GLYPH_NONEMPTY(v->shrunk.data))
+        bitmap_destroy((BITMAP *)v->shrunk.data);
+    if(MDVI_GLYPH_NONEMPTY(v->grey.data) && dev->free_image)
+        dev->free_image(v->grey.data);
+}
+
+static void select_variant(DviContext *dvi, DviFontChar *ch)
+{
+    double    hs = MDVI_HSHRINK(&dvi->params);
+    double    vs = MDVI_VSHRINK(&dvi->params);
+    Ulong    fg = MDVI_GLYPHFG(dvi);
+    Ulong    bg = MDVI_GLYPHBG(dvi);
+    double    gamma = dvi->params.gamma;
+    int    aa = MDVI_ENABLED(dvi, MDVI_PARAM_ANTIALIASED);
+    DviGlyphVariant curr, found;
+    int    i;
+
+    if(VARIANT_MATCHES(ch, hs, vs, fg, bg, gamma, aa))
+        return;
+
+    /* look for it among the ones we kept */
+    for(i = 0; i < ch->nvariants; i++) {
+        if(VARIANT_MATCHES(&ch->variants[i], hs, vs, fg, bg, gamma, aa))
+            break;
+    }
+    if(i < ch->nvariants) {
+        found = ch->variants[i];
+        ch->nvariants--;
+        memmove(&ch->variants[i], &ch->variants[i + 1],
+            (ch->nvariants - i) * sizeof(DviGlyphVariant));
+    } else {
+        found.hshrink = hs;
+        found.vshrink = vs;
+        found.fg = fg;
+        found.bg = bg;
+        found.gamma = gamma;
+        found.shrunk.data = NULL;
+        found.grey.data = NULL;
+    }
+
+    /* keep the current one, dropping the least recently used */
+    if(ch->shrunk.data || ch->grey.data) {
+        curr.hshrink = ch->hshrink;
+        curr.vshrink = ch->vshrink;
+        curr.fg = ch->fg;
+        curr.bg = ch->bg;
+        curr.gamma = ch->gamma;
+        curr.shrunk = ch->shrunk;
+        curr.grey = ch->grey;
+        if(ch->variants == NULL)
+            ch->variants = xnalloc(DviGlyphVariant, MDVI_GLYPH_VARIANTS);
+        if(ch->nvariants == MDVI_GLYPH_VARIANTS)
+            free_variant(&dvi->device, &ch->variants[--ch->nvariants]);
+        memmove(&ch->variants[1], &ch->variants[0],
+            ch->nvariants * sizeof(DviGlyphVariant));
+        ch->variants[0] = curr;
+        ch->nvariants++;
+    }
+
+    ch->hshrink = found.hshrink;
+    ch->vshrink = found.vshrink;
+    ch->fg = found.fg;
+    ch->bg = found.bg;
+    ch->gamma = found.gamma;
+    ch->shrunk = found.shrunk;
+    ch->grey = found.grey;
+}
+
+/* get the grey glyph from the on-disk cache, without loading the glyph */
+static int grey_from_cache(DviContext *dvi, DviFont *font, DviFontChar *ch,
+    int code)
+{
+    DviGlyph grey;
+    const Uchar *cov;
+
+    select_variant(dvi, ch);
+    if(ch->grey.data && !MDVI_GLYPH_ISEMPTY(ch->grey.data))
+        return 1;
+    if(!glcache_get(dvi, font, code, &grey, &cov) ||
+       mdvi_grey_glyph(dvi, ch, &grey, cov) < 0)
+        return 0;
+    ch->grey = grey;
+    ch->gamma = dvi->params.gamma;
+    glyph_mem_add(&glyph_mem.grey, IMAGE_MEM(&dvi->device, &ch->grey));
+    return 1;
+}
+
+/* 
+ * Make the scaled glyph for `ch' in `dest'. When it goes to the on-disk
+ * cache, `*cov' gets what to save there. This only looks at `ch', so it
+ * can work on a copy of it while the font is unlocked.
+ */
+static void scale_glyph(DviContext *dvi, DviFont *font, DviFontChar *ch,
+    DviGlyph *dest, Uchar **cov)
+{
+    *cov = NULL;
+    if(MDVI_DISABLED(dvi, MDVI_PARAM_ANTIALIASED))
+        font->finfo->shrink0(dvi, font, ch, dest);
+    else if(CACHES_GREY(dvi, font, ch)) {
+        /* same as shrink1, but we keep the coverage for the cache */
+        *cov = mdvi_glyph_coverage(dvi, ch, dest);
+        if(mdvi_grey_glyph(dvi, ch, dest, *cov) < 0) {
+            mdvi_free(*cov);
+            *cov = NULL;
+            mdvi_shrink_glyph(dvi, font, ch, dest);
+        }
+    } else
+        font->finfo->shrink1(dvi, font, ch, dest);
+}
+
+/* account for the glyph scale_glyph() made, now in `ch' */
+static void add_scaled(DviContext *dvi, DviFont *font, DviFontChar *ch,
+    int code, Uchar *cov)
+{
+    if(MDVI_DISABLED(dvi, MDVI_PARAM_ANTIALIASED)) {
+        glyph_mem_add(&glyph_mem.shrunk, BITMAP_MEM(ch->shrunk.data));
+        return;
+    }
+    if(cov) {
+        glcache_put(dvi, font, code, &ch->grey, cov);
+        mdvi_free(cov);
+    }
+    ch->gamma = dvi->params.gamma;
+    glyph_mem_add(&glyph_mem.grey, IMAGE_MEM(&dvi->device, &ch->grey));
+}
+
+/* 
+ * With `later' set, the scaled glyph is not made, and `*later' says
+ * whether it still has to be.
+ */
+static DviFontChar *get_glyph(DviContext *dvi, DviFont *font, int code,
+    int *later)
 {
     DviFontChar *ch;
+    Uchar    *cov;
 
 again:
     /* if we have not loaded the font yet, do so now */
@@ -355,56 +718,179 @@ again:
     ch = FONTCHAR(font, code);
     if(!ch || !glyph_present(ch))
         return NULL;
-    if(!ch->loaded && load_one_glyph(dvi, font, code) == -1) {
-        if(font->chars == NULL) {
-            /* we need to try another font class */
-            goto again;
+    if(!ch->loaded) {
+        if(CACHES_GREY(dvi, font, ch) && 
+           grey_from_cache(dvi, font, ch, code)) {
+            ch->lastuse = glyph_tick();
+            return ch;
         }
-        return NULL;
+        if(load_one_glyph(dvi, font, code) == -1) {
+            if(font->chars == NULL) {
+                /* we need to try another font class */
+                goto again;
+            }
+            return NULL;
+        }
+        /* yes, we have to do this again */
+        ch = FONTCHAR(font, code);
+        glyph_mem_add(&glyph_mem.raw, BITMAP_MEM(ch->glyph.data));
     }
-    /* yes, we have to do this again */
-    ch = FONTCHAR(font, code);
+    ch->lastuse = glyph_tick();
 
-    /* Got the glyph. If we also have the right scaled glyph, do no more */
+    /* get the scaled glyphs made for our parameters in place */
+    if(ch->width && ch->height && font->finfo->getglyph)
+        select_variant(dvi, ch);
+
+    /* 
+     * Got the glyph. If we also have the right scaled glyph, do no more.
+     * Grey glyphs are made even when not shrinking, since devices that
+     * draw through them have nothing else to use.
+     */
     if(!ch->width || !ch->height ||
        font->finfo->getglyph == NULL ||
-       (dvi->params.hshrink == 1 && dvi->params.vshrink == 1))
+       (MDVI_HSHRINK(&dvi->params) == 1 && MDVI_VSHRINK(&dvi->params) == 1 &&
+        MDVI_DISABLED(dvi, MDVI_PARAM_ANTIALIASED)))
         return ch;
     
     /* If the glyph is empty, we just need to shrink the box */
     if(ch->missing || MDVI_GLYPH_ISEMPTY(ch->glyph.data)) {
-        if(MDVI_GLYPH_UNSET(ch->shrunk.data))
+        if(MDVI_GLYPH_UNSET(ch->shrunk.data)) {
             mdvi_shrink_box(dvi, font, ch, &ch->shrunk);
+            glyph_mem_add(&glyph_mem.shrunk, BITMAP_MEM(ch->shrunk.data));
+        }
         return ch;
     } else if(MDVI_ENABLED(dvi, MDVI_PARAM_ANTIALIASED)) {
+        /* select_variant() made sure the colors are right */
         if(ch->grey.data && 
-           !MDVI_GLYPH_ISEMPTY(ch->grey.data) &&
-           ch->fg == dvi->curr_fg && 
-           ch->bg == dvi->curr_bg)
+           !MDVI_GLYPH_ISEMPTY(ch->grey.data))
                return ch;
-        if(ch->grey.data &&
-           !MDVI_GLYPH_ISEMPTY(ch->grey.data)) {
-            if(dvi->device.free_image)
-                dvi->device.free_image(ch->grey.data);
-            ch->grey.data = NULL;
+        if(later) {
+            *later = 1;
+            return ch;
         }
-        font->finfo->shrink1(dvi, font, ch, &ch->grey);
-    } else if(!ch->shrunk.data)
-        font->finfo->shrink0(dvi, font, ch, &ch->shrunk);
+        scale_glyph(dvi, font, ch, &ch->grey, &cov);
+        add_scaled(dvi, font, ch, code, cov);
+    } else if(!ch->shrunk.data) {
+        if(later) {
+            *later = 1;
+            return ch;
+        }
+        scale_glyph(dvi, font, ch, &ch->shrunk, &cov);
+        add_scaled(dvi, font, ch, code, cov);
+    }
+
+    return ch;
+}
 
+DviFontChar *font_get_glyph(DviContext *dvi, DviFont *font, int code)
+{
+    DviFontChar *ch;
+
+    font_lock(font);
+    ch = get_glyph(dvi, font, code, NULL);
+    font_unlock(font);
     return ch;
 }
 
+/* 
+ * Load a glyph ahead of drawing it. The glyph is read under the font's
+ * lock, since the font classes read it into the font itself, but it is
+ * scaled from a copy with the lock released, so that other threads can
+ * work on the same font meanwhile. Fonts with their own way of scaling
+ * are scaled under the lock, as font_get_glyph() would.
+ */
+void    font_preload_glyph(DviContext *dvi, DviFont *font, int code)
+{
+    DviFontChar *ch;
+    DviFontChar copy;
+    DviGlyph scaled;
+    Uchar    *cov;
+    int    later = 0;
+    int    aa = MDVI_ENABLED(dvi, MDVI_PARAM_ANTIALIASED);
+
+    font_lock(font);
+    ch = get_glyph(dvi, font, code, &later);
+    if(ch == NULL || !later) {
+        font_unlock(font);
+        return;
+    }
+    if((aa && font->finfo->shrink1 != mdvi_shrink_glyph_grey) ||
+       (!aa && font->finfo->shrink0 != mdvi_shrink_glyph) ||
+       !MDVI_GLYPH_NONEMPTY(ch->glyph.data)) {
+        get_glyph(dvi, font, code, NULL);
+        font_unlock(font);
+        return;
+    }
+    /* the budget may take the bitmap away while we work */
+    copy = *ch;
+    copy.glyph.data = bitmap_copy((BITMAP *)ch->glyph.data);
+    font_unlock(font);
+
+    scaled.data = NULL;
+    scale_glyph(dvi, font, &copy, &scaled, &cov);
+    bitmap_destroy((BITMAP *)copy.glyph.data);
+
+    /* someone may have made it, or changed scales, meanwhile */
+    font_lock(font);
+    ch = FONTCHAR(font, code);
+    if(glyph_present(ch) && ch->hshrink == copy.hshrink && 
+       ch->vshrink == copy.vshrink) {
+        if(aa && ch->grey.data == NULL) {
+            ch->grey = scaled;
+            ch->fg = copy.fg;
+            ch->bg = copy.bg;
+            add_scaled(dvi, font, ch, code, cov);
+            scaled.data = NULL;
+            cov = NULL;
+        } else if(!aa && ch->shrunk.data == NULL) {
+            ch->shrunk = scaled;
+            add_scaled(dvi, font, ch, code, cov);
+            scaled.data = NULL;
+        }
+    }
+    font_unlock(font);
+    if(cov)
+        mdvi_free(cov);
+    if(MDVI_GLYPH_NONEMPTY(scaled.data)) {
+        if(!aa)
+            bitmap_destroy((BITMAP *)scaled.data);
+        else if(dvi->device.free_image)
+            dvi->device.free_image(scaled.data);
+    }
+}
+
+DviFontChar *font_get_char(DviContext *dvi, DviFont *font, int code)
+{
+    DviFontChar *ch = NULL;
+
+    font_lock(font);
+    if(font->chars || load_font_file(&dvi->params, font) == 0)
+        ch = FONTCHAR(font, code);
+    font_unlock(font);
+    return glyph_present(ch) ? ch : NULL;
+}
+
 void    font_reset_one_glyph(DviDevice *dev, DviFontChar *ch, int what)
 {
+    int    i;
+
     if(!glyph_present(ch))
         return;
+    if(ch->variants && (what & (MDVI_FONTSEL_BITMAP|MDVI_FONTSEL_GREY))) {
+        for(i = 0; i < ch->nvariants; i++)
+            free_variant(dev, &ch->variants[i]);
+        mdvi_free(ch->variants);
+        ch->variants = NULL;
+        ch->nvariants = 0;
+    }
     if(what & MDVI_FONTSEL_BITMAP) {
+        glyph_mem_sub(&glyph_mem.shrunk, BITMAP_MEM(ch->shrunk.data));
         if(MDVI_GLYPH_NONEMPTY(ch->shrunk.data))
             bitmap_destroy((BITMAP *)ch->shrunk.data);
         ch->shrunk.data = NULL;
     }
     if(what & MDVI_FONTSEL_GREY) {
+        glyph_mem_sub(&glyph_mem.grey, IMAGE_MEM(dev, &ch->grey));
         if(MDVI_GLYPH_NONEMPTY(ch->grey.data)) {
             if(dev->free_image)
                 dev->free_image(ch->grey.data);
@@ -412,6 +898,7 @@ void    font_reset_one_glyph(DviDevice *dev, DviFontChar *ch, int what)
         ch->grey.data = NULL;
     }
     if(what & MDVI_FONTSEL_GLYPH) {
+        glyph_mem_sub(&glyph_mem.raw, BITMAP_MEM(ch->glyph.data));
         if(MDVI_GLYPH_NONEMPTY(ch->glyph.data))
             bitmap_destroy((BITMAP *)ch->glyph.data);
         ch->glyph.data = NULL;
@@ -419,6 +906,137 @@ void    font_reset_one_glyph(DviDevice *dev, DviFontChar *ch, int what)
     }
 }
 
+static int compare_groups(const void *p1, const void *p2)
+{
+    const GlyphUse *a = (const GlyphUse *)p1;
+    const GlyphUse *b = (const GlyphUse *)p2;
+
+    if(a->group != b->group)
+        return ((char *)a->group < (char *)b->group) ? -1 : 1;
+    return 0;
+}
+
+/* oldest storage first, keeping the glyphs that share it together */
+static int compare_uses(const void *p1, const void *p2)
+{
+    const GlyphUse *a = (const GlyphUse *)p1;
+    const GlyphUse *b = (const GlyphUse *)p2;
+
+    if(a->grouped != b->grouped)
+        return (a->grouped < b->grouped) ? -1 : 1;
+    if(a->group != b->group)
+        return compare_groups(p1, p2);
+    return (a->lastuse < b->lastuse ? -1 : a->lastuse > b->lastuse);
+}
+
+#define GLYPH_HOLDS_MEMORY(ch) \
+    (MDVI_GLYPH_NONEMPTY((ch)->glyph.data) || \
+     MDVI_GLYPH_NONEMPTY((ch)->shrunk.data) || \
+     MDVI_GLYPH_NONEMPTY((ch)->grey.data) || (ch)->nvariants)
+
+/* 
+ * Must be called with no font locks held. Fonts that are busy are 
+ * skipped, they will be looked at next time. When the device packs
+ * images together, the storage is only freed with the last image in it,
+ * so glyphs are dropped a whole storage at a time, by its last use.
+ */
+void    font_enforce_budget(DviDevice *dev)
+{
+    GlyphUse *uses = NULL;
+    int    nuses = 0;
+    int    maxuses = 0;
+    size_t    budget;
+    size_t    target;
+    DviFont    *font;
+    DviFontChar *ch;
+    int    i, j;
+
+    pthread_mutex_lock(&glyph_mem_mutex);
+    budget = glyph_mem.budget;
+    pthread_mutex_unlock(&glyph_mem_mutex);
+    if(budget == 0 || glyph_mem_total() <= budget)
+        return;
+    /* leave some room, so we don't come back here on every page */
+    target = budget - budget / 4;
+
+    fontlist_lock();
+    for(font = (DviFont *)fontlist.head; font; font = font->next) {
+        if(!font->chars || pthread_mutex_trylock(&font->lock) != 0)
+            continue;
+        for(i = font->loc; i <= font->hic; i++) {
+            ch = FONTCHAR(font, i);
+            if(!glyph_present(ch) || !GLYPH_HOLDS_MEMORY(ch))
+                continue;
+            if(nuses == maxuses) {
+                maxuses = maxuses ? 2 * maxuses : 256;
+                uses = xresize(uses, GlyphUse, maxuses);
+            }
+            uses[nuses].font = font;
+            uses[nuses].code = i;
+            uses[nuses].lastuse = ch->lastuse;
+            uses[nuses].group = NULL;
+            if(dev->image_group && MDVI_GLYPH_NONEMPTY(ch->grey.data))
+                uses[nuses].group = dev->image_group(ch->grey.data);
+            uses[nuses].grouped = ch->lastuse;
+            nuses++;
+        }
+        font_unlock(font);
+    }
+    if(dev->image_group) {
+        qsort(uses, nuses, sizeof(GlyphUse), compare_groups);
+        for(i = 0; i < nuses; i = j) {
+            Ulong    last = uses[i].lastuse;
+
+            for(j = i + 1; j < nuses && uses[i].group &&
+                uses[j].group == uses[i].group; j++)
+                last = Max(last, uses[j].lastuse);
+            while(i < j)
+                uses[i++].grouped = last;
+        }
+    }
+    qsort(uses, nuses, sizeof(GlyphUse), compare_uses);
+
+    /* finish the storage we started on, or nothing is freed */
+    for(i = 0; i < nuses && (glyph_mem_total() > target ||
+        (i > 0 && uses[i].group && uses[i].group == uses[i - 1].group)); 
+        i++) {
+        font = uses[i].font;
+        if(pthread_mutex_trylock(&font->lock) != 0)
+            continue;
+        /* skip glyphs that were used since we looked */
+        ch = FONTCHAR(font, uses[i].code);
+        if(ch && ch->lastuse == uses[i].lastuse)
+            font_reset_one_glyph(dev, ch, MDVI_FONTSEL_GLYPH|
+                MDVI_FONTSEL_BITMAP|MDVI_FONTSEL_GREY);
+        font_unlock(font);
+    }
+    fontlist_unlock();
+
+    DEBUG((DBG_FONTS, "glyph budget: went through %d of %d glyphs\n", 
+        i, nuses));
+    if(uses)
+        mdvi_free(uses);
+}
+
+/* 
+ * Save the glyphs made since the last call. This writes files, so it is
+ * not done while drawing pages; fonts save their glyphs anyway when they
+ * are freed. Like font_enforce_budget, this skips fonts that are busy.
+ */
+void    font_flush_glyph_cache(void)
+{
+    DviFont    *font;
+
+    fontlist_lock();
+    for(font = (DviFont *)fontlist.head; font; font = font->next) {
+        if(!font->glcache || pthread_mutex_trylock(&font->lock) != 0)
+            continue;
+        glcache_flush(font);
+        font_unlock(font);
+    }
+    fontlist_unlock();
+}
+
 void    font_reset_font_glyphs(DviDevice *dev, DviFont *font, int what)
 {
     int    i;
@@ -426,6 +1044,7 @@ void    font_reset_font_glyphs(DviDevice *dev, DviFont *font, int what)
     
     if(what & MDVI_FONTSEL_GLYPH)
         what |= MDVI_FONTSEL_BITMAP|MDVI_FONTSEL_GREY;    
+    font_lock(font);
     if(font->subfonts) {
         DviFontRef *ref;
         
@@ -437,8 +1056,10 @@ void    font_reset_font_glyphs(DviDevice *dev, DviFont *font, int what)
         fclose(font->in);
         font->in = NULL;
     }
-    if(font->finfo->getglyph == NULL)
+    if(font->finfo->getglyph == NULL) {
+        font_unlock(font);
         return;
+    }
     DEBUG((DBG_FONTS, "resetting glyphs in font `%s'\n", font->fontname));
     for(ch = font->chars, i = font->loc; i <= font->hic; ch++, i++) {
         if(glyph_present(ch))
@@ -446,6 +1067,7 @@ void    font_reset_font_glyphs(DviDevice *dev, DviFont *font, int what)
     }
     if((what & MDVI_FONTSEL_GLYPH) && font->finfo->reset)
         font->finfo->reset(font);
+    font_unlock(font);
 }    
 
 void    font_reset_chain_glyphs(DviDevice *dev, DviFontRef *head, int what)
@@ -456,16 +1078,48 @@ void    font_reset_chain_glyphs(DviDevice *dev, DviFontRef *head, int what)
         font_reset_font_glyphs(dev, ref->ref, what);
 }
 
-static int compare_refs(const void *p1, const void *p2)
+/* 
+ * Font ids are hashed into a table with at least twice as many slots as
+ * there are fonts, and collisions go to the next free slot. Ids are 
+ * usually small and dense, so most of them just index the table.
+ */
+DviFontRef **font_build_map(DviFontRef *refs, Uint *mask)
 {
-    return ((*(DviFontRef **)p1)->fontid - (*(DviFontRef **)p2)->fontid);
+    DviFontRef **map, *ref;
+    Uint    size, i;
+    int    n;
+
+    for(n = 0, ref = refs; ref; ref = ref->next)
+        n++;
+    for(size = 8; size < 2 * n; size <<= 1)
+        ;
+    map = xnalloc(DviFontRef *, size);
+    memset(map, 0, size * sizeof(DviFontRef *));
+    for(ref = refs; ref; ref = ref->next) {
+        /* if an id is defined twice, the first one wins */
+        for(i = (Uint)ref->fontid & (size - 1); map[i]; i = (i + 1) & (size - 1))
+            if(map[i]->fontid == ref->fontid)
+                break;
+        if(map[i] == NULL)
+            map[i] = ref;
+    }
+    *mask = size - 1;
+    return map;
+}
+
+DviFontRef *font_map_find(DviFontRef **map, Uint mask, Int32 id)
+{
+    Uint    i;
+
+    /* there is always a free slot to stop at */
+    for(i = (Uint)id & mask; map[i]; i = (i + 1) & mask)
+        if(map[i]->fontid == id)
+            return map[i];
+    return NULL;
 }
 
 void    font_finish_definitions(DviContext *dvi)
 {
-    int    count;
-    DviFontRef **map, *ref;
-    
     /* first get rid of unused fonts */
     font_free_unused(&dvi->device);
 
@@ -473,12 +1127,7 @@ void    font_finish_definitions(DviContext *dvi)
         mdvi_warning(_("%s: no fonts defined\n"), dvi->filename);
         return;
     }
-    map = xnalloc(DviFontRef *, dvi->nfonts);
-    for(count = 0, ref = dvi->fonts; ref; ref = ref->next)
-        map[count++] = ref;
-    /* sort the array by font id */
-    qsort(map, dvi->nfonts, sizeof(DviFontRef *), compare_refs);
-    dvi->fontmap = map;
+    dvi->fontmap = font_build_map(dvi->fonts, &dvi->fontmask);
 }
 
 DviFontRef *font_find_flat(DviContext *dvi, Int32 id)
@@ -493,26 +1142,18 @@ DviFontRef *font_find_flat(DviContext *dvi, Int32 id)
 
 DviFontRef *font_find_mapped(DviContext *dvi, Int32 id)
 {
-    int    lo, hi, n;
-    DviFontRef **map;
-    
-    /* do a binary search */
-    lo = 0; hi = dvi->nfonts;
-    map = dvi->fontmap;
-    while(lo < hi) {
-        int    sign;
-        
-        n = (hi + lo) >> 1;
-        sign = (map[n]->fontid - id);
-        if(sign == 0)
-            break;
-        else if(sign < 0)
-            lo = n;
-        else
-            hi = n;
-    }
-    if(lo >= hi)
+    if(dvi->fontmap == NULL)
         return NULL;
-    return map[n];
+    return font_map_find(dvi->fontmap, dvi->fontmask, id);
+}
+
+/* a subfont of the virtual font whose macro is running */
+DviFontRef *font_find_sub(DviContext *dvi, Int32 id)
+{
+    DviFont    *font = dvi->macrofont;
+
+    if(font == NULL || font->submap == NULL)
+        return font_find_flat(dvi, id);
+    return font_map_find(font->submap, font->submask, id);
 }
 
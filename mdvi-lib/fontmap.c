@@ -44,6 +44,11 @@ typedef struct _PSFontMap {
     char    *fullname;
 } PSFontMap;
 
+/* 
+ * All the state below is protected by the lookup lock. The public 
+ * functions take it and call their do_* counterparts.
+ */
+
 /* these variables control PS font maps */
 static char *pslibdir = NULL;    /* path where we look for PS font maps */
 static char *psfontdir = NULL;    /* PS font search path */
@@ -356,7 +361,7 @@ static DviEncoding *register_encoding(const char *basefile, int replace)
     return enc;
 }
 
-DviEncoding *mdvi_request_encoding(const char *name)
+static DviEncoding *do_request_encoding(const char *name)
 {
     DviEncoding *enc = find_encoding(name);
 
@@ -389,7 +394,17 @@ DviEncoding *mdvi_request_encoding(const char *name)
     return enc;
 }
 
-void    mdvi_release_encoding(DviEncoding *enc, int should_free)
+DviEncoding *mdvi_request_encoding(const char *name)
+{
+    DviEncoding    *result;
+
+    mdvi_lookup_lock();
+    result = do_request_encoding(name);
+    mdvi_lookup_unlock();
+    return result;
+}
+
+static void do_release_encoding(DviEncoding *enc, int should_free)
 {
     /* ignore our static encoding */
     if(enc == tex_text_encoding)
@@ -400,7 +415,14 @@ void    mdvi_release_encoding(DviEncoding *enc, int should_free)
     mdvi_hash_reset(&enc->nametab, 1); /* we'll reuse it */
 }
 
-int    mdvi_encode_glyph(DviEncoding *enc, const char *name)
+void    mdvi_release_encoding(DviEncoding *enc, int should_free)
+{
+    mdvi_lookup_lock();
+    do_release_encoding(enc, should_free);
+    mdvi_lookup_unlock();
+}
+
+static int do_encode_glyph(DviEncoding *enc, const char *name)
 {
     void    *data;
     
@@ -412,6 +434,16 @@ int    mdvi_encode_glyph(DviEncoding *enc, const char *name)
     return (Ptr2Int(data) - 1);
 }
 
+int    mdvi_encode_glyph(DviEncoding *enc, const char *name)
+{
+    int    result;
+
+    mdvi_lookup_lock();
+    result = do_encode_glyph(enc, name);
+    mdvi_lookup_unlock();
+    return result;
+}
+
 /****************
  * Fontmaps     *
  ****************/
@@ -460,7 +492,7 @@ static void print_ent(DviFontMapEnt *ent)
 }
 #endif
 
-DviFontMapEnt    *mdvi_load_fontmap(const char *file)
+static DviFontMapEnt *do_load_fontmap(const char *file)
 {
     char    *ptr;
     FILE    *in;
@@ -604,6 +636,16 @@ DviFontMapEnt    *mdvi_load_fontmap(const char *file)
     return (DviFontMapEnt *)list.head;
 }
 
+DviFontMapEnt    *mdvi_load_fontmap(const char *file)
+{
+    DviFontMapEnt    *result;
+
+    mdvi_lookup_lock();
+    result = do_load_fontmap(file);
+    mdvi_lookup_unlock();
+    return result;
+}
+
 static void free_ent(DviFontMapEnt *ent)
 {
     ASSERT(ent->fontname != NULL);
@@ -621,7 +663,7 @@ static void free_ent(DviFontMapEnt *ent)
     mdvi_free(ent);
 }
 
-void    mdvi_install_fontmap(DviFontMapEnt *head)
+static void do_install_fontmap(DviFontMapEnt *head)
 {
     DviFontMapEnt *ent, *next;
 
@@ -644,6 +686,13 @@ void    mdvi_install_fontmap(DviFontMapEnt *head)
     }
 }
 
+void    mdvi_install_fontmap(DviFontMapEnt *head)
+{
+    mdvi_lookup_lock();
+    do_install_fontmap(head);
+    mdvi_lookup_unlock();
+}
+
 static void init_static_encoding()
 {
     DviEncoding    *encoding;
@@ -798,7 +847,7 @@ static int    mdvi_init_fontmaps(void)
     return count;
 }
 
-int    mdvi_query_fontmap(DviFontMapInfo *info, const char *fontname)
+static int do_query_fontmap(DviFontMapInfo *info, const char *fontname)
 {
     DviFontMapEnt *ent;
 
@@ -818,7 +867,17 @@ int    mdvi_query_fontmap(DviFontMapInfo *info, const char *fontname)
     return 0;    
 }
 
-int    mdvi_add_fontmap_file(const char *name, const char *fullpath)
+int    mdvi_query_fontmap(DviFontMapInfo *info, const char *fontname)
+{
+    int    result;
+
+    mdvi_lookup_lock();
+    result = do_query_fontmap(info, fontname);
+    mdvi_lookup_unlock();
+    return result;
+}
+
+static int do_add_fontmap_file(const char *name, const char *fullpath)
 {
     DviFontMapEnt *ent;
     
@@ -833,8 +892,18 @@ int    mdvi_add_fontmap_file(const char *name, const char *fullpath)
     return 0;
 }
 
+int    mdvi_add_fontmap_file(const char *name, const char *fullpath)
+{
+    int    result;
 
-void    mdvi_flush_encodings(void)
+    mdvi_lookup_lock();
+    result = do_add_fontmap_file(name, fullpath);
+    mdvi_lookup_unlock();
+    return result;
+}
+
+
+static void do_flush_encodings(void)
 {
     DviEncoding *enc;
 
@@ -858,7 +927,14 @@ void    mdvi_flush_encodings(void)
     mdvi_hash_reset(&enctable_file, 0);    
 }
 
-void    mdvi_flush_fontmaps(void)
+void    mdvi_flush_encodings(void)
+{
+    mdvi_lookup_lock();
+    do_flush_encodings();
+    mdvi_lookup_unlock();
+}
+
+static void do_flush_fontmaps(void)
 {
     DviFontMapEnt *ent;
     
@@ -874,6 +950,13 @@ void    mdvi_flush_fontmaps(void)
     fontmaps_loaded = 0;
 }
 
+void    mdvi_flush_fontmaps(void)
+{
+    mdvi_lookup_lock();
+    do_flush_fontmaps();
+    mdvi_lookup_unlock();
+}
+
 /* reading of PS fontmaps */
 
 void    ps_init_default_paths(void)
@@ -896,7 +979,7 @@ void    ps_init_default_paths(void)
     psinitialized = 1;
 }
 
-int    mdvi_ps_read_fontmap(const char *name)
+static int do_ps_read_fontmap(const char *name)
 {
     char    *fullname;
     FILE    *in;
@@ -989,7 +1072,17 @@ int    mdvi_ps_read_fontmap(const char *name)
     return 0;
 }
 
-void    mdvi_ps_flush_fonts(void)
+int    mdvi_ps_read_fontmap(const char *name)
+{
+    int    result;
+
+    mdvi_lookup_lock();
+    result = do_ps_read_fontmap(name);
+    mdvi_lookup_unlock();
+    return result;
+}
+
+static void do_ps_flush_fonts(void)
 {
     PSFontMap *map;
     
@@ -1018,7 +1111,14 @@ void    mdvi_ps_flush_fonts(void)
     psinitialized = 0;
 }
 
-char    *mdvi_ps_find_font(const char *psname)
+void    mdvi_ps_flush_fonts(void)
+{
+    mdvi_lookup_lock();
+    do_ps_flush_fonts();
+    mdvi_lookup_unlock();
+}
+
+static char *do_ps_find_font(const char *psname)
 {
     PSFontMap *map, *smap;
     char    *filename;
@@ -1058,6 +1158,16 @@ char    *mdvi_ps_find_font(const char *psname)
     return filename;
 }
 
+char    *mdvi_ps_find_font(const char *psname)
+{
+    char    *result;
+
+    mdvi_lookup_lock();
+    result = do_ps_find_font(psname);
+    mdvi_lookup_unlock();
+    return result;
+}
+
 /*
  * To get metric info for a font, we proceed as follows:
  *  - We try to find NAME.<tfm,ofm,afm>.
@@ -1078,7 +1188,7 @@ char    *mdvi_ps_find_font(const char *psname)
  * not modify the returned data at all, and it should be disposed with
  * free_font_metrics().
  */
-TFMInfo *mdvi_ps_get_metrics(const char *fontname)
+static TFMInfo *do_ps_get_metrics(const char *fontname)
 {
     TFMInfo *info;
     DviFontMapInfo map;
@@ -1176,3 +1286,13 @@ TFMInfo *mdvi_ps_get_metrics(const char *fontname)
     
     return info;
 }
+
+TFMInfo *mdvi_ps_get_metrics(const char *fontname)
+{
+    TFMInfo    *result;
+
+    mdvi_lookup_lock();
+    result = do_ps_get_metrics(fontname);
+    mdvi_lookup_unlock();
+    return result;
+}
@@ -47,11 +47,14 @@
  * fonts are configured.
  */
 
-#include "mdvi.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <kpathsea/expand.h>
+#include <kpathsea/pathsearch.h>
 
-#define HAVE_PROTOTYPES 1
-#include <kpathsea/tex-file.h>
-#include <kpathsea/tex-glyph.h>
+#include "mdvi.h"
+#include "private.h"
 
 struct _DviFontClass {
     DviFontClass *next;
@@ -68,6 +71,28 @@ char *_mdvi_fallback_font = MDVI_FALLBACK_FONT;
 static ListHead font_classes[MAX_CLASS];
 static int initialized = 0;
 
+/*
+ * Results of lookup_font(), so each font is searched for only once.
+ * Lookups that found a font are also saved to a file, if one was set, so
+ * later sessions don't have to search either. The file is started over
+ * when any ls-R database or texmf.cnf changes. All of this is protected
+ * by the lookup lock.
+ */
+typedef struct {
+    char    *filename;    /* NULL if the font was not found */
+    Ushort    hdpi;
+    Ushort    vdpi;
+} LookupEntry;
+
+#define LOOKUP_HASH_SIZE    131
+#define LOOKUP_LINE_MAX        2048
+#define LOOKUP_MAGIC        "mdvi-lookups 1"
+
+static DviHashTable lookup_cache;
+static int lookup_cache_ready = 0;
+static char *lookup_cache_file = NULL;
+static FILE *lookup_cache_out = NULL;
+
 static void init_font_classes(void)
 {
     int    i;
@@ -92,6 +117,7 @@ char    **mdvi_list_font_class(int klass)
         klass = MAX_CLASS-1;
     if(klass < 0 || klass >= MAX_CLASS)
         return NULL;
+    mdvi_lookup_lock();
     n = font_classes[klass].count;
     list = xnalloc(char *, n + 1);
     fc = (DviFontClass *)font_classes[klass].head;
@@ -99,6 +125,7 @@ char    **mdvi_list_font_class(int klass)
         list[i] = mdvi_strdup(fc->info.name);
     }
     list[i] = NULL;
+    mdvi_lookup_unlock();
     return list;
 }
 
@@ -110,6 +137,7 @@ int    mdvi_register_font_type(DviFontInfo *info, int klass)
         klass = MAX_CLASS-1;
     if(klass < 0 || klass >= MAX_CLASS)
         return -1;
+    mdvi_lookup_lock();
     if(!initialized)
         init_font_classes();
     fc = xalloc(struct _DviFontClass);
@@ -126,6 +154,7 @@ int    mdvi_register_font_type(DviFontInfo *info, int klass)
     fc->info.lookup = info->lookup;
     fc->info.kpse_type = info->kpse_type;
     listh_append(&font_classes[klass], LIST(fc));
+    mdvi_lookup_unlock();
     return 0;
 }
 
@@ -137,6 +166,7 @@ int    mdvi_unregister_font_type(const char *name, int klass)
     if(klass == -1)
         klass = MAX_CLASS - 1;
     
+    mdvi_lookup_lock();
     if(klass >= 0 && klass < MAX_CLASS) {
         k = klass;
         LIST_FOREACH(fc, DviFontClass, &font_classes[k]) {
@@ -152,12 +182,15 @@ int    mdvi_unregister_font_type(const char *name, int klass)
             if(fc) break;
         }
     } else
-        return -1;
+        fc = NULL;
     
-    if(fc == NULL || fc->links)
+    if(fc == NULL || fc->links) {
+        mdvi_lookup_unlock();
         return -1;
+    }
     /* remove it */
     listh_remove(&font_classes[k], LIST(fc));
+    mdvi_lookup_unlock();
     
     /* and destroy it */
     mdvi_free(fc->info.name);
@@ -191,11 +224,177 @@ static char *lookup_font(DviFontClass *ptr, const char *name, Ushort *h, Ushort
     return filename;
 }
 
+/* must be called before any font is looked up */
+void    mdvi_set_lookup_cache(const char *file)
+{
+    mdvi_lookup_lock();
+    if(lookup_cache_file)
+        mdvi_free(lookup_cache_file);
+    lookup_cache_file = file ? mdvi_strdup(file) : NULL;
+    mdvi_lookup_unlock();
+}
+
+static Ulong stamp_file(Ulong h, const char *path)
+{
+    struct stat st;
+
+    if(path == NULL || stat(path, &st) < 0)
+        return h;
+    for(; *path; path++)
+        h = h * 31 + (Uchar)*path;
+    h = h * 31 + (Ulong)st.st_mtime;
+    return h * 31 + (Ulong)st.st_size;
+}
+
+/* changes whenever the files kpathsea searches with change */
+static Ulong lookup_stamp(void)
+{
+    char    *cnf, *dbs, *elt, *path;
+    Ulong    h;
+
+    cnf = kpse_find_file("texmf.cnf", kpse_cnf_format, 0);
+    h = stamp_file(0, cnf);
+    if(cnf)
+        mdvi_free(cnf);
+    dbs = kpse_path_expand("$TEXMFDBS");
+    for(elt = kpse_path_element(dbs); elt; elt = kpse_path_element(NULL)) {
+        path = mdvi_malloc(strlen(elt) + 6);
+        sprintf(path, "%s/ls-R", elt);
+        h = stamp_file(h, path);
+        mdvi_free(path);
+    }
+    mdvi_free(dbs);
+    return h;
+}
+
+static LookupEntry *lookup_cache_add(const char *key, const char *filename,
+    Ushort hdpi, Ushort vdpi)
+{
+    LookupEntry *ent;
+
+    ent = xalloc(LookupEntry);
+    ent->filename = filename ? mdvi_strdup(filename) : NULL;
+    ent->hdpi = hdpi;
+    ent->vdpi = vdpi;
+    mdvi_hash_add(&lookup_cache, MDVI_KEY(mdvi_strdup(key)), ent,
+        MDVI_HASH_UNCHECKED);
+    return ent;
+}
+
+/* lines are `class TAB name TAB hdpi TAB vdpi TAB hdpi TAB vdpi TAB file' */
+static void lookup_cache_parse(char *line)
+{
+    char    *p, *file;
+    int    i, hdpi, vdpi;
+    LookupEntry *ent;
+
+    if((p = strchr(line, '\n')) == NULL)
+        return;
+    *p = 0;
+    /* the key is made of the first four fields */
+    for(p = line, i = 0; p && i < 4; i++)
+        p = strchr(p + 1, '\t');
+    if(p == NULL || sscanf(p + 1, "%d\t%d\t", &hdpi, &vdpi) != 2)
+        return;
+    *p++ = 0;
+    if((file = strrchr(p, '\t')) == NULL || *++file == 0)
+        return;
+    /* later lines replace earlier ones */
+    ent = (LookupEntry *)mdvi_hash_lookup(&lookup_cache, MDVI_KEY(line));
+    if(ent == NULL) {
+        lookup_cache_add(line, file, hdpi, vdpi);
+        return;
+    }
+    if(ent->filename)
+        mdvi_free(ent->filename);
+    ent->filename = mdvi_strdup(file);
+    ent->hdpi = hdpi;
+    ent->vdpi = vdpi;
+}
+
+static void lookup_cache_init(void)
+{
+    char    stamp[64];
+    char    line[LOOKUP_LINE_MAX];
+    FILE    *in;
+
+    mdvi_hash_create(&lookup_cache, LOOKUP_HASH_SIZE);
+    lookup_cache_ready = 1;
+    if(lookup_cache_file == NULL)
+        return;
+
+    sprintf(stamp, "%s %08lx\n", LOOKUP_MAGIC, lookup_stamp());
+    in = fopen(lookup_cache_file, "r");
+    if(in && fgets(line, sizeof(line), in) && STREQ(line, stamp)) {
+        while(fgets(line, sizeof(line), in))
+            lookup_cache_parse(line);
+        fclose(in);
+        DEBUG((DBG_FONTS, "%s: %d lookups\n", 
+            lookup_cache_file, lookup_cache.nkeys));
+        lookup_cache_out = fopen(lookup_cache_file, "a");
+        return;
+    }
+    if(in)
+        fclose(in);
+    DEBUG((DBG_FONTS, "%s: starting over\n", lookup_cache_file));
+    lookup_cache_out = fopen(lookup_cache_file, "w");
+    if(lookup_cache_out) {
+        fputs(stamp, lookup_cache_out);
+        fflush(lookup_cache_out);
+    }
+}
+
+static char *cached_lookup_font(DviFontClass *ptr, const char *name,
+    Ushort *h, Ushort *v)
+{
+    char    key[LOOKUP_LINE_MAX];
+    char    *filename;
+    LookupEntry *ent;
+
+    if(!lookup_cache_ready)
+        lookup_cache_init();
+    /* leave room for the rest of the line */
+    if(strlen(ptr->info.name) + strlen(name) + 32 > LOOKUP_LINE_MAX / 2 ||
+       strpbrk(name, "\t\n"))
+        return lookup_font(ptr, name, h, v);
+
+    sprintf(key, "%s\t%s\t%u\t%u", ptr->info.name, name, *h, *v);
+    ent = (LookupEntry *)mdvi_hash_lookup(&lookup_cache, MDVI_KEY(key));
+    if(ent && ent->filename == NULL)
+        return NULL;
+    /* files that went away are looked up again */
+    if(ent && access(ent->filename, R_OK) == 0) {
+        *h = ent->hdpi;
+        *v = ent->vdpi;
+        return mdvi_strdup(ent->filename);
+    }
+
+    filename = lookup_font(ptr, name, h, v);
+    if(ent) {
+        mdvi_free(ent->filename);
+        ent->filename = filename ? mdvi_strdup(filename) : NULL;
+        ent->hdpi = *h;
+        ent->vdpi = *v;
+    } else
+        lookup_cache_add(key, filename, *h, *v);
+    /* 
+     * Failures are only remembered until we exit: fonts made later (or
+     * installed in a tree without ls-R) would never be found otherwise.
+     */
+    if(lookup_cache_out && filename &&
+       strlen(filename) < LOOKUP_LINE_MAX / 2 && !strpbrk(filename, "\t\n")) {
+        fprintf(lookup_cache_out, "%s\t%u\t%u\t%s\n", key, *h, *v,
+            filename);
+        fflush(lookup_cache_out);
+    }
+    return filename;
+}
+
 /*
  * Class MAX_CLASS-1 is special: it consists of `metric' fonts that should
  * be tried as a last resort
  */
-char    *mdvi_lookup_font(DviFontSearch *search)
+static char *do_lookup_font(DviFontSearch *search)
 {
     int kid;
     int k;
@@ -235,7 +434,7 @@ again:
             DEBUG((DBG_FONTS, "%d: trying `%s' at (%d,%d)dpi as `%s'\n",
                 k, name, hdpi, vdpi, ptr->info.name));
             /* lookup the font in this class */
-            filename = lookup_font(ptr, name, &hdpi, &vdpi);
+            filename = cached_lookup_font(ptr, name, &hdpi, &vdpi);
             if(filename)
                 break;
             ptr = ptr->next;
@@ -283,7 +482,7 @@ metrics:
     while(ptr) {
         DEBUG((DBG_FONTS, "metric: trying `%s' at (%d,%d)dpi as `%s'\n",
             name, hdpi, vdpi, ptr->info.name));
-        filename = lookup_font(ptr, name, &hdpi, &vdpi);
+        filename = cached_lookup_font(ptr, name, &hdpi, &vdpi);
         if(filename)
             break;
         ptr = ptr->next;
@@ -316,6 +515,16 @@ metrics:
     return NULL;
 }
 
+char    *mdvi_lookup_font(DviFontSearch *search)
+{
+    char    *filename;
+
+    mdvi_lookup_lock();
+    filename = do_lookup_font(search);
+    mdvi_lookup_unlock();
+    return filename;
+}
+
 /* called by `font_reference' to do the initial lookup */
 DviFont    *mdvi_add_font(const char *name, Int32 sum,
     int hdpi, int vdpi, Int32 scale)
@@ -344,6 +553,10 @@ DviFont    *mdvi_add_font(const char *name, Int32 sum,
     font->in = NULL;
     font->chars = NULL;
     font->subfonts = NULL;
+    font->submap = NULL;
+    font->private = NULL;
+    font->vfcode = NULL;
+    font->glcache = NULL;
 
     return font;
 }
@@ -355,7 +568,9 @@ int    mdvi_font_retry(DviParams *params, DviFont *font)
 
     ASSERT(font->search.curr != NULL);    
     /* we won't be using this class anymore */
+    mdvi_lookup_lock();
     font->search.curr->links--;
+    mdvi_lookup_unlock();
 
     filename = mdvi_lookup_font(&font->search);
     if(filename == NULL)
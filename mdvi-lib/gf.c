@@ -339,6 +339,10 @@ static int gf_load_font(DviParams *unused, DviFont *font)
         ch->glyph.data = NULL;
         ch->shrunk.data = NULL;
         ch->grey.data = NULL;
+        ch->variants = NULL;
+        ch->nvariants = 0;
+        ch->hshrink = 0;
+        ch->vshrink = 0;
         ch->flags = 0;
         ch->loaded = 0;
     }    
@@ -0,0 +1,403 @@
+/* glcache.c -- keeps grey glyphs on disk across sessions */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Decoding and shrinking glyphs is most of the work of drawing a page for
+ * the first time, and it comes out the same every time a font is used at
+ * the same size. If a cache directory has been set, grey glyphs are saved
+ * there, one file per font file and scaling, and later sessions map those
+ * files instead of loading and shrinking the glyphs again.
+ *
+ * Only the coverage of each pixel is saved, so the files don't depend on
+ * the colors or on the device. A file is ignored (and eventually written
+ * again) if the font file changed after it was made.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mdvi.h"
+#include "private.h"
+
+#define GLCACHE_MAGIC    "MDVIGLC1"
+
+typedef struct {
+    char    magic[8];
+    Uint32    size;        /* of this header, so other builds don't match */
+    Int32    checksum;    /* of the font */
+    long    mtime;        /* of the font file */
+    long    length;        /* of the font file */
+    int    hdpi;
+    int    vdpi;
+    double    hshrink;
+    double    vshrink;
+    int    orientation;
+    int    loc;
+    int    hic;
+} GlyphCacheHeader;
+
+/* one for each character from loc to hic, after the header */
+typedef struct {
+    Uint32    offset;        /* of the coverage values, 0 if not saved */
+    Int16    x;
+    Int16    y;
+    Uint16    w;
+    Uint16    h;
+} GlyphCacheEntry;
+
+typedef struct {
+    int    code;
+    DviGlyph glyph;
+    Uchar    *cov;
+} GlyphCachePending;
+
+struct _DviGlyphCache {
+    GlyphCacheHeader key;
+    char    *path;        /* NULL if we can't use a file */
+    Uchar    *map;        /* the file, if it matches the key */
+    size_t    maplen;
+    GlyphCachePending *pending;    /* glyphs not saved yet */
+    int    npending;
+    int    maxpending;
+    DviGlyphCache *next;
+};
+
+/* scalings a font keeps a cache open for */
+#define GLCACHE_MAX    8
+
+static char *glcache_dir = NULL;
+
+/* must be called before any font is loaded, NULL disables the cache */
+void    mdvi_set_glyph_cache_dir(const char *dir)
+{
+    if(glcache_dir)
+        mdvi_free(glcache_dir);
+    glcache_dir = dir ? mdvi_strdup(dir) : NULL;
+}
+
+#define ENTRIES(gc)    \
+    ((GlyphCacheEntry *)((gc)->map + sizeof(GlyphCacheHeader)))
+#define NENTRIES(gc)    ((gc)->key.hic - (gc)->key.loc + 1)
+
+static Uint32 hash_bytes(Uint32 h, const void *data, size_t n)
+{
+    const Uchar *p = (const Uchar *)data;
+
+    /* FNV-1a */
+    while(n-- > 0)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+static char *glcache_path(DviFont *font, GlyphCacheHeader *key)
+{
+    Uint32    h;
+    char    *path;
+
+    /* the same font at the same size always goes to the same file */
+    h = hash_bytes(2166136261U, font->filename, strlen(font->filename));
+    h = hash_bytes(h, &key->hdpi, sizeof(key->hdpi));
+    h = hash_bytes(h, &key->vdpi, sizeof(key->vdpi));
+    h = hash_bytes(h, &key->hshrink, sizeof(key->hshrink));
+    h = hash_bytes(h, &key->vshrink, sizeof(key->vshrink));
+    h = hash_bytes(h, &key->orientation, sizeof(key->orientation));
+    path = mdvi_malloc(strlen(glcache_dir) + strlen(font->fontname) + 16);
+    sprintf(path, "%s/%s-%08x.glc", glcache_dir, font->fontname, (unsigned)h);
+    return path;
+}
+
+static void glcache_map(DviGlyphCache *gc)
+{
+    struct stat st;
+    void    *map;
+    int    fd;
+
+    if((fd = open(gc->path, O_RDONLY)) < 0)
+        return;
+    if(fstat(fd, &st) < 0 ||
+       (size_t)st.st_size < sizeof(GlyphCacheHeader) +
+       NENTRIES(gc) * sizeof(GlyphCacheEntry)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return;
+    /* keys are zeroed before they're filled, so padding compares too */
+    if(memcmp(map, &gc->key, sizeof(GlyphCacheHeader)) != 0) {
+        DEBUG((DBG_FILES, "%s: out of date\n", gc->path));
+        munmap(map, st.st_size);
+        return;
+    }
+    DEBUG((DBG_FILES, "%s: mapped\n", gc->path));
+    gc->map = map;
+    gc->maplen = st.st_size;
+}
+
+static DviGlyphCache *glcache_open(DviContext *dvi, DviFont *font)
+{
+    DviGlyphCache *gc;
+    struct stat st;
+
+    gc = xalloc(DviGlyphCache);
+    memset(gc, 0, sizeof(DviGlyphCache));
+    memcpy(gc->key.magic, GLCACHE_MAGIC, 8);
+    gc->key.size = sizeof(GlyphCacheHeader);
+    gc->key.checksum = font->checksum;
+    gc->key.hdpi = font->hdpi;
+    gc->key.vdpi = font->vdpi;
+    gc->key.hshrink = MDVI_HSHRINK(&dvi->params);
+    gc->key.vshrink = MDVI_VSHRINK(&dvi->params);
+    gc->key.orientation = dvi->params.orientation;
+    gc->key.loc = font->loc;
+    gc->key.hic = font->hic;
+    /* without a font file we don't know if the cache would be valid */
+    if(stat(font->filename, &st) < 0)
+        return gc;
+    gc->key.mtime = st.st_mtime;
+    gc->key.length = st.st_size;
+    gc->path = glcache_path(font, &gc->key);
+    glcache_map(gc);
+    return gc;
+}
+
+static void glcache_free __PROTO((DviGlyphCache *));
+
+/* 
+ * The cache for the current parameters, or NULL if there is none. A font
+ * keeps the caches for the last GLCACHE_MAX scalings it was drawn at, most
+ * recently used first, so zooming back and forth doesn't write them out.
+ */
+static DviGlyphCache *glcache_select(DviContext *dvi, DviFont *font)
+{
+    DviGlyphCache *gc, **prev;
+    int    n;
+
+    if(glcache_dir == NULL || font->chars == NULL)
+        return NULL;
+    for(prev = &font->glcache, n = 0; (gc = *prev); prev = &gc->next, n++) {
+        if(gc->key.hshrink == MDVI_HSHRINK(&dvi->params) &&
+           gc->key.vshrink == MDVI_VSHRINK(&dvi->params) &&
+           gc->key.orientation == (int)dvi->params.orientation)
+            break;
+        /* this one was not used for longest */
+        if(n == GLCACHE_MAX - 1 && gc->next == NULL) {
+            *prev = NULL;
+            glcache_free(gc);
+            gc = NULL;
+            break;
+        }
+    }
+    if(gc == NULL)
+        gc = glcache_open(dvi, font);
+    else
+        *prev = gc->next;
+    gc->next = font->glcache;
+    font->glcache = gc;
+    return gc->path ? gc : NULL;
+}
+
+static GlyphCacheEntry *glcache_entry(DviGlyphCache *gc, int code)
+{
+    GlyphCacheEntry *e;
+
+    if(gc->map == NULL || code < gc->key.loc || code > gc->key.hic)
+        return NULL;
+    e = &ENTRIES(gc)[code - gc->key.loc];
+    if(e->offset == 0 || e->w == 0 || e->h == 0 ||
+       (size_t)e->offset + (size_t)e->w * e->h > gc->maplen)
+        return NULL;
+    return e;
+}
+
+/*
+ * Look for a glyph, at the current scaling. On success, `dest' gets the
+ * glyph's geometry and `cov' its coverage, which stays valid while the
+ * font lock is held.
+ */
+int    glcache_get(DviContext *dvi, DviFont *font, int code,
+    DviGlyph *dest, const Uchar **cov)
+{
+    DviGlyphCache *gc;
+    GlyphCacheEntry *e;
+
+    if((gc = glcache_select(dvi, font)) == NULL ||
+       (e = glcache_entry(gc, code)) == NULL)
+        return 0;
+    dest->x = e->x;
+    dest->y = e->y;
+    dest->w = e->w;
+    dest->h = e->h;
+    dest->data = NULL;
+    *cov = gc->map + e->offset;
+    return 1;
+}
+
+/* remember a glyph we just made, so it gets saved */
+void    glcache_put(DviContext *dvi, DviFont *font, int code,
+    DviGlyph *glyph, const Uchar *cov)
+{
+    DviGlyphCache *gc;
+    GlyphCachePending *p;
+    size_t    n;
+    int    i;
+
+    if(glyph->w == 0 || glyph->h == 0 ||
+       (gc = glcache_select(dvi, font)) == NULL ||
+       glcache_entry(gc, code) != NULL)
+        return;
+    for(i = 0; i < gc->npending; i++) {
+        if(gc->pending[i].code == code)
+            return;
+    }
+    if(gc->npending == gc->maxpending) {
+        gc->maxpending = gc->maxpending ? 2 * gc->maxpending : 32;
+        gc->pending = xresize(gc->pending, GlyphCachePending, gc->maxpending);
+    }
+    n = (size_t)glyph->w * glyph->h;
+    p = &gc->pending[gc->npending++];
+    p->code = code;
+    p->glyph = *glyph;
+    p->glyph.data = NULL;
+    p->cov = mdvi_malloc(n);
+    memcpy(p->cov, cov, n);
+}
+
+static void free_pending(DviGlyphCache *gc)
+{
+    int    i;
+
+    for(i = 0; i < gc->npending; i++)
+        mdvi_free(gc->pending[i].cov);
+    gc->npending = 0;
+}
+
+/*
+ * Write out the saved glyphs along with the new ones. The file is replaced
+ * atomically, so other sessions never see half of it.
+ */
+static void glcache_write(DviGlyphCache *gc)
+{
+    GlyphCacheEntry *entries, *e;
+    GlyphCachePending *p;
+    Uchar    *data;
+    size_t    length, offset, n;
+    char    *tmp;
+    int    i, fd, ok;
+
+    if(gc == NULL || gc->path == NULL || gc->npending == 0)
+        return;
+
+    /* lay out the new file */
+    length = sizeof(GlyphCacheHeader) + NENTRIES(gc) * sizeof(GlyphCacheEntry);
+    for(i = gc->key.loc; i <= gc->key.hic; i++) {
+        if((e = glcache_entry(gc, i)) != NULL)
+            length += (size_t)e->w * e->h;
+    }
+    for(i = 0; i < gc->npending; i++)
+        length += (size_t)gc->pending[i].glyph.w * gc->pending[i].glyph.h;
+    data = mdvi_malloc(length);
+    memcpy(data, &gc->key, sizeof(GlyphCacheHeader));
+    entries = (GlyphCacheEntry *)(data + sizeof(GlyphCacheHeader));
+    memset(entries, 0, NENTRIES(gc) * sizeof(GlyphCacheEntry));
+    offset = sizeof(GlyphCacheHeader) + NENTRIES(gc) * sizeof(GlyphCacheEntry);
+    for(i = gc->key.loc; i <= gc->key.hic; i++) {
+        if((e = glcache_entry(gc, i)) == NULL)
+            continue;
+        n = (size_t)e->w * e->h;
+        entries[i - gc->key.loc] = *e;
+        entries[i - gc->key.loc].offset = offset;
+        memcpy(data + offset, gc->map + e->offset, n);
+        offset += n;
+    }
+    for(i = 0; i < gc->npending; i++) {
+        p = &gc->pending[i];
+        n = (size_t)p->glyph.w * p->glyph.h;
+        e = &entries[p->code - gc->key.loc];
+        e->offset = offset;
+        e->x = p->glyph.x;
+        e->y = p->glyph.y;
+        e->w = p->glyph.w;
+        e->h = p->glyph.h;
+        memcpy(data + offset, p->cov, n);
+        offset += n;
+    }
+    free_pending(gc);
+
+    tmp = mdvi_malloc(strlen(gc->path) + 8);
+    sprintf(tmp, "%s.XXXXXX", gc->path);
+    ok = 0;
+    if((fd = mkstemp(tmp)) >= 0) {
+        ok = (write(fd, data, length) == (ssize_t)length);
+        ok = (close(fd) == 0) && ok;
+        if(ok)
+            ok = (rename(tmp, gc->path) == 0);
+        if(!ok)
+            unlink(tmp);
+    }
+    DEBUG((DBG_FILES, "%s: %s\n", gc->path, ok ? "saved" : "could not save"));
+    mdvi_free(tmp);
+    mdvi_free(data);
+
+    /* use the new file from now on */
+    if(ok) {
+        if(gc->map)
+            munmap(gc->map, gc->maplen);
+        gc->map = NULL;
+        gc->maplen = 0;
+        glcache_map(gc);
+    }
+}
+
+static void glcache_free(DviGlyphCache *gc)
+{
+    glcache_write(gc);
+    free_pending(gc);
+    if(gc->pending)
+        mdvi_free(gc->pending);
+    if(gc->map)
+        munmap(gc->map, gc->maplen);
+    if(gc->path)
+        mdvi_free(gc->path);
+    mdvi_free(gc);
+}
+
+void    glcache_flush(DviFont *font)
+{
+    DviGlyphCache *gc;
+
+    for(gc = font->glcache; gc; gc = gc->next)
+        glcache_write(gc);
+}
+
+void    glcache_close(DviFont *font)
+{
+    DviGlyphCache *gc;
+
+    while((gc = font->glcache) != NULL) {
+        font->glcache = gc->next;
+        glcache_free(gc);
+    }
+}
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "sysdeps.h"
 #include "bitmap.h"
@@ -45,8 +46,12 @@ typedef struct _DviSection DviSection;
 typedef struct _TFMChar TFMChar;
 typedef struct _TFMInfo TFMInfo;
 typedef struct _DviFontSearch DviFontSearch;
-/* this is an opaque type */
+/* these are opaque types */
 typedef struct _DviFontClass DviFontClass;
+typedef struct _DviDisplayList DviDisplayList;
+typedef struct _DviPageCache DviPageCache;
+typedef struct _DviPageColors DviPageColors;
+typedef struct _DviGlyphCache DviGlyphCache;
 
 typedef void (*DviFreeFunc) __PROTO((void *));
 typedef void (*DviFree2Func) __PROTO((void *, void *));
@@ -98,8 +103,11 @@ typedef void *(*DviCreateImage)    __PROTO((void *device_data,
                          Uint height,
                          Uint bpp));
 typedef void (*DviFreeImage)    __PROTO((void *image));
+typedef void (*DviRefImage)    __PROTO((void *image));
 typedef void (*DviPutPixel)    __PROTO((void *image, int x, int y, Ulong color));
+typedef void (*DviPutRow)    __PROTO((void *image, int y, const Ulong *colors, int n));
 typedef void (*DviImageDone)    __PROTO((void *image));
+typedef void *(*DviImageGroup)    __PROTO((void *image));
 typedef void (*DviDevDestroy)   __PROTO((void *data));
 typedef void (*DviRefresh)      __PROTO((DviContext *dvi, void *device_data));
 typedef void (*DviSetColor)    __PROTO((void *device_data, Ulong, Ulong));
@@ -114,15 +122,22 @@ struct _DviDevice {
     DviColorScale    alloc_colors;
     DviCreateImage    create_image;
     DviFreeImage    free_image;
+    DviRefImage    ref_image;    /* take a reference, dropped by free_image */
+    DviImageGroup    image_group;    /* optional, the storage an image shares */
     DviPutPixel    put_pixel;
+    DviPutRow    put_row;    /* optional, a whole row of put_pixel */
         DviImageDone    image_done;
     DviDevDestroy    dev_destroy;
     DviRefresh    refresh;
     DviSetColor    set_color;
     DviPSDraw       draw_ps;
+    Uint    flags;        /* MDVI_DEVICE_* */
     void *        device_data;
 };
 
+/* grey images only hold coverage, draw_glyph applies the current color */
+#define MDVI_DEVICE_ALPHA    1
+
 /*
  * Fonts
  */
@@ -178,6 +193,17 @@ struct _DviFontInfo {
     void *            private;
 };
 
+/* a scaled glyph made for other shrinking factors or colors */
+typedef struct {
+    double    hshrink;
+    double    vshrink;
+    Ulong    fg;
+    Ulong    bg;
+    double    gamma;
+    DviGlyph shrunk;
+    DviGlyph grey;
+} DviGlyphVariant;
+
 struct _DviFontChar {
     Uint32    offset;
     Int16    code;        /* format-dependent, not used by MDVI */
@@ -196,11 +222,18 @@ struct _DviFontChar {
 #endif
     Ulong    fg;
     Ulong    bg;
+    double    hshrink;    /* shrinking factors for `shrunk' and `grey' */
+    double    vshrink;
+    double    gamma;        /* gamma `grey' was made with */
     BITMAP    *glyph_data;
     /* data for shrunk bitimaps */
     DviGlyph glyph;
     DviGlyph shrunk;
     DviGlyph grey;
+    /* other scaled versions, most recently used first */
+    DviGlyphVariant *variants;
+    int    nvariants;
+    Ulong    lastuse;    /* for the glyph memory budget */
 };
 
 struct _DviFontRef {
@@ -264,7 +297,12 @@ struct _DviFont {
     DviFontSearch    search;
     DviFontChar    *chars;
     DviFontRef    *subfonts;
+    DviFontRef    **submap;    /* subfonts by id */
+    Uint    submask;
     void    *private;
+    void    *vfcode;    /* compiled virtual font macros */
+    DviGlyphCache *glcache;    /* glyphs saved on disk */
+    pthread_mutex_t lock;    /* protects the glyphs (recursive) */
 };
 
 /*
@@ -301,6 +339,8 @@ struct _DviParams {
     Uint    vdpi;        /* vertical resolution */
     int    hshrink;    /* horizontal shrinking factor */
     int    vshrink;    /* vertical shrinking factor */
+    double    hscale;        /* horizontal zoom on top of shrinking */
+    double    vscale;        /* vertical zoom on top of shrinking */
     Uint    density;    /* pixel density */
     Uint    flags;        /* flags (see MDVI_PARAM macros) */
     int    hdrift;        /* max. horizontal drift */
@@ -331,7 +371,10 @@ typedef enum {
     MDVI_SET_VDRIFT        = 12,
     MDVI_SET_ORIENTATION    = 13,
     MDVI_SET_FOREGROUND    = 14,
-    MDVI_SET_BACKGROUND    = 15
+    MDVI_SET_BACKGROUND    = 15,
+    MDVI_SET_SCALE        = 16,
+    MDVI_SET_XSCALE        = 17,
+    MDVI_SET_YSCALE        = 18
 } DviParamCode;
 
 struct _DviBuffer {
@@ -373,6 +416,7 @@ struct _DviContext {
     Int32    den;        /* denominator */
     DviFontRef *fonts;    /* fonts used in this file */
     DviFontRef **fontmap;    /* for faster id lookups */
+    Uint    fontmask;    /* size of fontmap, minus one */
     DviFontRef *currfont;    /* current font */
     int    nfonts;        /* # of fonts used in this job */
     Int32    dvimag;        /* original magnification */
@@ -397,7 +441,21 @@ struct _DviContext {
     int    color_size;
 
     DviFontRef *(*findref) __PROTO((DviContext *, Int32));
+    DviFont    *macrofont;    /* virtual font whose macro is running */
     void    *user_data;    /* client data attached to this context */
+    DviContext *parent;    /* context we were cloned from, if any */
+    DviPageCache *pagecache; /* compiled pages, shared with clones */
+    int    *pageorigin;    /* where pages were before the last reload */
+    DviPageColors *pagecolors; /* colors pages start with, shared too */
+    DviDisplayList *dlist;    /* page being compiled, if any */
+    int    compiling;    /* compiling it without drawing */
+    Uchar    *map;        /* the file, if MDVI_PARAM_MAPFILE or COPYFILE */
+    size_t    maplen;        /* size of the mapping */
+    int    mapcopy;    /* map was read into memory, not mapped */
+    int    clip_x;        /* only draw what shows in here, if clip_w > 0 */
+    int    clip_y;
+    int    clip_w;
+    int    clip_h;
 };
 
 typedef enum {
@@ -432,6 +490,14 @@ typedef void (*DviSpecialHandler)
 #define MDVI_PARAM_CHARBOXES    4
 #define MDVI_PARAM_SHOWUNDEF    8
 #define MDVI_PARAM_DELAYFONTS    16
+/* read pages from a memory mapping of the file. The file must not be
+ * truncated while it is mapped, or we get SIGBUS */
+#define MDVI_PARAM_MAPFILE    32
+/* decode the glyphs a page needs on several threads before drawing it */
+#define MDVI_PARAM_PRELOAD    64
+/* read the whole file into memory instead, so that it can be rewritten 
+ * while we use it */
+#define MDVI_PARAM_COPYFILE    128
 
 /*
  * The FALLBACK priority class is reserved for font formats that
@@ -463,8 +529,16 @@ typedef void (*DviSpecialHandler)
 #define MDVI_VALIDPAGE(d,p)    ((p) >= 0 && (p) <= MDVI_LASTPAGE(d))
 #define MDVI_FLAGS(d)        (d)->params.flags
 #define MDVI_SHRINK_FROM_DPI(d)    Max(1, (d) / 75)
+/* the real shrinking factors, which need not be whole numbers */
+#define MDVI_HSHRINK(p)        ((p)->hshrink / (p)->hscale)
+#define MDVI_VSHRINK(p)        ((p)->vshrink / (p)->vscale)
 #define MDVI_CURRFG(d)        (d)->curr_fg
 #define MDVI_CURRBG(d)        (d)->curr_bg
+/* the colors grey glyphs are made for */
+#define MDVI_GLYPHFG(d)        \
+    (((d)->device.flags & MDVI_DEVICE_ALPHA) ? 0 : MDVI_CURRFG(d))
+#define MDVI_GLYPHBG(d)        \
+    (((d)->device.flags & MDVI_DEVICE_ALPHA) ? 0 : MDVI_CURRBG(d))
 
 #define pixel_round(d,v)    (int)((d)->params.conv * (v) + 0.5)
 #define vpixel_round(d,v)    (int)((d)->params.vconv * (v) + 0.5)
@@ -472,11 +546,19 @@ typedef void (*DviSpecialHandler)
 #define vrule_round(d,v)    (int)((d)->params.vconv * (v) + 0.99999)
 
 extern int    mdvi_reload __PROTO((DviContext *, DviParams *));
+extern DviContext *mdvi_reload_prepare __PROTO((DviContext *, DviParams *));
+extern int    mdvi_reload_finish __PROTO((DviContext *, DviContext *));
+extern int    mdvi_page_origin __PROTO((DviContext *, int));
+extern void    mdvi_set_clip __PROTO((DviContext *, int, int, int, int));
 extern void    mdvi_setpage __PROTO((DviContext *, int));
 extern int      mdvi_dopage __PROTO((DviContext *, int));
 extern void     mdvi_shrink_glyph __PROTO((DviContext *, DviFont *, DviFontChar *, DviGlyph *));
 extern void    mdvi_shrink_box __PROTO((DviContext *, DviFont *, DviFontChar *, DviGlyph *));
 extern void     mdvi_shrink_glyph_grey __PROTO((DviContext *, DviFont *, DviFontChar *, DviGlyph *));
+extern void     mdvi_shrink_glyph_frac __PROTO((DviContext *, DviFont *, DviFontChar *, DviGlyph *, double, double));
+extern void     mdvi_shrink_glyph_grey_frac __PROTO((DviContext *, DviFont *, DviFontChar *, DviGlyph *, double, double));
+extern Uchar    *mdvi_glyph_coverage __PROTO((DviContext *, DviFontChar *, DviGlyph *));
+extern int    mdvi_grey_glyph __PROTO((DviContext *, DviFontChar *, DviGlyph *, const Uchar *));
 extern int    mdvi_find_tex_page __PROTO((DviContext *, int));
 extern int    mdvi_configure __PROTO((DviContext *, DviParamCode, ...));
 
@@ -495,7 +577,9 @@ extern void    mdvi_sort_pages __PROTO((DviContext *, DviPageSort));
 extern void mdvi_init_kpathsea __PROTO((const char *, const char *, const char *, int, const char *));
 
 extern DviContext* mdvi_init_context __PROTO((DviParams *, DviPageSpec *, const char *));
+extern DviContext* mdvi_clone_context __PROTO((DviContext *));
 extern void     mdvi_destroy_context __PROTO((DviContext *));
+extern int    mdvi_file_changed __PROTO((DviContext *));
 
 /* helper macros that call mdvi_configure() */
 #define mdvi_config_one(d,x,y)    mdvi_configure((d), (x), (y), MDVI_PARAM_LAST)
@@ -520,6 +604,9 @@ extern void     mdvi_destroy_context __PROTO((DviContext *));
 #define mdvi_set_shrink(d,h,v)    \
     mdvi_configure((d), MDVI_SET_XSHRINK, (h), \
     MDVI_SET_YSHRINK, (v), MDVI_PARAM_LAST)
+#define mdvi_set_scale(d,h,v)    \
+    mdvi_configure((d), MDVI_SET_XSCALE, (double)(h), \
+    MDVI_SET_YSCALE, (double)(v), MDVI_PARAM_LAST)
 
 extern DviRange* mdvi_parse_range __PROTO((const char *, DviRange *, int *, char **));
 extern DviPageSpec* mdvi_parse_page_spec __PROTO((const char *));
@@ -552,6 +639,13 @@ extern void mdvi_flush_specials __PROTO((void));
 
 #define glyph_present(x) ((x) && (x)->offset)
 
+/* 
+ * Fonts and their glyphs are shared by every context. These serialize
+ * access to the glyphs of one font.
+ */
+extern void font_lock __PROTO((DviFont *));
+extern void font_unlock __PROTO((DviFont *));
+
 /* create a reference to a font */
 extern DviFontRef *font_reference __PROTO((DviParams *params,
                                            Int32 dvi_id,
@@ -581,12 +675,24 @@ extern void font_finish_definitions __PROTO((DviContext *));
 /* lookup an id # in a reference chain */
 extern DviFontRef* font_find_flat __PROTO((DviContext *, Int32));
 extern DviFontRef* font_find_mapped __PROTO((DviContext *, Int32));
+extern DviFontRef* font_find_sub __PROTO((DviContext *, Int32));
+
+/* hash a reference chain by id */
+extern DviFontRef** font_build_map __PROTO((DviFontRef *, Uint *));
+extern DviFontRef* font_map_find __PROTO((DviFontRef **, Uint, Int32));
 
 /* called to reopen (or rewind) a font file */
 extern int font_reopen __PROTO((DviFont *));
 
-/* reads a glyph from a font, and makes all necessary transformations */
+/* 
+ * reads a glyph from a font, and makes all necessary transformations.
+ * The result is only stable while the font lock is held.
+ */
 extern DviFontChar* font_get_glyph __PROTO((DviContext *, DviFont *, int));
+/* same, ahead of drawing, without keeping the lock while it is scaled */
+extern void font_preload_glyph __PROTO((DviContext *, DviFont *, int));
+/* same, but only the metrics are loaded, not the glyph */
+extern DviFontChar* font_get_char __PROTO((DviContext *, DviFont *, int));
 
 /* transform a glyph according to the given orientation */
 extern void font_transform_glyph __PROTO((DviOrientation, DviGlyph *));
@@ -594,6 +700,36 @@ extern void font_transform_glyph __PROTO((DviOrientation, DviGlyph *));
 /* destroy all fonts that are not being used, returns number of fonts freed */
 extern int font_free_unused __PROTO((DviDevice *));
 
+/* memory held by the glyphs of all fonts */
+typedef struct {
+    size_t    raw;        /* unscaled bitmaps */
+    size_t    shrunk;        /* shrunk bitmaps */
+    size_t    grey;        /* antialiased device images, or their storage */
+    size_t    budget;        /* 0 means no limit */
+} DviGlyphMemory;
+
+extern void mdvi_get_glyph_memory __PROTO((DviGlyphMemory *));
+/* devices with image_group count their storage here, negative when freed */
+extern void mdvi_add_image_memory __PROTO((long));
+extern void mdvi_set_glyph_budget __PROTO((size_t));
+extern void mdvi_set_glyph_threads __PROTO((int));
+
+/* drop least recently used glyphs until we are back under budget */
+extern void font_enforce_budget __PROTO((DviDevice *));
+
+/* on-disk glyph cache (glcache.c) */
+extern void mdvi_set_glyph_cache_dir __PROTO((const char *));
+extern int glcache_get __PROTO((DviContext *, DviFont *, int,
+    DviGlyph *, const Uchar **));
+extern void glcache_put __PROTO((DviContext *, DviFont *, int,
+    DviGlyph *, const Uchar *));
+extern void glcache_flush __PROTO((DviFont *));
+extern void glcache_close __PROTO((DviFont *));
+extern void font_flush_glyph_cache __PROTO((void));
+
+/* compiled virtual font macros (dviread.c) */
+extern void vf_free_code __PROTO((DviFont *));
+
 #define font_free_glyph(dev, font, code) \
     font_reset_one_glyph((dev), \
     FONTCHAR((font), (code)), MDVI_FONTSEL_GLYPH)
@@ -607,6 +743,7 @@ extern char **mdvi_list_font_class __PROTO((int));
 extern int mdvi_get_font_classes __PROTO((void));
 extern int mdvi_unregister_font_type __PROTO((const char *, int));
 extern char *mdvi_lookup_font __PROTO((DviFontSearch *));
+extern void mdvi_set_lookup_cache __PROTO((const char *));
 extern DviFont *mdvi_add_font __PROTO((const char *, Int32, int, int, Int32));
 extern int mdvi_font_retry __PROTO((DviParams *, DviFont *));
 
@@ -53,13 +53,29 @@
 
 static int pk_load_font __PROTO((DviParams *, DviFont *));
 static int pk_font_get_glyph __PROTO((DviParams *, DviFont *, int));
+static void pk_free_data __PROTO((DviFont *));
 
 static int pk_auto_generate = 1; /* this is ON by default */
 
+/* 
+ * The whole font file is kept in memory once it's been loaded, so that
+ * glyphs can be decoded without going through stdio. The image is padded
+ * with zeros so that a truncated character header can't read past it.
+ */
+#define PK_PAD    64
+
 typedef struct {
-    char    currbyte;
-    char    nybpos;
+    Uchar    *data;
+    size_t    length;
+} PkImage;
+
+typedef struct {
+    const Uchar *ptr;
+    const Uchar *end;
+    int    currbyte;
+    int    nybpos;
     int    dyn_f;
+    int    eof;
 } pkread;
 
 static char *pk_lookup __PROTO((const char *, Ushort *, Ushort *));
@@ -73,7 +89,7 @@ DviFontInfo pk_font_info = {
     pk_font_get_glyph,
     mdvi_shrink_glyph,
     mdvi_shrink_glyph_grey,
-    NULL,    /* free */
+    pk_free_data,    /* free */
     NULL,    /* reset */
     pk_lookup,    /* lookup */
     kpse_pk_format,
@@ -87,7 +103,7 @@ DviFontInfo pkn_font_info = {
     pk_font_get_glyph,
     mdvi_shrink_glyph,
     mdvi_shrink_glyph_grey,
-    NULL,    /* free */
+    pk_free_data,    /* free */
     NULL,    /* reset */
     pk_lookupn,    /* lookup */
     kpse_pk_format,
@@ -134,72 +150,71 @@ static char *pk_lookupn(const char *name, Ushort *hdpi, Ushort *vdpi)
     return filename;    
 }
 
-static inline int pk_get_nyb(FILE *p, pkread *pk)
+static inline int pk_get_nyb(pkread *pk)
 {
-    unsigned t;
-    int    nb;
-    char    c;
-    
-    t = c = pk->currbyte;
-    nb = pk->nybpos;
-    
-    switch(nb) {
-    case 0:
-        c = pk->currbyte = fuget1(p);
-        t = (c >> 4);
-        break;
-    case 1:
-        t = c;
-        break;
+    if(pk->nybpos) {
+        pk->nybpos = 0;
+        return (pk->currbyte & 0xf);
     }
-    pk->nybpos = !nb;
-    return (t & 0xf);
+    if(pk->ptr >= pk->end) {
+        /* any nonzero nybble gets the caller out of its loops */
+        pk->eof = 1;
+        return 1;
+    }
+    pk->currbyte = *pk->ptr++;
+    pk->nybpos = 1;
+    return (pk->currbyte >> 4);
 }
 
-/* 
+/*
  * this is a bit cumbersome because we have to pass around
  * the `pkread' data...
  */
-static int pk_packed_num(FILE *p, pkread *pkr, int *repeat)
+static int pk_packed_num(pkread *pkr, int *repeat)
 {
     int    i, j;
     int    dyn_f = pkr->dyn_f;
-    
-    i = pk_get_nyb(p, pkr);
+
+    i = pk_get_nyb(pkr);
     if(i == 0) {
         do {
-            j = pk_get_nyb(p, pkr);
+            j = pk_get_nyb(pkr);
             i++;
         } while(j == 0);
         while(i-- > 0)
-            j = (j << 4) + pk_get_nyb(p, pkr);
-        return (j - 15 + ((13 - dyn_f) << 4) + 
+            j = (j << 4) + pk_get_nyb(pkr);
+        return (j - 15 + ((13 - dyn_f) << 4) +
             dyn_f);
     } else if(i <= dyn_f)
         return i;
     else if(i < 14)
-        return ((i - dyn_f - 1) << 4) + 
-            pk_get_nyb(p, pkr) + dyn_f + 1;
+        return ((i - dyn_f - 1) << 4) +
+            pk_get_nyb(pkr) + dyn_f + 1;
     else {
         *repeat = 1;
         if(i == 14)
-            *repeat = pk_packed_num(p, pkr, repeat);
-        return pk_packed_num(p, pkr, repeat);
+            *repeat = pk_packed_num(pkr, repeat);
+        return pk_packed_num(pkr, repeat);
     }
 }
 
 #define ROUND(x,y)    (((x) + (y) - 1) / (y))
 
-static BITMAP *get_bitmap(FILE *p, int w, int h, int flags)
+static BITMAP *get_bitmap(const Uchar *p, const Uchar *end,
+    int w, int h, int flags)
 {
     int    i, j;
     BmUnit    *ptr;
     BITMAP    *bm;
     int    bitpos;
     int    currch;
-        
+
     flags = 0; /* shut up that compiler */
     bitpos = -1;
+    if(end - p < ROUND((long)w * h, 8)) {
+        mdvi_error(_("Bad PK file: glyph data is truncated\n"));
+        return NULL;
+    }
     if((bm = bitmap_alloc(w, h)) == NULL)
         return NULL;
     DEBUG((DBG_BITMAPS, "get_bitmap(%d,%d,%d): reading raw bitmap\n",
@@ -208,11 +223,11 @@ static BITMAP *get_bitmap(FILE *p, int w, int h, int flags)
     currch = 0;
     for(i = 0; i < h; i++) {
         BmUnit    mask;
-        
+
         mask = FIRSTMASK;
         for(j = 0; j < w; j++) {
             if(bitpos < 0) {
-                currch = fuget1(p);
+                currch = *p++;
                 bitpos = 7;
             }
             if(currch & (1 << bitpos))
@@ -229,17 +244,27 @@ static BITMAP *get_bitmap(FILE *p, int w, int h, int flags)
     return bm;
 }
 
-static BITMAP *get_packed(FILE *p, int w, int h, int flags)
+/* paint `count' pixels of a row, starting at column `col' */
+#define PAINT_RUN(row, col, count) \
+    bitmap_paint_bits((row) + (col) / BITMAP_BITS, \
+        (col) % BITMAP_BITS, (count))
+
+static BITMAP *get_packed(const Uchar *p, const Uchar *end,
+    int w, int h, int flags)
 {
     int    inrow, count;
     int    row;
     BITMAP    *bm;
+    BmUnit    *rowptr;
     int    repeat_count;
     int    paint;
     pkread    pkr;
-        
+
+    pkr.ptr = p;
+    pkr.end = end;
     pkr.nybpos = 0;
     pkr.currbyte = 0;
+    pkr.eof = 0;
     pkr.dyn_f = PK_DYN_F(flags);
     paint = !!(flags & 0x8);
 
@@ -250,31 +275,35 @@ static BITMAP *get_packed(FILE *p, int w, int h, int flags)
         return NULL;
     DEBUG((DBG_BITMAPS, "get_packed(%d,%d,%d): reading packed glyph\n",
         w, h, flags));
+    /* the bitmap starts out white, so only black runs are painted */
+    rowptr = bm->data;
     while(row < h) {
         int    i = 0;
-        
-        count = pk_packed_num(p, &pkr, &i);
+
+        count = pk_packed_num(&pkr, &i);
+        if(pkr.eof || count < 0)
+            break;
         if(i > 0) {
             if(repeat_count)
                 fprintf(stderr, "second repeat count for this row (had %d and got %d)\n",
                     repeat_count, i);
             repeat_count = i;
         }
-        
+
         if(count >= inrow) {
-            Uchar    *r, *t;
             BmUnit    *a, mask;
-            
+
             /* first finish current row */
             if(paint)
-                bitmap_set_row(bm, row, w - inrow, inrow, paint);
+                PAINT_RUN(rowptr, w - inrow, inrow);
             /* now copy it as many times as required */
-            r = (Uchar *)bm->data + row * bm->stride;
+            if(repeat_count >= h - row)
+                break;
             while(repeat_count-- > 0) {
-                t = r + bm->stride;
+                a = bm_offset(rowptr, bm->stride);
                 /* copy entire lines */
-                memcpy(t, r, bm->stride);
-                r = t;
+                memcpy(a, rowptr, bm->stride);
+                rowptr = a;
                 row++;
             }
             repeat_count = 0;
@@ -282,26 +311,33 @@ static BITMAP *get_packed(FILE *p, int w, int h, int flags)
             row++;
             /* update run count */
             count -= inrow;
-            /* now r points to the beginning of the last row we finished */
+            /* now rowptr points to the last row we finished */
+            rowptr = bm_offset(rowptr, bm->stride);
+            if(count / w > h - row)
+                break;
+            /* deal with entirely with/black rows */
             if(paint)
                 mask = ~((BmUnit)0);
             else
                 mask = 0;
-            /* goto next row */
-            a = (BmUnit *)(r + bm->stride);
-            /* deal with entirely with/black rows */
             while(count >= w) {
                 /* count number of atoms in a row */
+                a = rowptr;
                 i = ROUND(w, BITMAP_BITS);
                 while(i-- > 0)
                     *a++ = mask;
+                rowptr = bm_offset(rowptr, bm->stride);
                 count -= w;
                 row++;
             }
             inrow = w;
         }
-        if(count > 0)
-            bitmap_set_row(bm, row, w - inrow, count, paint);
+        if(count > 0) {
+            if(row >= h)
+                break;
+            if(paint)
+                PAINT_RUN(rowptr, w - inrow, count);
+        }
         inrow -= count;
         paint = !paint;
     }
@@ -313,13 +349,46 @@ static BITMAP *get_packed(FILE *p, int w, int h, int flags)
     return bm;
 }
 
-static BITMAP *get_char(FILE *p, int w, int h, int flags)
+static BITMAP *get_char(const Uchar *p, const Uchar *end,
+    int w, int h, int flags)
 {
     /* check if dyn_f == 14 */
     if(((flags >> 4) & 0xf) == 14)
-        return get_bitmap(p, w, h, flags);
+        return get_bitmap(p, end, w, h, flags);
     else
-        return get_packed(p, w, h, flags);
+        return get_packed(p, end, w, h, flags);
+}
+
+static PkImage *pk_read_image(FILE *in)
+{
+    PkImage    *img;
+    long    length;
+
+    if(fseek(in, (long)0, SEEK_END) == -1 ||
+       (length = ftell(in)) < 0 ||
+       fseek(in, (long)0, SEEK_SET) == -1)
+        return NULL;
+    img = xalloc(PkImage);
+    img->data = mdvi_malloc(length + PK_PAD);
+    if(fread(img->data, 1, length, in) != (size_t)length) {
+        mdvi_free(img->data);
+        mdvi_free(img);
+        return NULL;
+    }
+    memset(img->data + length, 0, PK_PAD);
+    img->length = length;
+    return img;
+}
+
+static void pk_free_data(DviFont *font)
+{
+    PkImage    *img = (PkImage *)font->private;
+
+    if(img == NULL)
+        return;
+    mdvi_free(img->data);
+    mdvi_free(img);
+    font->private = NULL;
 }
 
 /* supports any number of characters in a font */
@@ -329,87 +398,95 @@ static int pk_load_font(DviParams *unused, DviFont *font)
     int    flag_byte;
     int    hic, maxch;
     Int32    checksum;
-    FILE    *p;
+    PkImage    *img;
+    Uchar    *p, *end;
 #ifndef NODEBUG
     char    s[256];
 #endif
     long    alpha, beta, z;
     unsigned int loc;
 
+    pk_free_data(font);
     font->chars = xnalloc(DviFontChar, 256);
-    p = font->in;
     memset(font->chars, 0, 256 * sizeof(DviFontChar));
     for(i = 0; i < 256; i++)
         font->chars[i].offset = 0;
 
+    /* the glyphs will be decoded from here */
+    img = pk_read_image(font->in);
+    if(img == NULL)
+        goto badpk;
+    font->private = img;
+    p = img->data;
+    end = p + img->length;
+
     /* check the preamble */
-    loc = fuget1(p); hic = fuget1(p);
+    if(img->length < 3)
+        goto badpk;
+    loc = muget1(p); hic = muget1(p);
     if(loc != PK_PRE || hic != PK_ID)
         goto badpk;
-    i = fuget1(p);
+    i = muget1(p);
 #ifndef NODEBUG
-    for(loc = 0; loc < i; loc++)
-        s[loc] = fuget1(p);
-    s[loc] = 0;
+    if(i > end - p)
+        goto badpk;
+    memcpy(s, p, i);
+    s[i] = 0;
     DEBUG((DBG_FONTS, "(pk) %s: %s\n", font->fontname, s));
-#else
-    fseek(in, (long)i, SEEK_CUR);
 #endif
+    p += i;
     /* get the design size */
-    font->design = fuget4(p);
+    font->design = muget4(p);
     /* get the checksum */
-    checksum = fuget4(p);
+    checksum = muget4(p);
     if(checksum && font->checksum && font->checksum != checksum) {
         mdvi_warning(_("%s: checksum mismatch (expected %u, got %u)\n"),
                  font->fontname, font->checksum, checksum);
     } else if(!font->checksum)
         font->checksum = checksum;
     /* skip pixel per point ratios */
-    fuget4(p);
-    fuget4(p);
-    if(feof(p))
-        goto badpk;    
+    p += 8;
+    if(p > end)
+        goto badpk;
 
     /* now start reading the font */
     loc = 256; hic = -1; maxch = 256;
-    
+
     /* initialize alpha and beta for TFM width computation */
     TFMPREPARE(font->scale, z, alpha, beta);
 
-    while((flag_byte = fuget1(p)) != PK_POST) {
-        if(feof(p))
-            break;
+    flag_byte = EOF;
+    while(p < end && (flag_byte = muget1(p)) != PK_POST) {
         if(flag_byte >= PK_CMD_START) {
             switch(flag_byte) {
             case PK_X1:
             case PK_X2:
             case PK_X3:
             case PK_X4: {
+                i = MUGETN(p, flag_byte - PK_X1 + 1);
+                if(i < 0 || i > end - p)
+                    goto badpk;
 #ifndef NODEBUG
-                char    *t;
-                int    n;
-                
-                i = fugetn(p, flag_byte - PK_X1 + 1);
-                if(i < 256)
-                    t = &s[0];
-                else
-                    t = mdvi_malloc(i + 1);
-                for(n = 0; n < i; n++)
-                    t[n] = fuget1(p);
-                t[n] = 0;
-                DEBUG((DBG_SPECIAL, "(pk) %s: Special \"%s\"\n",
-                    font->fontname, t));
-                if(t != &s[0])
-                    mdvi_free(t);
-#else
-                i = fugetn(p, flag_byte - PK_X1 + 1);
-                while(i-- > 0)
-                    fuget1(p);
+                {
+                    char    *t;
+
+                    if(i < 256)
+                        t = &s[0];
+                    else
+                        t = mdvi_malloc(i + 1);
+                    memcpy(t, p, i);
+                    t[i] = 0;
+                    DEBUG((DBG_SPECIAL, "(pk) %s: Special \"%s\"\n",
+                        font->fontname, t));
+                    if(t != &s[0])
+                        mdvi_free(t);
+                }
 #endif
+                p += i;
                 break;
             }
             case PK_Y:
-                i = fuget4(p);
+                i = muget4(p);
                 DEBUG((DBG_SPECIAL, "(pk) %s: MF special %u\n",
                     font->fontname, (unsigned)i));
                 break;
@@ -425,49 +502,49 @@ static int pk_load_font(DviParams *unused, DviFont *font)
             int    cc;
             int    w, h;
             int    x, y;
-            int    offset;
+            long    offset;
             long    tfm;
-            
+
             switch(flag_byte & 0x7) {
             case 7:
-                pl = fuget4(p);
-                cc = fuget4(p);
-                offset = ftell(p) + pl;
-                tfm = fuget4(p);
-                fsget4(p); /* skip dx */
-                fsget4(p); /* skip dy */
-                w  = fuget4(p);
-                h  = fuget4(p); 
-                x  = fsget4(p);
-                y  = fsget4(p);
+                pl = muget4(p);
+                cc = muget4(p);
+                offset = (p - img->data) + pl;
+                tfm = muget4(p);
+                p += 8; /* skip dx and dy */
+                w  = muget4(p);
+                h  = muget4(p);
+                x  = msget4(p);
+                y  = msget4(p);
                 break;
             case 4:
             case 5:
-            case 6:                
-                pl = (flag_byte % 4) * 65536 + fuget2(p);
-                cc = fuget1(p);
-                offset = ftell(p) + pl;
-                tfm = fuget3(p);
-                fsget2(p); /* skip dx */
-                           /* dy assumed 0 */
-                w = fuget2(p);
-                h = fuget2(p);
-                x = fsget2(p);
-                y = fsget2(p);
+            case 6:
+                pl = (flag_byte % 4) * 65536 + muget2(p);
+                cc = muget1(p);
+                offset = (p - img->data) + pl;
+                tfm = muget3(p);
+                p += 2; /* skip dx */
+                        /* dy assumed 0 */
+                w = muget2(p);
+                h = muget2(p);
+                x = msget2(p);
+                y = msget2(p);
                 break;
             default:
-                pl = (flag_byte % 4) * 256 + fuget1(p);
-                cc = fuget1(p);
-                offset = ftell(p) + pl;
-                tfm = fuget3(p);
-                fsget1(p); /* skip dx */
-                           /* dy assumed 0 */
-                w = fuget1(p);
-                h = fuget1(p);
-                x = fsget1(p);
-                y = fsget1(p);
+                pl = (flag_byte % 4) * 256 + muget1(p);
+                cc = muget1(p);
+                offset = (p - img->data) + pl;
+                tfm = muget3(p);
+                p += 1; /* skip dx */
+                        /* dy assumed 0 */
+                w = muget1(p);
+                h = muget1(p);
+                x = msget1(p);
+                y = msget1(p);
             }
-            if(feof(p))
+            if(p > end || offset < (p - img->data) ||
+               offset > (long)img->length)
                 break;
 
             /* Although the PK format support bigger char codes,
@@ -477,13 +554,13 @@ static int pk_load_font(DviParams *unused, DviFont *font)
                 mdvi_error (_("%s: unexpected charcode (%d)\n"),
                         font->fontname,cc);
                 goto error;
-            } 
+            }
             if(cc < loc)
                 loc = cc;
             if(cc > hic)
                 hic = cc;
             if(cc > maxch) {
-                font->chars = xresize(font->chars, 
+                font->chars = xresize(font->chars,
                     DviFontChar, cc + 16);
                 for(i = maxch; i < cc + 16; i++)
                     font->chars[i].offset = 0;
@@ -491,7 +568,7 @@ static int pk_load_font(DviParams *unused, DviFont *font)
             }
             font->chars[cc].code = cc;
             font->chars[cc].flags = flag_byte;
-            font->chars[cc].offset = ftell(p);
+            font->chars[cc].offset = p - img->data;
             font->chars[cc].width = w;
             font->chars[cc].height = h;
             font->chars[cc].glyph.data = NULL;
@@ -503,9 +580,13 @@ static int pk_load_font(DviParams *unused, DviFont *font)
             font->chars[cc].glyph.h = h;
             font->chars[cc].grey.data = NULL;
             font->chars[cc].shrunk.data = NULL;
+            font->chars[cc].variants = NULL;
+            font->chars[cc].nvariants = 0;
+            font->chars[cc].hshrink = 0;
+            font->chars[cc].vshrink = 0;
             font->chars[cc].tfmwidth = TFMSCALE(z, tfm, alpha, beta);
             font->chars[cc].loaded = 0;
-            fseek(p, (long)offset, SEEK_SET);
+            p = img->data + offset;
         }
     }
     if(flag_byte != PK_POST) {
@@ -513,8 +594,8 @@ static int pk_load_font(DviParams *unused, DviFont *font)
                font->fontname);
         goto error;
     }
-    while((flag_byte = fuget1(p)) != EOF) {
-        if(flag_byte != PK_NOOP) {
+    while(p < end) {
+        if(*p++ != PK_NOOP) {
             mdvi_error(_("invalid PK file! (junk in postamble)\n"));
             goto error;
         }
@@ -522,18 +603,19 @@ static int pk_load_font(DviParams *unused, DviFont *font)
 
     /* resize font char data */
     if(loc > 0 || hic < maxch-1) {
-        memmove(font->chars, font->chars + loc, 
+        memmove(font->chars, font->chars + loc,
             (hic - loc + 1) * sizeof(DviFontChar));
         font->chars = xresize(font->chars,
             DviFontChar, hic - loc + 1);
     }
     font->loc = loc;
-    font->hic = hic;        
+    font->hic = hic;
     return 0;
 
 badpk:
     mdvi_error(_("%s: File corrupted, or not a PK file\n"), font->fontname);
 error:
+    pk_free_data(font);
     mdvi_free(font->chars);
     font->chars = NULL;
     font->loc = font->hic = 0;
@@ -543,6 +625,7 @@ error:
 static int pk_font_get_glyph(DviParams *params, DviFont *font, int code)
 {
     DviFontChar    *ch;
+    PkImage    *img;
 
     if((ch = FONTCHAR(font, code)) == NULL)
         return -1;
@@ -551,8 +634,6 @@ static int pk_font_get_glyph(DviParams *params, DviFont *font, int code)
         return -1;
     DEBUG((DBG_GLYPHS, "(pk) loading glyph for character %d (%dx%d) in font `%s'\n",
         code, ch->width, ch->height, font->fontname));
-    if(font->in == NULL && font_reopen(font) < 0)
-        return -1;
     if(!ch->width || !ch->height) {
         /* this happens for ` ' (ASCII 32) in some fonts */
         ch->glyph.x = ch->x;
@@ -562,10 +643,10 @@ static int pk_font_get_glyph(DviParams *params, DviFont *font, int code)
         ch->glyph.data = NULL;
         return 0; 
     }
-    if(fseek(font->in, ch->offset, SEEK_SET) == -1)
+    if((img = (PkImage *)font->private) == NULL)
         return -1;
-    ch->glyph.data = get_char(font->in, 
-        ch->width, ch->height, ch->flags);
+    ch->glyph.data = get_char(img->data + ch->offset, 
+        img->data + img->length, ch->width, ch->height, ch->flags);
     if(ch->glyph.data) {
         /* restore original settings */
         ch->glyph.x = ch->x;
@@ -41,6 +41,13 @@
 #include <kpathsea/tex-make.h>
 #include <kpathsea/lib.h>
 
+/* 
+ * kpathsea is not reentrant. This lock serialises all calls into it,
+ * together with the font classes and font maps that drive the lookups.
+ */
+extern void mdvi_lookup_lock __PROTO((void));
+extern void mdvi_lookup_unlock __PROTO((void));
+
 #define ISSP(p)        (*(p) == ' ' || *(p) == '\t')
 #define SKIPSP(p)    while(ISSP(p)) p++
 #define SKIPNSP(p)    while(*(p) && !ISSP(p)) p++
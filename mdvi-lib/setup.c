@@ -16,20 +16,50 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+/* for recursive mutexes */
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "mdvi.h"
 #include "private.h"
 
+static pthread_mutex_t lookup_mutex;
+static pthread_once_t lookup_mutex_once = PTHREAD_ONCE_INIT;
+
+static void lookup_mutex_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    /* font type lookups may go through the font maps, and back */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lookup_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void    mdvi_lookup_lock(void)
+{
+    pthread_once(&lookup_mutex_once, lookup_mutex_init);
+    pthread_mutex_lock(&lookup_mutex);
+}
+
+void    mdvi_lookup_unlock(void)
+{
+    pthread_mutex_unlock(&lookup_mutex);
+}
+
 void    mdvi_init_kpathsea(const char *program, 
     const char *mfmode, const char *font, int dpi,
     const char *texmfcnf)
 {
     const char *p;
 
+    mdvi_lookup_lock();
     /* Stop meaningless output generation. */
     kpse_make_tex_discard_errors = FALSE;
     
@@ -43,5 +73,6 @@ void    mdvi_init_kpathsea(const char *program,
     kpse_set_program_enabled(kpse_ofm_format, 1, kpse_src_compile);
     if (texmfcnf != NULL)
         xputenv("TEXMFCNF", texmfcnf);
+    mdvi_lookup_unlock();
 }
 
@@ -247,8 +247,8 @@ void    epsf_special(DviContext *dvi, char *prefix, char *arg)
     if (file != NULL)
         mdvi_free (special);
 
-    xf = dvi->params.dpi * dvi->params.mag / (72.0 * dvi->params.hshrink);
-    vf = dvi->params.vdpi * dvi->params.mag / (72.0 * dvi->params.vshrink);
+    xf = dvi->params.dpi * dvi->params.mag / (72.0 * MDVI_HSHRINK(&dvi->params));
+    vf = dvi->params.vdpi * dvi->params.mag / (72.0 * MDVI_VSHRINK(&dvi->params));
     w = FROUND(box.bw * xf);
     h = FROUND(box.bh * vf);
     x = FROUND(box.ox * xf) + dvi->pos.hh;
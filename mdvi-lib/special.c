@@ -18,6 +18,7 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "mdvi.h"
 #include "private.h"
@@ -40,6 +41,8 @@ typedef struct _DviSpecial {
 } DviSpecial;
     
 static ListHead specials = {NULL, NULL, 0};
+/* handlers are called without holding this */
+static pthread_mutex_t specials_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define SPECIAL(x)    \
     void x __PROTO((DviContext *, const char *, const char *))
@@ -60,6 +63,9 @@ static struct {
 #define NSPECIALS    (sizeof(builtins) / sizeof(builtins[0]))
 static int registered_builtins = 0;
 
+static int register_special __PROTO((const char *, const char *, 
+    const char *, DviSpecialHandler, int));
+
 static void register_builtin_specials(void)
 {
     int    i;
@@ -67,7 +73,7 @@ static void register_builtin_specials(void)
     ASSERT(registered_builtins == 0);    
     registered_builtins = 1;
     for(i = 0; i < NSPECIALS; i++)
-        mdvi_register_special(
+        register_special(
             builtins[i].label,
             builtins[i].prefix,
             builtins[i].regex,
@@ -87,15 +93,12 @@ static DviSpecial *find_special_prefix(const char *prefix)
     return sp;
 }
 
-int    mdvi_register_special(const char *label, const char *prefix, 
+static int register_special(const char *label, const char *prefix, 
     const char *regex, DviSpecialHandler handler, int replace)
 {
     DviSpecial *sp;
     int    newsp = 0;
 
-    if(!registered_builtins)
-        register_builtin_specials();
-
     sp = find_special_prefix(prefix);
     if(sp == NULL) {
         sp = xalloc(DviSpecial);
@@ -133,19 +136,36 @@ int    mdvi_register_special(const char *label, const char *prefix,
     return 0;
 }
 
+int    mdvi_register_special(const char *label, const char *prefix, 
+    const char *regex, DviSpecialHandler handler, int replace)
+{
+    int    status;
+
+    pthread_mutex_lock(&specials_mutex);
+    if(!registered_builtins)
+        register_builtin_specials();
+    status = register_special(label, prefix, regex, handler, replace);
+    pthread_mutex_unlock(&specials_mutex);
+    return status;
+}
+
 int    mdvi_unregister_special(const char *prefix)
 {
     DviSpecial *sp;
     
+    pthread_mutex_lock(&specials_mutex);
     sp = find_special_prefix(prefix);    
-    if(sp == NULL)
+    if(sp == NULL) {
+        pthread_mutex_unlock(&specials_mutex);
         return -1;
+    }
+    listh_remove(&specials, LIST(sp));
+    pthread_mutex_unlock(&specials_mutex);
     mdvi_free(sp->prefix);
 #ifdef WITH_REGEX_SPECIALS
     if(sp->has_reg)
         regfree(&sp->reg);
 #endif
-    listh_remove(&specials, LIST(sp));
     mdvi_free(sp);
     return 0;
 }
@@ -157,9 +177,7 @@ int    mdvi_do_special(DviContext *dvi, char *string)
     char    *prefix;
     char     *ptr;    
     DviSpecial *sp;
-
-    if(!registered_builtins) {
-    }
+    DviSpecialHandler handler;
 
     if(!string || !*string)
         return 0;
@@ -172,6 +190,7 @@ int    mdvi_do_special(DviContext *dvi, char *string)
     
     /* now try to find a match */
     ptr = string;
+    pthread_mutex_lock(&specials_mutex);
     for(sp = (DviSpecial *)specials.head; sp; sp = sp->next) {
 #ifdef WITH_REGEX_SPECIALS
         if(sp->has_reg && !regexec(&sp->reg, ptr, 0, 0, 0))
@@ -185,9 +204,11 @@ int    mdvi_do_special(DviContext *dvi, char *string)
     }
 
     if(sp == NULL) {
+        pthread_mutex_unlock(&specials_mutex);
         DEBUG((DBG_SPECIAL, "None found\n"));
         return -1;
     }
+    handler = sp->handler;
 
     /* extract the prefix */
     if(ptr == string) {
@@ -202,9 +223,10 @@ int    mdvi_do_special(DviContext *dvi, char *string)
             "PREFIX match with `%s' (prefix `%s', arg `%s')\n",
             sp->label, prefix, ptr));
     }
+    pthread_mutex_unlock(&specials_mutex);
 
     /* invoke the handler */
-    sp->handler(dvi, prefix, ptr);
+    handler(dvi, prefix, ptr);
 
     return 0;
 }
@@ -213,7 +235,7 @@ void    mdvi_flush_specials(void)
 {
     DviSpecial *sp, *list;
     
-    
+    pthread_mutex_lock(&specials_mutex);
     for(list = (DviSpecial *)specials.head; (sp = list); ) {
         list = sp->next;
         if(sp->prefix) mdvi_free(sp->prefix);
@@ -227,6 +249,7 @@ void    mdvi_flush_specials(void)
     specials.head = NULL;
     specials.tail = NULL;
     specials.count = 0;
+    pthread_mutex_unlock(&specials_mutex);
 }
 
 /* some builtin specials */
@@ -424,6 +424,10 @@ static int t1_load_font(DviParams *params, DviFont *font)
         font->chars[i].glyph.data = NULL;
         font->chars[i].shrunk.data = NULL;
         font->chars[i].grey.data = NULL;
+        font->chars[i].variants = NULL;
+        font->chars[i].nvariants = 0;
+        font->chars[i].hshrink = 0;
+        font->chars[i].vshrink = 0;
     }
     
     return 0;
@@ -462,8 +466,8 @@ static void t1_font_shrink_glyph(DviContext *dvi, DviFont *font, DviFontChar *ch
         ch->code, font->fontname, ch->width, ch->height));    
     size = (double)font->scale / (dvi->params.tfm_conv * 0x100000);
     size = 72.0 * size / 72.27;
-    matrix.cxx = 1.0/(double)dvi->params.hshrink;
-    matrix.cyy = 1.0/(double)dvi->params.vshrink;
+    matrix.cxx = 1.0/MDVI_HSHRINK(&dvi->params);
+    matrix.cyy = 1.0/MDVI_VSHRINK(&dvi->params);
     matrix.cxy = 0.0;
     matrix.cyx = 0.0;
     glyph = T1_SetChar(info->t1id, ch->code, (float)size, &matrix);
@@ -76,12 +76,12 @@ DviFontInfo afm_font_info = {
 /* 
  * Although it does not seem that way, this conversion is independent of the
  * shrinking factors, within roundoff (that's because `conv' and `vconv'
- * have already been scaled by hshrink and vshrink, repsectively). We
+ * have already been scaled by the real shrinking factors). We
  * should really use `dviconv' and `dvivconv', but I'm not so sure those
  * should be moved to the DviParams structure.
  */
-#define XCONV(x)    FROUND(params->conv * (x) * params->hshrink)
-#define YCONV(y)    FROUND(params->vconv * (y) * params->vshrink)
+#define XCONV(x)    FROUND(params->conv * (x) * MDVI_HSHRINK(params))
+#define YCONV(y)    FROUND(params->vconv * (y) * MDVI_VSHRINK(params))
 
 /* this is used quite often in several places, so I made it standalone */
 int    get_tfm_chars(DviParams *params, DviFont *font, TFMInfo *info, int loaded)
@@ -134,6 +134,10 @@ int    get_tfm_chars(DviParams *params, DviFont *font, TFMInfo *info, int loaded
         ch->glyph.data  = NULL;
         ch->grey.data   = NULL;
         ch->shrunk.data = NULL;
+        ch->variants    = NULL;
+        ch->nvariants   = 0;
+        ch->hshrink     = 0;
+        ch->vshrink     = 0;
         ch->loaded      = loaded;
     }
 
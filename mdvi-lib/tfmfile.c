@@ -23,6 +23,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "mdvi.h"
 #include "private.h"
@@ -43,6 +44,7 @@ typedef struct tfmpool {
 
 static ListHead    tfmpool = {NULL, NULL, 0};
 static DviHashTable tfmhash;
+static pthread_mutex_t tfmpool_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define TFM_HASH_SIZE    31
 
@@ -595,6 +597,7 @@ char    *lookup_font_metrics(const char *name, int *type)
 {
     char    *file;
     
+    mdvi_lookup_lock();
     switch(*type) {
 #ifndef WITH_AFM_FILES
         case DviFontAny:
@@ -627,8 +630,10 @@ char    *lookup_font_metrics(const char *name, int *type)
             break;
 #endif
         default:
-            return NULL;
+            file = NULL;
+            break;
     }
+    mdvi_lookup_unlock();
 
     return file;
 }
@@ -649,9 +654,11 @@ char    *lookup_font_metrics(const char *name, int *type)
 TFMInfo    *get_font_metrics(const char *short_name, int type, const char *filename)
 {
     TFMPool *tfm = NULL;
+    TFMPool *old;
     int    status;
     char    *file;
     
+    pthread_mutex_lock(&tfmpool_mutex);
     if(tfmpool.count) {
         tfm = (TFMPool *)mdvi_hash_lookup(&tfmhash, 
             MDVI_KEY(short_name));
@@ -659,9 +666,12 @@ TFMInfo    *get_font_metrics(const char *short_name, int type, const char *filen
             DEBUG((DBG_FONTS, "(mt) reusing metric file `%s' (%d links)\n",
                 short_name, tfm->links));
             tfm->links++;
+            pthread_mutex_unlock(&tfmpool_mutex);
             return &tfm->tfminfo;
         }
     }
+    /* don't hold the pool while we go looking for files */
+    pthread_mutex_unlock(&tfmpool_mutex);
 
     file = filename ? (char *)filename : lookup_font_metrics(short_name, &type);
     if(file == NULL)
@@ -693,6 +703,20 @@ TFMInfo    *get_font_metrics(const char *short_name, int type, const char *filen
     }
     tfm->short_name = mdvi_strdup(short_name);
     
+    pthread_mutex_lock(&tfmpool_mutex);
+    /* someone may have loaded it while we were reading the file */
+    old = NULL;
+    if(tfmpool.count)
+        old = (TFMPool *)mdvi_hash_lookup(&tfmhash, MDVI_KEY(short_name));
+    if(old != NULL) {
+        old->links++;
+        pthread_mutex_unlock(&tfmpool_mutex);
+        mdvi_free(tfm->short_name);
+        mdvi_free(tfm->tfminfo.chars);
+        mdvi_free(tfm);
+        return &old->tfminfo;
+    }
+
     /* add it to the pool */
     if(tfmpool.count == 0)
         mdvi_hash_create(&tfmhash, TFM_HASH_SIZE);
@@ -700,6 +724,7 @@ TFMInfo    *get_font_metrics(const char *short_name, int type, const char *filen
         tfm, MDVI_HASH_UNCHECKED);
     listh_prepend(&tfmpool, LIST(tfm));
     tfm->links = 1;
+    pthread_mutex_unlock(&tfmpool_mutex);
 
     return &tfm->tfminfo;
 }
@@ -708,24 +733,31 @@ void    free_font_metrics(TFMInfo *info)
 {
     TFMPool *tfm;
 
-    if(tfmpool.count == 0)
+    pthread_mutex_lock(&tfmpool_mutex);
+    if(tfmpool.count == 0) {
+        pthread_mutex_unlock(&tfmpool_mutex);
         return;
+    }
     /* get the entry -- can't use the hash table for this, because
      * we don't have the short name */
     for(tfm = (TFMPool *)tfmpool.head; tfm; tfm = tfm->next)
         if(info == &tfm->tfminfo)
             break;
-    if(tfm == NULL)
+    if(tfm == NULL) {
+        pthread_mutex_unlock(&tfmpool_mutex);
         return;
+    }
     if(--tfm->links > 0) {
         DEBUG((DBG_FONTS, "(mt) %s not removed, still in use\n",    
             tfm->short_name));
+        pthread_mutex_unlock(&tfmpool_mutex);
         return;
     }
     mdvi_hash_remove_ptr(&tfmhash, MDVI_KEY(tfm->short_name));
 
     DEBUG((DBG_FONTS, "(mt) removing unused TFM data for `%s'\n", tfm->short_name));
     listh_remove(&tfmpool, LIST(tfm));
+    pthread_mutex_unlock(&tfmpool_mutex);
     mdvi_free(tfm->short_name);
     mdvi_free(tfm->tfminfo.chars);
     mdvi_free(tfm);    
@@ -735,6 +767,7 @@ void    flush_font_metrics(void)
 {
     TFMPool    *ptr;
     
+    pthread_mutex_lock(&tfmpool_mutex);
     for(; (ptr = (TFMPool *)tfmpool.head); ) {
         tfmpool.head = LIST(ptr->next);
         
@@ -743,4 +776,5 @@ void    flush_font_metrics(void)
         mdvi_free(ptr);
     }
     mdvi_hash_reset(&tfmhash, 0);
+    pthread_mutex_unlock(&tfmpool_mutex);
 }
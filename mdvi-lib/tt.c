@@ -318,6 +318,10 @@ static int tt_load_font(DviParams *params, DviFont *font)
         font->chars[i].glyph.data = NULL;
         font->chars[i].shrunk.data = NULL;
         font->chars[i].grey.data = NULL;
+        font->chars[i].variants = NULL;
+        font->chars[i].nvariants = 0;
+        font->chars[i].hshrink = 0;
+        font->chars[i].vshrink = 0;
     }
     
     if(info->fmfname == NULL)
@@ -441,8 +445,8 @@ static void tt_shrink_glyph(DviContext *dvi, DviFont *font, DviFontChar *ch, Dvi
 {
     tt_get_bitmap(&dvi->params, font,
         ch->code,
-        (double)font->hdpi / (dvi->params.dpi * dvi->params.hshrink),
-        (double)font->vdpi / (dvi->params.vdpi * dvi->params.vshrink),
+        (double)font->hdpi / (dvi->params.dpi * MDVI_HSHRINK(&dvi->params)),
+        (double)font->vdpi / (dvi->params.vdpi * MDVI_VSHRINK(&dvi->params)),
         dest);
     /* transform the glyph for the current orientation */
     font_transform_glyph(dvi->params.orientation, dest);
@@ -227,6 +227,7 @@ static int vf_load_font(DviParams *params, DviFont *font)
     font->loc = loc;
     font->hic = hic;
     font->private = macros;
+    font->submap = font_build_map(font->subfonts, &font->submask);
 
     return 0;
     
@@ -243,4 +244,7 @@ error:
 static void vf_free_macros(DviFont *font)
 {
     mdvi_free(font->private);    
+    if(font->submap)
+        mdvi_free(font->submap);
+    font->submap = NULL;
 }
@@ -28,13 +28,12 @@
 #include "cairo-device.h"
 
 #include <zathura/plugin-api.h>
+#include <gio/gio.h>
 
 #include <ctype.h>
 # include <sys/wait.h>
 #include <stdlib.h>
 
-static GMutex dvi_context_mutex;
-
 typedef struct _DviDocument DviDocument;
 
 zathura_error_t 
@@ -82,8 +81,43 @@ enum {
     PROP_TITLE
 };
 
+/* how many pages around the last one rendered are prepared in advance */
+#define DVI_PREFETCH_AHEAD  2
+#define DVI_PREFETCH_BEHIND 1
+
+/* memory for rendered pages, in MiB. With 0, pages are not kept */
+#ifndef DVI_PAGE_CACHE_SIZE
+#define DVI_PAGE_CACHE_SIZE 64
+#endif
+
+/* keep antialiased glyphs under the user's cache directory */
+#ifndef DVI_GLYPH_CACHE
+#define DVI_GLYPH_CACHE 1
+#endif
+
+/* remember where kpathsea found each font, in the same place */
+#ifndef DVI_LOOKUP_CACHE
+#define DVI_LOOKUP_CACHE 1
+#endif
+
+/* everything a rendered page depends on */
+typedef struct {
+    guint page;
+    gdouble scale;
+    Ulong fg;
+    Ulong bg;
+    int orientation;
+    Ulong mtime;
+} DviPageKey;
+
+typedef struct {
+    DviPageKey key;
+    cairo_surface_t *surface;   /* NULL while it is being rendered */
+} DviPageImage;
+
 struct _DviDocument
 {
+    /* the loaded document, pages are rendered on clones of it */
     DviContext *context;
     DviPageSpec *spec;
     DviParams *params;
@@ -93,6 +127,29 @@ struct _DviDocument
     double base_height;
     
     const char* path;
+
+    /* clones of context not currently rendering a page */
+    GQueue idle_contexts;
+    guint n_contexts;
+    guint max_contexts;
+    GMutex pool_mutex;
+    GCond pool_cond;
+
+    /* held for writing while context is reloaded */
+    GRWLock reload_lock;
+
+    /* watches the file, and reads it again in the background */
+    GFileMonitor *monitor;
+    GThreadPool *reload_pool;
+
+    /* renders pages around the current one in the background */
+    GThreadPool *prefetch_pool;
+    gint closing;               /* set when queued prefetches are dropped */
+
+    /* rendered pages, most recently used first */
+    GMutex images_mutex;
+    GQueue images;
+    gsize images_size;
 };
 
 static void
@@ -113,17 +170,440 @@ static void dvi_document_do_color_special (DviContext *dvi,
                                            const char *prefix,
                                            const char *arg);
 
+static void
+dvi_document_drop_contexts (DviDocument *doc)
+{
+    DviContext *dvi;
+
+    g_mutex_lock (&doc->pool_mutex);
+    while ((dvi = g_queue_pop_head (&doc->idle_contexts)) != NULL) {
+        mdvi_cairo_device_free (&dvi->device);
+        mdvi_destroy_context (dvi);
+        doc->n_contexts--;
+    }
+    g_mutex_unlock (&doc->pool_mutex);
+}
+
+static DviContext *
+dvi_document_acquire_context (DviDocument *doc)
+{
+    DviContext *dvi;
+
+    g_mutex_lock (&doc->pool_mutex);
+    while (g_queue_is_empty (&doc->idle_contexts) &&
+           doc->n_contexts >= doc->max_contexts)
+        g_cond_wait (&doc->pool_cond, &doc->pool_mutex);
+
+    dvi = g_queue_pop_head (&doc->idle_contexts);
+    if (dvi == NULL) {
+        dvi = mdvi_clone_context (doc->context);
+        mdvi_cairo_device_init (&dvi->device);
+        doc->n_contexts++;
+    }
+    g_mutex_unlock (&doc->pool_mutex);
+
+    return dvi;
+}
+
+static void
+dvi_document_release_context (DviDocument *doc, DviContext *dvi)
+{
+    g_mutex_lock (&doc->pool_mutex);
+    g_queue_push_head (&doc->idle_contexts, dvi);
+    g_cond_signal (&doc->pool_cond);
+    g_mutex_unlock (&doc->pool_mutex);
+}
+
+static void
+dvi_page_image_free (DviPageImage *image)
+{
+    if (image->surface)
+        cairo_surface_destroy (image->surface);
+    g_free (image);
+}
+
+static gsize
+dvi_page_image_size (DviPageImage *image)
+{
+    if (image->surface == NULL)
+        return 0;
+    return (gsize) cairo_image_surface_get_stride (image->surface) *
+        cairo_image_surface_get_height (image->surface);
+}
+
+static void
+dvi_document_drop_images (DviDocument *doc)
+{
+    DviPageImage *image;
+
+    g_mutex_lock (&doc->images_mutex);
+    while ((image = g_queue_pop_head (&doc->images)) != NULL)
+        dvi_page_image_free (image);
+    doc->images_size = 0;
+    g_mutex_unlock (&doc->images_mutex);
+}
+
+/* 
+ * After a reload, keep the images of the pages that did not change, 
+ * wherever they are now, and drop the rest.
+ */
+static void
+dvi_document_keep_images (DviDocument *doc)
+{
+    DviContext *dvi = doc->context;
+    GHashTable *moved;
+    GList *link, *next;
+    int i;
+
+    moved = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < dvi->npages; i++) {
+        int origin = mdvi_page_origin (dvi, i);
+        if (origin >= 0)
+            g_hash_table_insert (moved, GINT_TO_POINTER (origin + 1),
+                                 GINT_TO_POINTER (i + 1));
+    }
+
+    g_mutex_lock (&doc->images_mutex);
+    for (link = g_queue_peek_head_link (&doc->images); link; link = next) {
+        DviPageImage *image = link->data;
+        gpointer page = g_hash_table_lookup (moved,
+                                             GINT_TO_POINTER (image->key.page + 1));
+
+        next = link->next;
+        /* pages still being rendered are for the old file */
+        if (page && image->surface) {
+            image->key.page = GPOINTER_TO_INT (page) - 1;
+            image->key.mtime = dvi->modtime;
+            continue;
+        }
+        doc->images_size -= dvi_page_image_size (image);
+        g_queue_delete_link (&doc->images, link);
+        dvi_page_image_free (image);
+    }
+    g_mutex_unlock (&doc->images_mutex);
+
+    g_hash_table_destroy (moved);
+}
+
+/* 
+ * Drop the least recently used pages until they fit in the cache size,
+ * prefetched ones too. Must be called with images_mutex held. Pages still
+ * being prefetched take no room yet, so they are kept.
+ */
+static void
+dvi_document_trim_images (DviDocument *doc)
+{
+    DviPageImage *image;
+    GList *link, *prev;
+
+    for (link = g_queue_peek_tail_link (&doc->images);
+         link && doc->images_size > (gsize) DVI_PAGE_CACHE_SIZE << 20;
+         link = prev) {
+        image = link->data;
+        prev = link->prev;
+        if (image->surface == NULL)
+            continue;
+        doc->images_size -= dvi_page_image_size (image);
+        g_queue_delete_link (&doc->images, link);
+        dvi_page_image_free (image);
+    }
+}
+
+/* must be called with images_mutex held */
+static GList *
+dvi_document_find_image (DviDocument *doc, const DviPageKey *key)
+{
+    GList *link;
+
+    for (link = g_queue_peek_head_link (&doc->images); link; link = link->next) {
+        DviPageImage *image = link->data;
+
+        if (memcmp (&image->key, key, sizeof (DviPageKey)) == 0)
+            return link;
+    }
+    return NULL;
+}
+
+/* must be called with the reload lock held */
+static void
+dvi_document_page_key (DviDocument *doc, guint page, gdouble scale,
+                       DviPageKey *key)
+{
+    memset (key, 0, sizeof (DviPageKey));
+    key->page = page;
+    key->scale = scale;
+    key->fg = doc->params->fg;
+    key->bg = doc->params->bg;
+    key->orientation = doc->params->orientation;
+    key->mtime = doc->context->modtime;
+}
+
+/* 
+ * Store the image of a page. If the page was reserved by 
+ * dvi_document_reserve_image, it must still be there.
+ */
+static void
+dvi_document_store_image (DviDocument *doc, const DviPageKey *key,
+                          cairo_surface_t *surface, gboolean reserved)
+{
+    DviPageImage *image = NULL;
+    GList *link;
+
+    g_mutex_lock (&doc->images_mutex);
+    link = dvi_document_find_image (doc, key);
+    if (link && ((DviPageImage *) link->data)->surface == NULL) {
+        image = link->data;
+    } else if (link == NULL && !reserved) {
+        image = g_new0 (DviPageImage, 1);
+        memcpy (&image->key, key, sizeof (DviPageKey));
+        g_queue_push_head (&doc->images, image);
+    }
+    if (image) {
+        image->surface = cairo_surface_reference (surface);
+        doc->images_size += dvi_page_image_size (image);
+        dvi_document_trim_images (doc);
+    }
+    g_mutex_unlock (&doc->images_mutex);
+}
+
+/* make an empty entry for a page, unless it is already there */
+static gboolean
+dvi_document_reserve_image (DviDocument *doc, const DviPageKey *key)
+{
+    DviPageImage *image;
+
+    g_mutex_lock (&doc->images_mutex);
+    if (dvi_document_find_image (doc, key) != NULL) {
+        g_mutex_unlock (&doc->images_mutex);
+        return FALSE;
+    }
+    image = g_new0 (DviPageImage, 1);
+    memcpy (&image->key, key, sizeof (DviPageKey));
+    g_queue_push_head (&doc->images, image);
+    dvi_document_trim_images (doc);
+    g_mutex_unlock (&doc->images_mutex);
+
+    return TRUE;
+}
+
+/* returns a new reference to the image of a page, if we have it */
+static cairo_surface_t *
+dvi_document_lookup_image (DviDocument *doc, const DviPageKey *key)
+{
+    cairo_surface_t *surface = NULL;
+    GList *link;
+
+    g_mutex_lock (&doc->images_mutex);
+    link = dvi_document_find_image (doc, key);
+    if (link && ((DviPageImage *) link->data)->surface) {
+        surface = cairo_surface_reference (((DviPageImage *) link->data)->surface);
+        g_queue_unlink (&doc->images, link);
+        g_queue_push_head_link (&doc->images, link);
+    }
+    g_mutex_unlock (&doc->images_mutex);
+
+    return surface;
+}
+
+/* 
+ * Switch to a context prepared by mdvi_reload_prepare, clones have to go 
+ * with the old one. Must be called with the reload lock held for writing.
+ */
+static void
+dvi_document_finish_reload (DviDocument *doc, DviContext *newdvi)
+{
+    DviContext *dvi = doc->context;
+    int page_w = dvi->dvi_page_w;
+    int page_h = dvi->dvi_page_h;
+    double conv = dvi->dviconv;
+    double vconv = dvi->dvivconv;
+
+    dvi_document_drop_contexts (doc);
+    /* images of unchanged pages are still good if the paper is */
+    if (mdvi_reload_finish (dvi, newdvi) == 0 &&
+        dvi->dvi_page_w == page_w && dvi->dvi_page_h == page_h &&
+        dvi->dviconv == conv && dvi->dvivconv == vconv)
+        dvi_document_keep_images (doc);
+    else
+        dvi_document_drop_images (doc);
+}
+
+/* reload the document if it changed on disk, unless the monitor does it */
+static void
+dvi_document_check_reload (DviDocument *doc)
+{
+    DviContext *newdvi;
+
+    if (doc->monitor != NULL || !mdvi_file_changed (doc->context))
+        return;
+
+    g_rw_lock_writer_lock (&doc->reload_lock);
+    if (mdvi_file_changed (doc->context)) {
+        newdvi = mdvi_reload_prepare (doc->context, &doc->context->params);
+        if (newdvi)
+            dvi_document_finish_reload (doc, newdvi);
+    }
+    g_rw_lock_writer_unlock (&doc->reload_lock);
+}
+
+/* 
+ * Runs on reload_pool: read the file again while the old one is still
+ * used to render pages, and only stop them to switch over. If TeX is not
+ * done writing, this fails, and we wait for the next change.
+ */
+static void
+dvi_document_reload (gpointer data, gpointer user_data)
+{
+    DviDocument *doc = user_data;
+    DviContext *newdvi;
+
+    g_rw_lock_reader_lock (&doc->reload_lock);
+    newdvi = mdvi_reload_prepare (doc->context, &doc->context->params);
+    g_rw_lock_reader_unlock (&doc->reload_lock);
+    if (newdvi == NULL)
+        return;
+
+    g_rw_lock_writer_lock (&doc->reload_lock);
+    dvi_document_finish_reload (doc, newdvi);
+    g_rw_lock_writer_unlock (&doc->reload_lock);
+}
+
+static void
+dvi_document_file_changed (GFileMonitor *monitor, GFile *file, GFile *other,
+                           GFileMonitorEvent event, gpointer user_data)
+{
+    DviDocument *doc = user_data;
+
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED)
+        return;
+    /* one more reload after the one queued would find nothing new */
+    if (g_thread_pool_unprocessed (doc->reload_pool) == 0)
+        g_thread_pool_push (doc->reload_pool, GINT_TO_POINTER (1), NULL);
+}
+
+/* render a page with the current user transformation scaled by scale */
+static void
+dvi_document_render_page (DviDocument *doc, guint index, gdouble scale,
+                          cairo_t *cairo)
+{
+    DviContext *dvi = dvi_document_acquire_context (doc);
+
+    mdvi_setpage (dvi, index);
+
+    /* rasterize straight at the size the page is shown at */
+    mdvi_set_scale (dvi, scale, scale);
+   
+    /* calculate sizes */
+    unsigned int page_width  = ceil(scale * doc->base_width);
+    unsigned int page_height = ceil(scale * doc->base_height);
+
+    unsigned int proposed_width =  dvi->dvi_page_w * dvi->params.conv;
+    unsigned int proposed_height = dvi->dvi_page_h * dvi->params.vconv;
+
+    unsigned int xmargin = 0;
+    unsigned int ymargin = 0;
+
+    if (page_width >= proposed_width)
+        xmargin = (page_width - proposed_width) / 2;
+    if (page_height >= proposed_height)
+        ymargin = (page_height - proposed_height) / 2;
+        
+    mdvi_cairo_device_set_margins (&dvi->device, xmargin, ymargin);
+    /* undo the zoom zathura applied, so glyphs land on device pixels */
+    mdvi_cairo_device_set_scale (&dvi->device, 1.0/scale, 1.0/scale);
+    mdvi_cairo_device_render (dvi, cairo);
+
+    dvi_document_release_context (doc, dvi);
+}
+
+/* render a page to a new image, the same way zathura would */
+static cairo_surface_t *
+dvi_document_render_image (DviDocument *doc, guint index, gdouble scale)
+{
+    cairo_surface_t *surface;
+    cairo_t *cairo;
+
+    surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                          ceil (scale * doc->base_width),
+                                          ceil (scale * doc->base_height));
+    cairo = cairo_create (surface);
+    cairo_scale (cairo, scale, scale);
+    dvi_document_render_page (doc, index, scale, cairo);
+    cairo_destroy (cairo);
+
+    return surface;
+}
+
+/* 
+ * Runs on prefetch_pool: render a page so that the glyphs it needs are 
+ * decoded and the page is ready when it is asked for.
+ */
+static void
+dvi_document_prefetch (gpointer data, gpointer user_data)
+{
+    DviPageKey *key = data;
+    DviDocument *doc = user_data;
+    cairo_surface_t *surface;
+
+    if (g_atomic_int_get (&doc->closing)) {
+        g_free (key);
+        return;
+    }
+
+    g_rw_lock_reader_lock (&doc->reload_lock);
+    /* the file may have been reloaded since the job was queued */
+    if (key->mtime == doc->context->modtime) {
+        surface = dvi_document_render_image (doc, key->page, key->scale);
+        dvi_document_store_image (doc, key, surface, TRUE);
+        cairo_surface_destroy (surface);
+    }
+    g_rw_lock_reader_unlock (&doc->reload_lock);
+
+    g_free (key);
+}
+
+/* must be called with the reload lock held */
+static void
+dvi_document_schedule_prefetch (DviDocument *doc, guint page, gdouble scale)
+{
+    DviPageKey *key;
+
+    if (page >= (guint) doc->context->npages)
+        return;
+
+    key = g_new (DviPageKey, 1);
+    dvi_document_page_key (doc, page, scale, key);
+    if (dvi_document_reserve_image (doc, key))
+        g_thread_pool_push (doc->prefetch_pool, key, NULL);
+    else
+        g_free (key);
+}
+
 static void dvi_document_free (DviDocument *doc)
 {
     if (!doc)
         return; 
 
-    g_mutex_lock (&dvi_context_mutex);
+    /* wait for the page being prefetched, the rest just free their keys */
+    g_atomic_int_set (&doc->closing, TRUE);
+    if (doc->prefetch_pool)
+        g_thread_pool_free (doc->prefetch_pool, FALSE, TRUE);
+    /* same for reloads, once no more can be queued */
+    if (doc->monitor) {
+        g_signal_handlers_disconnect_by_data (doc->monitor, doc);
+        g_file_monitor_cancel (doc->monitor);
+        g_object_unref (doc->monitor);
+    }
+    if (doc->reload_pool)
+        g_thread_pool_free (doc->reload_pool, TRUE, TRUE);
+    dvi_document_drop_images (doc);
+    dvi_document_drop_contexts (doc);
+
     if (doc->context) {
         mdvi_cairo_device_free (&doc->context->device);
         mdvi_destroy_context (doc->context);
     }
-    g_mutex_unlock (&dvi_context_mutex);
 
     if (doc->params)
         g_free (doc->params);
@@ -131,32 +611,80 @@ static void dvi_document_free (DviDocument *doc)
     if (doc->spec)
         g_free (doc->spec);
 
+    g_mutex_clear (&doc->pool_mutex);
+    g_cond_clear (&doc->pool_cond);
+    g_rw_lock_clear (&doc->reload_lock);
+    g_mutex_clear (&doc->images_mutex);
+
     g_free (doc);
 }
 
+/* kpathsea, specials and font types are set up once for all documents */
+static void
+dvi_plugin_init (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter (&initialized)) {
+        gchar *texmfcnf = get_texmfcnf();
+        mdvi_init_kpathsea ("zathura", MDVI_MFMODE, MDVI_FALLBACK_FONT, MDVI_DPI, texmfcnf);
+        g_free(texmfcnf);
+
+        mdvi_register_special ("Color", "color", NULL, dvi_document_do_color_special, 1);
+        mdvi_register_fonts ();
+
+        if (DVI_GLYPH_CACHE) {
+            gchar *dir = g_build_filename (g_get_user_cache_dir (),
+                                           "zathura-dvi", "glyphs", NULL);
+            if (g_mkdir_with_parents (dir, 0700) == 0)
+                mdvi_set_glyph_cache_dir (dir);
+            g_free (dir);
+        }
+
+        if (DVI_LOOKUP_CACHE) {
+            gchar *dir = g_build_filename (g_get_user_cache_dir (),
+                                           "zathura-dvi", NULL);
+            if (g_mkdir_with_parents (dir, 0700) == 0) {
+                gchar *file = g_build_filename (dir, "fonts", NULL);
+                mdvi_set_lookup_cache (file);
+                g_free (file);
+            }
+            g_free (dir);
+        }
+
+        g_once_init_leave (&initialized, 1);
+    }
+}
+
 
 zathura_error_t
 plugin_document_open (zathura_document_t *document)
 {
-    gchar *texmfcnf = get_texmfcnf();
-    mdvi_init_kpathsea ("zathura", MDVI_MFMODE, MDVI_FALLBACK_FONT, MDVI_DPI, texmfcnf);
-    g_free(texmfcnf);
-
-    mdvi_register_special ("Color", "color", NULL, dvi_document_do_color_special, 1);
-    mdvi_register_fonts ();
+    dvi_plugin_init ();
 
     DviDocument *dvi_document = g_new0 (DviDocument, 1);
 
     dvi_document->context = NULL;
     dvi_document_init_params (dvi_document);
 
+    g_queue_init (&dvi_document->idle_contexts);
+    g_mutex_init (&dvi_document->pool_mutex);
+    g_cond_init (&dvi_document->pool_cond);
+    g_rw_lock_init (&dvi_document->reload_lock);
+    dvi_document->n_contexts = 0;
+    dvi_document->max_contexts = MAX (g_get_num_processors (), 1);
+    g_queue_init (&dvi_document->images);
+    g_mutex_init (&dvi_document->images_mutex);
+    dvi_document->images_size = 0;
+    dvi_document->prefetch_pool = g_thread_pool_new (dvi_document_prefetch,
+                                                     dvi_document, 1,
+                                                     FALSE, NULL);
+
     const char* path = zathura_document_get_path(document);
 
-    g_mutex_lock (&dvi_context_mutex);
     dvi_document->context = mdvi_init_context(dvi_document->params, 
                                               dvi_document->spec, 
                                               path);
-    g_mutex_unlock (&dvi_context_mutex);
 
     if (!dvi_document->context) {
         dvi_document_free (dvi_document);
@@ -165,6 +693,19 @@ plugin_document_open (zathura_document_t *document)
 
     zathura_document_set_data(document, dvi_document);
 
+    /* without a monitor, pages check the file when they are rendered */
+    dvi_document->reload_pool = g_thread_pool_new (dvi_document_reload,
+                                                   dvi_document, 1,
+                                                   FALSE, NULL);
+    GFile *file = g_file_new_for_path (dvi_document->context->filename);
+    dvi_document->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE,
+                                                 NULL, NULL);
+    g_object_unref (file);
+    if (dvi_document->monitor)
+        g_signal_connect (dvi_document->monitor, "changed",
+                          G_CALLBACK (dvi_document_file_changed),
+                          dvi_document);
+
     zathura_document_set_number_of_pages(document, 
                                          dvi_document->context->npages);
    
@@ -223,42 +764,52 @@ plugin_page_render_cairo(zathura_page_t *page,
     }
 
     DviDocument* dvi_document = zathura_document_get_data (document);
-    
-    g_mutex_lock (&dvi_context_mutex);
-
-    mdvi_setpage (dvi_document->context, 
-                  zathura_page_get_index(page));
-   
-    /* calculate sizes */
-    gdouble scale = zathura_document_get_scale(document);
-
-    unsigned int page_width  = ceil(scale * zathura_page_get_width(page));
-    unsigned int page_height = ceil(scale * zathura_page_get_height(page));
-
-    unsigned int proposed_width =  dvi_document->context->dvi_page_w * dvi_document->context->params.conv;
-    unsigned int proposed_height = dvi_document->context->dvi_page_h * dvi_document->context->params.vconv;
-
-    mdvi_set_shrink (dvi_document->context, 
-                     (int)((dvi_document->params->hshrink - 1) / scale) + 1,
-                     (int)((dvi_document->params->vshrink - 1) / scale) + 1);
-
-    unsigned int xmargin = 0;
-    unsigned int ymargin = 0;
+    guint index = zathura_page_get_index (page);
+    cairo_surface_t *surface;
+    cairo_matrix_t matrix;
+    gdouble scale;
+    DviPageKey key;
+
+    /* the zoom zathura set up, which may not be the document's scale yet */
+    cairo_get_matrix (cairo, &matrix);
+    scale = hypot (matrix.xx, matrix.yx);
+    if (scale <= 0)
+        scale = zathura_document_get_scale (document);
+
+    dvi_document_check_reload (dvi_document);
+
+    g_rw_lock_reader_lock (&dvi_document->reload_lock);
+    dvi_document_page_key (dvi_document, index, scale, &key);
+    /* printing draws straight to the printer, at its own resolution */
+    surface = NULL;
+    if (!printing)
+        surface = dvi_document_lookup_image (dvi_document, &key);
+    if (surface == NULL && DVI_PAGE_CACHE_SIZE > 0 && !printing) {
+        surface = dvi_document_render_image (dvi_document, index, scale);
+        dvi_document_store_image (dvi_document, &key, surface, FALSE);
+    }
+    if (surface) {
+        /* the image is already zoomed, keep the rest of the transform */
+        cairo_save (cairo);
+        cairo_scale (cairo, 1.0 / scale, 1.0 / scale);
+        cairo_set_source_surface (cairo, surface, 0, 0);
+        cairo_paint (cairo);
+        cairo_restore (cairo);
+        cairo_surface_destroy (surface);
+    } else {
+        dvi_document_render_page (dvi_document, index, scale, cairo);
+    }
 
-    if (page_width >= proposed_width)
-        xmargin = (page_width - proposed_width) / 2;
-    if (page_height >= proposed_height)
-        ymargin = (page_height - proposed_height) / 2;
-        
-    mdvi_cairo_device_set_margins (&dvi_document->context->device, 
-                                   xmargin, 
-                                   ymargin);
-    mdvi_cairo_device_set_scale (&dvi_document->context->device, 
-                                 1.0/scale, 
-                                 1.0/scale);
-    mdvi_cairo_device_render (dvi_document->context, cairo);
+    /* get the neighbours ready while the user reads this one */
+    if (!printing) {
+        guint i;
 
-    g_mutex_unlock (&dvi_context_mutex);
+        for (i = 1; i <= DVI_PREFETCH_AHEAD; i++)
+            dvi_document_schedule_prefetch (dvi_document, index + i, scale);
+        for (i = 1; i <= DVI_PREFETCH_BEHIND && i <= index; i++)
+            dvi_document_schedule_prefetch (dvi_document, index - i, scale);
+    }
+    g_rw_lock_reader_unlock (&dvi_document->reload_lock);
 
     return ZATHURA_ERROR_OK;
 }
@@ -273,7 +824,8 @@ dvi_document_init_params (DviDocument *dvi_document)
     dvi_document->params->mag      = MDVI_MAGNIFICATION;
     dvi_document->params->density  = MDVI_DEFAULT_DENSITY;
     dvi_document->params->gamma    = MDVI_DEFAULT_GAMMA;
-    dvi_document->params->flags    = MDVI_PARAM_ANTIALIASED;
+    dvi_document->params->flags    = MDVI_PARAM_ANTIALIASED | MDVI_PARAM_PRELOAD |
+                                     MDVI_PARAM_COPYFILE;
     dvi_document->params->hdrift   = 0;
     dvi_document->params->vdrift   = 0;
     dvi_document->params->hshrink  =  MDVI_SHRINK_FROM_DPI(dvi_document->params->dpi);